@@ -0,0 +1,126 @@
+#pragma once
+
+// Fixed layout binary encoding of a GPS fix, shared by the receiver firmware and the client.
+// Little endian with no padding. Fields are written byte by byte, so the layout doesn't
+// depend on the compiler or the host endianness, and decoding reads straight out of
+// whatever buffer the bytes arrived in.
+//
+//  offset size
+//     0     2  magic "GF"
+//     2     1  version
+//     3     1  flags, see GPS_FRAME_AVAILABLE and GPS_FRAME_KEEPALIVE
+//     4     2  device, tracker id
+//     6     2  reserved, 0
+//     8     4  seq, receiver device table sequence number of the last change
+//    12     4  last_update, receiver millis() of the last packet
+//    16     4  time, hhmmss UTC
+//    20     4  lat, degrees * 1e7
+//    24     4  lng, degrees * 1e7
+//    28     2  rssi, dBm
+//    30     1  sat_count
+//    31     1  reserved, 0
+//
+// A frame with a different version has a different layout, decoders reject it.
+// Version 1 had no device id nor sequence number.
+
+#include <stddef.h>
+#include <stdint.h>
+
+static constexpr uint8_t GPS_FRAME_MAGIC[2] = {'G', 'F'};
+static constexpr uint8_t GPS_FRAME_VERSION = 2;
+static constexpr size_t GPS_FRAME_SIZE = 32;
+
+static constexpr uint8_t GPS_FRAME_AVAILABLE = 0x01; // the tracker has been heard from lately
+static constexpr uint8_t GPS_FRAME_KEEPALIVE = 0x02; // no fix, only keeps a stream alive
+
+typedef struct {
+  int32_t lat_e7, lng_e7;
+  uint32_t seq, last_update, time;
+  int16_t rssi;
+  uint16_t device;
+  uint8_t sat_count, flags;
+} gps_frame_t;
+
+static inline int32_t gps_frame_to_e7(float deg) {
+  const float scaled = deg*1e7f;
+  return (int32_t)(scaled < 0.f ? scaled-0.5f : scaled+0.5f);
+}
+
+static inline double gps_frame_from_e7(int32_t e7) {
+  return (double)e7*1e-7;
+}
+
+static inline void gps_frame_put16(uint8_t* out, uint16_t val) {
+  out[0] = (uint8_t)val;
+  out[1] = (uint8_t)(val >> 8);
+}
+
+static inline void gps_frame_put32(uint8_t* out, uint32_t val) {
+  out[0] = (uint8_t)val;
+  out[1] = (uint8_t)(val >> 8);
+  out[2] = (uint8_t)(val >> 16);
+  out[3] = (uint8_t)(val >> 24);
+}
+
+static inline uint16_t gps_frame_get16(const uint8_t* in) {
+  return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static inline uint32_t gps_frame_get32(const uint8_t* in) {
+  return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) |
+         ((uint32_t)in[3] << 24);
+}
+
+// Writes GPS_FRAME_SIZE bytes to `out`
+static inline void gps_frame_encode(const gps_frame_t& frame, uint8_t* out) {
+  out[0] = GPS_FRAME_MAGIC[0];
+  out[1] = GPS_FRAME_MAGIC[1];
+  out[2] = GPS_FRAME_VERSION;
+  out[3] = frame.flags;
+  gps_frame_put16(out+4, frame.device);
+  gps_frame_put16(out+6, 0);
+  gps_frame_put32(out+8, frame.seq);
+  gps_frame_put32(out+12, frame.last_update);
+  gps_frame_put32(out+16, frame.time);
+  gps_frame_put32(out+20, (uint32_t)frame.lat_e7);
+  gps_frame_put32(out+24, (uint32_t)frame.lng_e7);
+  gps_frame_put16(out+28, (uint16_t)frame.rssi);
+  out[30] = frame.sat_count;
+  out[31] = 0;
+}
+
+// True if `in` starts with a frame header, `len` can be shorter than a whole frame
+static inline bool gps_frame_header(const uint8_t* in, size_t len) {
+  return (len < 1 || in[0] == GPS_FRAME_MAGIC[0]) &&
+         (len < 2 || in[1] == GPS_FRAME_MAGIC[1]) &&
+         (len < 3 || in[2] == GPS_FRAME_VERSION);
+}
+
+// Reads a frame from the first GPS_FRAME_SIZE bytes of `in`, false if there aren't enough
+// bytes or they aren't a frame of this version
+static inline bool gps_frame_decode(const uint8_t* in, size_t len, gps_frame_t& frame) {
+  if (len < GPS_FRAME_SIZE || !gps_frame_header(in, len)) {
+    return false;
+  }
+  frame.flags = in[3];
+  frame.device = gps_frame_get16(in+4);
+  frame.seq = gps_frame_get32(in+8);
+  frame.last_update = gps_frame_get32(in+12);
+  frame.time = gps_frame_get32(in+16);
+  frame.lat_e7 = (int32_t)gps_frame_get32(in+20);
+  frame.lng_e7 = (int32_t)gps_frame_get32(in+24);
+  frame.rssi = (int16_t)gps_frame_get16(in+28);
+  frame.sat_count = in[30];
+  return true;
+}
+
+// Offset of the next byte in `in` that could start a frame, `len` if there's none.
+// Used to resynchronize a stream after garbage
+static inline size_t gps_frame_sync(const uint8_t* in, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (gps_frame_header(in+i, len-i)) {
+      return i;
+    }
+  }
+  return len;
+}
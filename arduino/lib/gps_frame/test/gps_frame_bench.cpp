@@ -0,0 +1,54 @@
+#include "gps_frame.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// Encodes and decodes a batch of frames, prints the time per frame for each step.
+// Usage: gps_frame_bench [iterations]
+int main(int argc, char* argv[]) {
+  const long iterations = argc > 1 ? std::atol(argv[1]) : 10000000L;
+  if (iterations <= 0) {
+    std::fprintf(stderr, "Invalid iteration count\n");
+    return 1;
+  }
+
+  constexpr uint32_t batch = 256u;
+  static uint8_t bufs[batch][GPS_FRAME_SIZE];
+  gps_frame_t frame{};
+  frame.lat_e7 = gps_frame_to_e7(-34.6037f);
+  frame.lng_e7 = gps_frame_to_e7(-58.3816f);
+  frame.time = 120000u;
+  frame.rssi = -80;
+  frame.sat_count = 9u;
+  frame.flags = GPS_FRAME_AVAILABLE;
+
+  using clock = std::chrono::steady_clock;
+  const auto encode_start = clock::now();
+  for (long i = 0; i < iterations; ++i) {
+    frame.seq = static_cast<uint32_t>(i);
+    frame.device = static_cast<uint16_t>(i);
+    gps_frame_encode(frame, bufs[i % batch]);
+  }
+  const auto encode_end = clock::now();
+
+  // Summing the fields keeps the decoder from being optimized away
+  uint64_t sum = 0u;
+  long decoded = 0;
+  for (long i = 0; i < iterations; ++i) {
+    gps_frame_t out{};
+    if (gps_frame_decode(bufs[i % batch], GPS_FRAME_SIZE, out)) {
+      sum += out.seq + out.device + static_cast<uint32_t>(out.lat_e7);
+      ++decoded;
+    }
+  }
+  const auto decode_end = clock::now();
+
+  const auto per_frame = [iterations](clock::duration dur) {
+    return std::chrono::duration<double, std::nano>(dur).count()/static_cast<double>(iterations);
+  };
+  std::printf("gps_frame: %ld frames, encode %.2f ns/frame, decode %.2f ns/frame (%ld ok, %llx)\n",
+              iterations, per_frame(encode_end-encode_start), per_frame(decode_end-encode_end),
+              decoded, static_cast<unsigned long long>(sum));
+  return decoded == iterations ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+#include "gps_frame.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+static gps_frame_t round_trip(const gps_frame_t& frame) {
+  uint8_t buf[GPS_FRAME_SIZE];
+  gps_frame_encode(frame, buf);
+  gps_frame_t out{};
+  CHECK(gps_frame_decode(buf, sizeof(buf), out));
+  return out;
+}
+
+static void check_equal(const gps_frame_t& a, const gps_frame_t& b) {
+  CHECK(a.lat_e7 == b.lat_e7);
+  CHECK(a.lng_e7 == b.lng_e7);
+  CHECK(a.seq == b.seq);
+  CHECK(a.last_update == b.last_update);
+  CHECK(a.time == b.time);
+  CHECK(a.rssi == b.rssi);
+  CHECK(a.device == b.device);
+  CHECK(a.sat_count == b.sat_count);
+  CHECK(a.flags == b.flags);
+}
+
+static void test_round_trip() {
+  gps_frame_t frame{};
+  frame.lat_e7 = gps_frame_to_e7(-34.6037f);
+  frame.lng_e7 = gps_frame_to_e7(-58.3816f);
+  frame.seq = 0xFFFFFFFFu;
+  frame.last_update = 0xFFFFFFFEu;
+  frame.time = 235959u;
+  frame.rssi = -120;
+  frame.device = 0xFFFFu;
+  frame.sat_count = 255u;
+  frame.flags = GPS_FRAME_AVAILABLE;
+  check_equal(round_trip(frame), frame);
+
+  // Ends of the ranges the fields can hold
+  frame.lat_e7 = -900000000;
+  frame.lng_e7 = -1800000000;
+  frame.rssi = INT16_MIN;
+  frame.seq = 0u;
+  check_equal(round_trip(frame), frame);
+  frame.lat_e7 = 900000000;
+  frame.lng_e7 = 1800000000;
+  frame.rssi = INT16_MAX;
+  frame.flags = GPS_FRAME_KEEPALIVE;
+  check_equal(round_trip(frame), frame);
+}
+
+static void test_layout() {
+  gps_frame_t frame{};
+  frame.device = 0x0102u;
+  frame.seq = 0x03040506u;
+  frame.lat_e7 = -1;
+  uint8_t buf[GPS_FRAME_SIZE];
+  std::memset(buf, 0xAA, sizeof(buf));
+  gps_frame_encode(frame, buf);
+  CHECK(buf[0] == 'G' && buf[1] == 'F');
+  CHECK(buf[2] == GPS_FRAME_VERSION);
+  CHECK(buf[4] == 0x02 && buf[5] == 0x01); // little endian
+  CHECK(buf[6] == 0 && buf[7] == 0 && buf[31] == 0);
+  CHECK(buf[8] == 0x06 && buf[11] == 0x03);
+  CHECK(buf[20] == 0xFF && buf[23] == 0xFF);
+}
+
+static void test_rejects() {
+  gps_frame_t frame{};
+  frame.seq = 1u;
+  uint8_t buf[GPS_FRAME_SIZE];
+  gps_frame_encode(frame, buf);
+
+  gps_frame_t out{};
+  CHECK(!gps_frame_decode(buf, GPS_FRAME_SIZE-1, out));
+  CHECK(!gps_frame_decode(buf, 0u, out));
+
+  buf[2] = GPS_FRAME_VERSION-1;
+  CHECK(!gps_frame_decode(buf, sizeof(buf), out));
+  buf[2] = GPS_FRAME_VERSION+1;
+  CHECK(!gps_frame_decode(buf, sizeof(buf), out));
+  buf[2] = GPS_FRAME_VERSION;
+
+  buf[1] = 'X';
+  CHECK(!gps_frame_decode(buf, sizeof(buf), out));
+  buf[1] = GPS_FRAME_MAGIC[1];
+  CHECK(gps_frame_decode(buf, sizeof(buf), out));
+
+  // A prefix of a header still looks like one, the splitter waits for the rest
+  CHECK(gps_frame_header(buf, 1u));
+  CHECK(gps_frame_header(buf, 2u));
+}
+
+static void test_sync() {
+  uint8_t buf[3+GPS_FRAME_SIZE];
+  std::memcpy(buf, "{G}", 3);
+  gps_frame_t frame{};
+  gps_frame_encode(frame, buf+3);
+  CHECK(gps_frame_sync(buf, sizeof(buf)) == 3u);
+  CHECK(gps_frame_sync(buf, 3u) == 3u);
+  CHECK(gps_frame_sync(buf, 0u) == 0u);
+}
+
+static void test_time() {
+  // hhmmss goes through untouched, midnight included
+  const uint32_t times[] = {0u, 1u, 120000u, 235959u};
+  for (uint32_t time : times) {
+    gps_frame_t frame{};
+    frame.time = time;
+    CHECK(round_trip(frame).time == time);
+  }
+
+  // The scaling happens in float, its 24 bit mantissa keeps the e7 value within 64 steps
+  // (6.4e-6 degrees, under a meter) up to 180, hence the 1e-5 tolerance. Rounds away from
+  // zero on both sides
+  CHECK(gps_frame_to_e7(0.f) == 0);
+  CHECK(gps_frame_to_e7(-180.f) == -1800000000);
+  CHECK(gps_frame_to_e7(180.f) == 1800000000);
+  const float degrees[] = {-34.6037f, -58.3816f, 0.5f, 89.9999f, -0.0000001f};
+  for (float deg : degrees) {
+    const double back = gps_frame_from_e7(gps_frame_to_e7(deg));
+    CHECK(std::abs(back - static_cast<double>(deg)) < 1e-5);
+  }
+}
+
+int main() {
+  test_round_trip();
+  test_layout();
+  test_rejects();
+  test_sync();
+  test_time();
+  if (failures) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("gps_frame: all checks passed\n");
+  return 0;
+}
@@ -2,6 +2,7 @@
 #include <LoRa.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266WebServer.h>
+#include <gps_frame.h>
 
 // NodeMCU connections
 #define LORA_MISO 12 // D6
@@ -15,6 +16,16 @@
 
 #define GPS_WAIT_THRESH 60000 // 1 minute
 
+// Trackers remembered at once, the one silent for the longest gets replaced when full
+#define MAX_DEVICES 32
+
+// Server-Sent Events feed at /stream, one "fix" event per accepted packet and every
+// device on connect. /frames streams the same fixes as back to back binary frames
+// (see gps_frame.h)
+#define STREAM_PORT 81
+#define STREAM_MAX_CLIENTS 4
+#define STREAM_HEARTBEAT 15000 // 15 seconds
+
 // #define USE_AP
 #define WIFI_DEBUG
 
@@ -35,19 +46,44 @@ IPAddress subnet {255, 255, 255, 0};
 #endif
 
 
+// Same layout as in lora_gps_send.ino, no padding on either side
 typedef struct {
+  uint16_t device{0}, reserved{0};
   float lat{0.f}, lng{0.f};
   uint32_t sat_c{0}, time{0};
 } gps_data_t;
 
-static struct {
+// Packets from trackers that predate the device id, they show up as device 0
+#define LEGACY_PACKET_SIZE (sizeof(gps_data_t)-4)
+
+typedef struct {
   gps_data_t cache{};
   unsigned long last_update{0};
+  uint32_t seq{0}; // table_seq of the last change
   int rssi{0};
-  bool available{false};
-} gps;
+  bool used{false}, available{false};
+} device_t;
+
+static device_t devices[MAX_DEVICES];
+static uint32_t table_seq = 0;       // bumped on every change to any device
+static device_t* latest = nullptr;   // last device heard from, served at "/"
 
 ESP8266WebServer server{80};
+WiFiServer stream_server{STREAM_PORT};
+
+static struct {
+  WiFiClient client;
+  bool streaming{false}; // request read and headers sent
+  bool binary{false};
+  char request[16]{};    // start of the request line
+  size_t line_len{0}, line_count{0};
+  unsigned long last_write{0};
+} stream_clients[STREAM_MAX_CLIENTS];
+
+// Scratch buffers, responses get written from here instead of building Strings
+static uint8_t frame_buf[GPS_FRAME_SIZE];
+static char json_buf[192];
+static char event_buf[sizeof(json_buf)+32];
 
 static void init_lora() { 
   Serial.println("=> LoRa Receiver");
@@ -90,24 +126,216 @@ void init_server(const char* path, Fun&& f) {
   Serial.println(path);
 }
 
-static String json_encode() {
-  String out = "{";
-  out +="\"available\":";
-  out += String{gps.available};
-  out += ",\"last_update\":";
-  out += String{gps.last_update};
-  out += ",\"rssi\":";
-  out += String{gps.rssi};
-  out += ",\"time\":";
-  out += String{gps.cache.time/100};
-  out += ",\"sat_count\":";
-  out += String{gps.cache.sat_c, 5};
-  out += ",\"lat\":";
-  out += String{gps.cache.lat, 6};
-  out += ",\"lng\":";
-  out += String{gps.cache.lng, 6};
-  out += "}";
-  return out;
+static void init_stream() {
+  stream_server.begin();
+  stream_server.setNoDelay(true);
+
+  Serial.print("Stream: Initialized -> ");
+  Serial.println(STREAM_PORT);
+}
+
+static const char* json_encode(const device_t& dev) {
+  snprintf(json_buf, sizeof(json_buf),
+           "{\"id\":%u,\"seq\":%lu,\"available\":%d,\"last_update\":%lu,\"rssi\":%d,"
+           "\"time\":%lu,\"sat_count\":%lu,\"lat\":%.6f,\"lng\":%.6f}",
+           (unsigned)dev.cache.device, (unsigned long)dev.seq, (int)dev.available,
+           (unsigned long)dev.last_update, dev.rssi, (unsigned long)(dev.cache.time/100),
+           (unsigned long)dev.cache.sat_c, (double)dev.cache.lat, (double)dev.cache.lng);
+  return json_buf;
+}
+
+static const uint8_t* frame_encode(const device_t& dev) {
+  gps_frame_t frame;
+  frame.flags = dev.available ? GPS_FRAME_AVAILABLE : 0;
+  frame.device = dev.cache.device;
+  frame.seq = dev.seq;
+  frame.last_update = (uint32_t)dev.last_update;
+  frame.time = dev.cache.time/100;
+  frame.lat_e7 = gps_frame_to_e7(dev.cache.lat);
+  frame.lng_e7 = gps_frame_to_e7(dev.cache.lng);
+  frame.rssi = (int16_t)dev.rssi;
+  frame.sat_count = (uint8_t)dev.cache.sat_c;
+  gps_frame_encode(frame, frame_buf);
+  return frame_buf;
+}
+
+static const uint8_t* frame_keepalive() {
+  gps_frame_t frame{};
+  frame.flags = GPS_FRAME_KEEPALIVE;
+  frame.seq = table_seq;
+  gps_frame_encode(frame, frame_buf);
+  return frame_buf;
+}
+
+static device_t* device_find(uint16_t id) {
+  for (size_t i = 0; i < MAX_DEVICES; ++i) {
+    if (devices[i].used && devices[i].cache.device == id) {
+      return &devices[i];
+    }
+  }
+  return nullptr;
+}
+
+// Takes a free entry, or the one of the unavailable device silent for the longest
+static device_t* device_add(uint16_t id) {
+  device_t* slot = nullptr;
+  for (size_t i = 0; i < MAX_DEVICES; ++i) {
+    auto& dev = devices[i];
+    if (!dev.used) {
+      slot = &dev;
+      break;
+    }
+    if (!dev.available && (!slot || dev.last_update < slot->last_update)) {
+      slot = &dev;
+    }
+  }
+  if (!slot) {
+    return nullptr;
+  }
+  if (slot->used) {
+    Serial.print("Devices: Replacing device ");
+    Serial.println(slot->cache.device);
+  }
+  if (latest == slot) {
+    latest = nullptr;
+  }
+  *slot = device_t{};
+  slot->used = true;
+  slot->cache.device = id;
+  return slot;
+}
+
+static void device_touch(device_t& dev) {
+  dev.seq = ++table_seq;
+}
+
+// Devices changed after `since`. A `since` ahead of the table means the receiver rebooted
+// since the client last asked, everything gets sent again
+template<typename Fun>
+static void devices_since(uint32_t since, Fun&& fun) {
+  if (since > table_seq) {
+    since = 0;
+  }
+  for (size_t i = 0; i < MAX_DEVICES; ++i) {
+    if (devices[i].used && devices[i].seq > since) {
+      fun(devices[i]);
+    }
+  }
+}
+
+static bool stream_write(size_t i, const uint8_t* data, size_t len) {
+  auto& slot = stream_clients[i];
+  if (slot.client.write(data, len) != len) {
+    Serial.print("Stream: Client dropped -> ");
+    Serial.println(i);
+    slot.client.stop();
+    slot.streaming = false;
+    return false;
+  }
+  slot.last_write = millis();
+  return true;
+}
+
+static bool stream_write(size_t i, const char* data) {
+  return stream_write(i, (const uint8_t*)data, strlen(data));
+}
+
+static bool stream_send_fix(size_t i, const device_t& dev) {
+  if (stream_clients[i].binary) {
+    return stream_write(i, frame_encode(dev), GPS_FRAME_SIZE);
+  }
+  snprintf(event_buf, sizeof(event_buf), "event: fix\ndata: %s\n\n", json_encode(dev));
+  return stream_write(i, event_buf);
+}
+
+// Pushes the state of `dev` to every connected client
+static void stream_broadcast(const device_t& dev) {
+  for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+    if (stream_clients[i].streaming) {
+      stream_send_fix(i, dev);
+    }
+  }
+}
+
+// Accepts new clients, finishes their handshakes and keeps idle ones alive
+static void stream_poll() {
+  WiFiClient incoming = stream_server.available();
+  if (incoming) {
+    size_t i = 0;
+    while (i < STREAM_MAX_CLIENTS && stream_clients[i].client.connected()) {
+      ++i;
+    }
+    if (i == STREAM_MAX_CLIENTS) {
+      incoming.print("HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n");
+      incoming.stop();
+    } else {
+      incoming.setNoDelay(true);
+      stream_clients[i].client = incoming;
+      stream_clients[i].streaming = false;
+      stream_clients[i].binary = false;
+      stream_clients[i].request[0] = '\0';
+      stream_clients[i].line_len = 0;
+      stream_clients[i].line_count = 0;
+    }
+  }
+
+  for (size_t i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+    auto& slot = stream_clients[i];
+    if (!slot.client.connected()) {
+      slot.streaming = false;
+      continue;
+    }
+
+    if (!slot.streaming) {
+      // Skip the request until the empty line, only the path of the first one matters
+      while (slot.client.available()) {
+        char c = (char)slot.client.read();
+        if (c == '\r') {
+          continue;
+        }
+        if (c != '\n') {
+          if (slot.line_count == 0 && slot.line_len < sizeof(slot.request)-1) {
+            slot.request[slot.line_len] = c;
+            slot.request[slot.line_len+1] = '\0';
+          }
+          ++slot.line_len;
+          continue;
+        }
+        if (slot.line_len == 0) {
+          slot.streaming = true;
+          break;
+        }
+        slot.line_len = 0;
+        ++slot.line_count;
+      }
+      if (!slot.streaming) {
+        continue;
+      }
+      slot.binary = strncmp(slot.request, "GET /frames", 11) == 0;
+      const char* headers = slot.binary ? "HTTP/1.1 200 OK\r\n"
+                                          "Content-Type: application/octet-stream\r\n"
+                                          "Cache-Control: no-cache\r\n"
+                                          "Connection: keep-alive\r\n\r\n"
+                                        : "HTTP/1.1 200 OK\r\n"
+                                          "Content-Type: text/event-stream\r\n"
+                                          "Cache-Control: no-cache\r\n"
+                                          "Connection: keep-alive\r\n\r\n";
+      if (stream_write(i, headers)) {
+        Serial.print("Stream: Client connected -> ");
+        Serial.println(i);
+        devices_since(0, [i](const device_t& dev) { stream_send_fix(i, dev); });
+      }
+      continue;
+    }
+
+    if (millis() - slot.last_write > STREAM_HEARTBEAT) {
+      if (slot.binary) {
+        stream_write(i, frame_keepalive(), GPS_FRAME_SIZE);
+      } else {
+        stream_write(i, ":\n\n");
+      }
+    }
+  }
 }
 
 void setup() {
@@ -116,12 +344,54 @@ void setup() {
   
   init_wifi();
   init_lora();
+  // Last device heard from, for clients that only know about one tracker
+  server.on("/frame", []() {
+    if (!latest) {
+      server.send(204);
+      return;
+    }
+    server.send(200, "application/octet-stream", (const char*)frame_encode(*latest),
+                GPS_FRAME_SIZE);
+  });
+  // ?since=<seq> to get only the devices changed after that
+  server.on("/devices", []() {
+    const uint32_t since = strtoul(server.arg("since").c_str(), nullptr, 10);
+    server.chunkedResponseModeStart(200, "text/json");
+    snprintf(json_buf, sizeof(json_buf), "{\"seq\":%lu,\"devices\":[",
+             (unsigned long)table_seq);
+    server.sendContent(json_buf);
+    bool first = true;
+    devices_since(since, [&first](const device_t& dev) {
+      if (!first) {
+        server.sendContent(",");
+      }
+      first = false;
+      server.sendContent(json_encode(dev));
+    });
+    server.sendContent("]}");
+    server.chunkedResponseFinalize();
+  });
+  server.on("/devices.bin", []() {
+    const uint32_t since = strtoul(server.arg("since").c_str(), nullptr, 10);
+    size_t count = 0;
+    devices_since(since, [&count](const device_t&) { ++count; });
+    server.setContentLength(count*GPS_FRAME_SIZE);
+    server.send(200, "application/octet-stream", "");
+    devices_since(since, [](const device_t& dev) {
+      server.sendContent((const char*)frame_encode(dev), GPS_FRAME_SIZE);
+    });
+  });
   init_server("/", []() {
-    String response = json_encode();
+    if (!latest) {
+      server.send(204);
+      return;
+    }
+    const char* response = json_encode(*latest);
     server.send(200, "text/json", response);
     Serial.print("Server: GET response -> ");
     Serial.println(response);
   });
+  init_stream();
 
   pinMode(LED_BUILTIN, OUTPUT);
   
@@ -136,44 +406,66 @@ void setup() {
 }
 
 
-static bool lora_poll() {
+static device_t* lora_poll() {
   int packet_size = LoRa.parsePacket();
   if(!packet_size) {
-    return false;
+    return nullptr;
   }
-  
-  if ((size_t)packet_size != sizeof(gps_data_t)) {
+
+  gps_data_t packet;
+  uint8_t* dst = (uint8_t*)&packet;
+  if ((size_t)packet_size == LEGACY_PACKET_SIZE) {
+    dst += sizeof(gps_data_t)-LEGACY_PACKET_SIZE;
+  } else if ((size_t)packet_size != sizeof(gps_data_t)) {
     Serial.println("Invalid packet received!");
-    return false;
+    return nullptr;
+  }
+  for (int i = 0; i < packet_size; ++i) {
+    dst[i] = (uint8_t)LoRa.read();
   }
 
-  uint8_t buff[sizeof(gps_data_t)];
-  size_t sz = sizeof(gps_data_t);
-  
-  for (size_t i = 0; i < sz; ++i) {
-    buff[i] = (uint8_t)LoRa.read();
+  device_t* dev = device_find(packet.device);
+  if (!dev) {
+    dev = device_add(packet.device);
   }
-  memcpy(&gps.cache, buff, sz);
+  if (!dev) {
+    Serial.println("Devices: Table full, packet dropped");
+    return nullptr;
+  }
+  dev->cache = packet;
+  dev->rssi = LoRa.packetRssi();
 
-  
-  Serial.print("LoRa: Received packet with RSSI ");
-  Serial.println(LoRa.packetRssi());
-  gps.rssi = LoRa.packetRssi();
-  return true;
+  Serial.print("LoRa: Received packet from device ");
+  Serial.print(packet.device);
+  Serial.print(" with RSSI ");
+  Serial.println(dev->rssi);
+  return dev;
 }
 
 void loop() {
-  if (lora_poll()) {
-    if (!gps.available) {
-      digitalWrite(LED_BUILTIN, LOW);
-      gps.available = true; 
+  if (device_t* dev = lora_poll()) {
+    digitalWrite(LED_BUILTIN, LOW);
+    dev->available = true;
+    dev->last_update = millis();
+    device_touch(*dev);
+    latest = dev;
+    stream_broadcast(*dev);
+  }
+
+  bool any_available = false;
+  for (size_t i = 0; i < MAX_DEVICES; ++i) {
+    auto& dev = devices[i];
+    if (dev.available && millis() - dev.last_update > GPS_WAIT_THRESH) {
+      dev.available = false;
+      device_touch(dev);
+      stream_broadcast(dev);
     }
-    gps.last_update = millis();
+    any_available |= dev.available;
   }
-  if (gps.available && millis() - gps.last_update > GPS_WAIT_THRESH) {
+  if (!any_available) {
     digitalWrite(LED_BUILTIN, HIGH);
-    gps.available = false;
   }
-  
+
   server.handleClient();
+  stream_poll();
 }
@@ -13,6 +13,9 @@
 
 #define LORA_SEND_DELAY 2000
 
+// Unique for every tracker talking to the same receiver
+#define DEVICE_ID 1
+
 #define GPS_RX 3
 #define GPS_TX 2
 #define GPS_BAUD 9600
@@ -24,7 +27,9 @@
 TinyGPSPlus gps{};
 SoftwareSerial gps_serial{GPS_TX, GPS_RX};
 
+// Same layout as in lora_gps_recv.ino, no padding on either side
 typedef struct {
+  uint16_t device, reserved;
   float lat, lng;
   uint32_t sat_c, time;
 } gps_data_t;
@@ -115,6 +120,8 @@ void loop() {
 #endif
 
   gps_data_t data {
+    .device = DEVICE_ID,
+    .reserved = 0,
     .lat = gps.location.lat(),
     .lng = gps.location.lng(),
     .sat_c = gps.satellites.value(),
@@ -0,0 +1,72 @@
+#include "spatial_grid.hpp"
+
+#include <chrono>
+#include <random>
+
+// Radius and nearest queries over 40k objects, checked against a brute force scan of every
+// object. Same cell size as the picking grids in main.cpp
+static constexpr size_t object_count = 40000u;
+static constexpr size_t query_count = 20000u;
+static constexpr float world_size = 16384.f; // world units, about 4km across at zoom 19
+static constexpr float cell_size = 64.f;
+
+int main() {
+  using clock = std::chrono::steady_clock;
+  std::minstd_rand rng{1234u};
+  std::uniform_real_distribution<float> coord{0.f, world_size};
+  std::uniform_real_distribution<float> radius{0.f, 8.f};
+  std::uniform_real_distribution<float> query_radius{5.f, 80.f};
+
+  spatial_grid<uint32> grid{cell_size};
+  std::vector<vec2> pos(object_count);
+  std::vector<float> rad(object_count);
+  for (uint32 i = 0u; i < object_count; ++i) {
+    pos[i] = vec2{coord(rng), coord(rng)};
+    rad[i] = radius(rng);
+    grid.insert(pos[i], rad[i], i);
+  }
+
+  std::vector<vec2> centers(query_count);
+  std::vector<float> radii(query_count);
+  for (size_t i = 0u; i < query_count; ++i) {
+    centers[i] = vec2{coord(rng), coord(rng)};
+    radii[i] = query_radius(rng);
+  }
+
+  size_t found = 0u, nearest = 0u;
+  auto start = clock::now();
+  for (size_t i = 0u; i < query_count; ++i) {
+    grid.query_radius(centers[i], radii[i], [&](auto, uint32, vec2) { ++found; });
+    nearest += grid.nearest(centers[i], radii[i]).has_value();
+  }
+  const auto grid_time = clock::now() - start;
+
+  size_t brute_found = 0u, brute_nearest = 0u;
+  start = clock::now();
+  for (size_t i = 0u; i < query_count; ++i) {
+    bool any = false;
+    for (uint32 j = 0u; j < object_count; ++j) {
+      const vec2 diff = pos[j] - centers[i];
+      const float dist = radii[i] + rad[j];
+      if (glm::dot(diff, diff) <= dist*dist) {
+        ++brute_found;
+        any = true;
+      }
+    }
+    brute_nearest += any;
+  }
+  const auto brute_time = clock::now() - start;
+
+  const auto per_query = [](clock::duration time) {
+    return std::chrono::duration<double, std::micro>(time).count()/query_count;
+  };
+  fmt::print("{} objects, {} queries, {} hits\n", object_count, query_count, found);
+  fmt::print("grid:  {:.2f}us per radius + nearest query\n", per_query(grid_time));
+  fmt::print("brute: {:.2f}us per radius query\n", per_query(brute_time));
+  if (found != brute_found || nearest != brute_nearest) {
+    fmt::print("mismatch, grid found {} ({} nearest), brute force {} ({} nearest)\n",
+               found, nearest, brute_found, brute_nearest);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,34 @@
+#version 460 core
+
+in vec2 tex_coord;
+in vec2 pixel;
+flat in float tex_layer;
+out vec4 frag_color;
+
+struct tile_instance {
+  vec2 pos;
+  float scale;
+  float layer;
+};
+
+// Has to match the vertex shader
+layout (std430, binding = 2) readonly buffer tile_instances {
+  vec4 background;
+  vec2 clip_min;
+  vec2 clip_max;
+  mat4 transform;
+  tile_instance instances[];
+};
+
+layout (binding = 0) uniform sampler2DArray u_sampler;
+
+void main() {
+  if (any(lessThan(pixel, clip_min)) || any(greaterThanEqual(pixel, clip_max))) {
+    discard;
+  }
+  if (tex_layer < 0.f) {
+    frag_color = background;
+    return;
+  }
+  frag_color = texture(u_sampler, vec3(tex_coord, tex_layer));
+}
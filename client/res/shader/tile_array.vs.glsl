@@ -0,0 +1,37 @@
+#version 460 core
+
+layout (location = 0) in vec3 att_coords;
+layout (location = 1) in vec3 att_normals;
+layout (location = 2) in vec2 att_texcoords;
+out vec2 tex_coord;
+out vec2 pixel;
+flat out float tex_layer;
+
+struct tile_instance {
+  vec2 pos;
+  float scale;
+  float layer;
+};
+
+// Draws into the map cache or straight on screen, see tile_layer.hpp
+layout (std430, binding = 2) readonly buffer tile_instances {
+  vec4 background;
+  vec2 clip_min;
+  vec2 clip_max;
+  mat4 transform;
+  tile_instance instances[];
+};
+
+void main() {
+  // The first instance fills the clip rect with the background
+  if (gl_InstanceID == 0) {
+    pixel = mix(clip_min, clip_max, att_coords.xy + .5f);
+    tex_layer = -1.f;
+  } else {
+    tile_instance tile = instances[gl_InstanceID-1];
+    pixel = (tile.pos + att_coords.xy*tile.scale)*u_zoom;
+    tex_layer = tile.layer;
+  }
+  gl_Position = transform*vec4(pixel, 0.f, 1.f);
+  tex_coord = att_texcoords;
+}
@@ -0,0 +1,165 @@
+#include "./download_scheduler.hpp"
+
+#include <fstream>
+#include <random>
+
+namespace fs = std::filesystem;
+
+static std::string host_of(std::string_view url) {
+  auto begin = url.find("://");
+  begin = begin == std::string_view::npos ? 0u : begin+3u;
+  const auto end = url.find('/', begin);
+  return std::string{url.substr(begin, end == std::string_view::npos ? end : end-begin)};
+}
+
+// One validator per line, etag first
+static void read_meta(const fs::path& path, std::string& etag, std::string& last_modified) {
+  std::ifstream stream{path};
+  if (stream) {
+    std::getline(stream, etag);
+    std::getline(stream, last_modified);
+  }
+}
+
+static bool write_file(const fs::path& path, std::string_view contents) {
+  std::ofstream stream{path, std::ios::out | std::ios::binary | std::ios::trunc};
+  return stream.write(contents.data(), contents.size()).flush().good();
+}
+
+static void write_meta(const fs::path& path, std::string_view etag,
+                       std::string_view last_modified) {
+  std::error_code err;
+  if (etag.empty() && last_modified.empty()) {
+    fs::remove(path, err);
+    return;
+  }
+  std::ofstream stream{path, std::ios::out | std::ios::trunc};
+  stream << etag << '\n' << last_modified << '\n';
+}
+
+download_scheduler::download_scheduler(net_reactor& reactor, const config_t& config) :
+  _reactor{reactor}, _config{config}, _in_flight{0u}
+{
+  _config.max_in_flight = std::max(_config.max_in_flight, 1u);
+}
+
+bool download_scheduler::is_stale(const fs::path& path) const {
+  std::error_code err;
+  const auto mtime = fs::last_write_time(path, err);
+  if (err) {
+    return false;
+  }
+  return fs::file_time_type::clock::now() - mtime > _config.stale_after;
+}
+
+void download_scheduler::_release() {
+  if (_slot_waiters.empty()) {
+    --_in_flight;
+    return;
+  }
+  // Hand the slot over directly so nobody can sneak in before the waiter resumes
+  const auto handle = _slot_waiters.front();
+  _slot_waiters.pop_front();
+  if (!_reactor.post(handle)) {
+    handle.resume();
+  }
+}
+
+auto download_scheduler::fetch(std::string url, fs::path path) -> net_task<fetch_status> {
+  // Off the reactor thread once it stopped, the maps below are only safe to touch on it
+  if (_reactor.stopping()) {
+    co_return fetch_status::failed;
+  }
+  const auto missing = _missing.find(url);
+  if (missing != _missing.end()) {
+    if (clock::now() < missing->second) {
+      co_return fetch_status::not_found;
+    }
+    _missing.erase(missing);
+  }
+
+  auto meta_path = path;
+  meta_path += ".meta";
+  net_reactor::request_t req{.url = url};
+  if (fs::exists(path)) {
+    std::string etag, last_modified;
+    read_meta(meta_path, etag, last_modified);
+    if (!etag.empty()) {
+      req.headers.emplace_back(fmt::format("If-None-Match: {}", etag));
+    }
+    if (!last_modified.empty()) {
+      req.headers.emplace_back(fmt::format("If-Modified-Since: {}", last_modified));
+    }
+  }
+
+  auto part = path;
+  part += ".part";
+  const auto host = host_of(url);
+  std::error_code err;
+  for (uint32 attempt = 0u; attempt <= _config.max_retries; ++attempt) {
+    auto& next = _next_request[host];
+    const auto slot = std::max(next, clock::now());
+    next = slot + _config.host_interval;
+    if (!co_await _reactor.sleep_until(slot)) {
+      co_return fetch_status::failed;
+    }
+
+    if (_in_flight < _config.max_in_flight) {
+      ++_in_flight;
+    } else {
+      co_await slot_op{*this};
+    }
+    auto res = co_await _reactor.fetch(req);
+    _release();
+    if (res.cancelled) {
+      co_return fetch_status::failed;
+    }
+
+    if (res.code == 200) {
+      if (!write_file(part, res.body)) {
+        logger::error("[download_scheduler] Failed to write \"{}\"", part.c_str());
+        fs::remove(part, err);
+        co_return fetch_status::failed;
+      }
+      fs::rename(part, path, err);
+      if (err) {
+        logger::error("[download_scheduler] Failed to move \"{}\": {}",
+                      path.c_str(), err.message());
+        fs::remove(part, err);
+        co_return fetch_status::failed;
+      }
+      write_meta(meta_path, res.etag, res.last_modified);
+      co_return fetch_status::downloaded;
+    }
+    if (res.code == 304) {
+      fs::last_write_time(path, fs::file_time_type::clock::now(), err);
+      co_return fetch_status::not_modified;
+    }
+    if (res.code == 404 || res.code == 410) {
+      logger::warning("[download_scheduler] \"{}\" not found", url);
+      _missing[url] = clock::now() + _config.negative_ttl;
+      co_return fetch_status::not_found;
+    }
+    const bool transient = res.code == 0 || res.code == 408 || res.code == 429 ||
+                           res.code >= 500;
+    if (!transient) {
+      logger::error("[download_scheduler] \"{}\" returned {}", url, res.code);
+      co_return fetch_status::failed;
+    }
+    if (attempt == _config.max_retries) {
+      break;
+    }
+
+    // Jitter so the transfers that failed together don't retry together
+    static std::minstd_rand rng{std::random_device{}()};
+    const auto base = _config.backoff*(1u << attempt);
+    std::uniform_int_distribution<int64_t> jitter{0, base.count()/2};
+    const auto delay = base + std::chrono::milliseconds{jitter(rng)};
+    logger::warning("[download_scheduler] \"{}\" failed ({}), retry in {}ms",
+                    url, res.code ? fmt::format("{}", res.code) : res.error, delay.count());
+    // Back off the whole host, not just this tile
+    next = std::max(next, clock::now() + delay);
+  }
+  logger::error("[download_scheduler] Giving up on \"{}\"", url);
+  co_return fetch_status::failed;
+}
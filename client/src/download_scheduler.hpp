@@ -0,0 +1,72 @@
+#pragma once
+
+#include "./net_reactor.hpp"
+
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <unordered_map>
+
+// Tile downloads on top of the net_reactor.
+// Bounds the transfers in flight, spaces out requests to the same host, retries transient
+// failures with exponential backoff and remembers 404s for a while.
+// Files are written to a temporary and renamed into place, so a partial download never
+// shows up in the cache. The ETag/Last-Modified of each file are kept in "<file>.meta"
+// and sent back when a stale file gets revalidated.
+//
+// fetch() must be awaited from the reactor thread, the scheduler state is not locked.
+class download_scheduler {
+public:
+  using clock = net_reactor::clock;
+
+  struct config_t {
+    uint32 max_in_flight;                    // transfers at once, over every host
+    std::chrono::milliseconds host_interval; // between request starts on the same host
+    uint32 max_retries;
+    std::chrono::milliseconds backoff;       // first retry delay, doubles on each attempt
+    std::chrono::seconds stale_after;        // cached files older than this get revalidated
+    std::chrono::seconds negative_ttl;       // how long a 404 is remembered
+  };
+
+  enum class fetch_status {
+    downloaded,   // new or changed contents written to the file
+    not_modified, // the cached file is still valid
+    not_found,    // 404/410, or a remembered one
+    failed,
+  };
+
+private:
+  // Suspends until a transfer slot gets released
+  struct slot_op {
+    download_scheduler& self;
+
+    bool await_ready() const noexcept { return self._in_flight < self._config.max_in_flight; }
+    void await_suspend(std::coroutine_handle<> handle) { self._slot_waiters.emplace_back(handle); }
+    void await_resume() const noexcept {}
+  };
+
+public:
+  download_scheduler(net_reactor& reactor, const config_t& config);
+
+  download_scheduler(const download_scheduler&) = delete;
+  download_scheduler& operator=(const download_scheduler&) = delete;
+
+public:
+  // Downloads `url` into `path`, or revalidates it if `path` already exists
+  net_task<fetch_status> fetch(std::string url, std::filesystem::path path);
+
+  // True if `path` exists and is older than config_t::stale_after, thread safe
+  bool is_stale(const std::filesystem::path& path) const;
+
+private:
+  void _release();
+
+private:
+  net_reactor& _reactor;
+  config_t _config;
+
+  uint32 _in_flight;
+  std::deque<std::coroutine_handle<>> _slot_waiters;
+  std::unordered_map<std::string, clock::time_point> _next_request; // per host
+  std::unordered_map<std::string, clock::time_point> _missing;      // url -> expiry
+};
@@ -0,0 +1,362 @@
+#include "./fix_history.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static uint64_t zigzag(int64_t val) {
+  return (static_cast<uint64_t>(val) << 1u) ^ static_cast<uint64_t>(val >> 63);
+}
+
+static int64_t unzigzag(uint64_t val) {
+  return static_cast<int64_t>(val >> 1u) ^ -static_cast<int64_t>(val & 1u);
+}
+
+static void put_varint(std::vector<uint8_t>& out, int64_t val) {
+  uint64_t bits = zigzag(val);
+  while (bits >= 0x80u) {
+    out.emplace_back(static_cast<uint8_t>(bits | 0x80u));
+    bits >>= 7u;
+  }
+  out.emplace_back(static_cast<uint8_t>(bits));
+}
+
+static bool get_varint(const uint8_t*& in, const uint8_t* end, int64_t& val) {
+  uint64_t bits = 0u;
+  for (uint32 shift = 0u; in != end && shift < 64u; shift += 7u) {
+    const uint8_t byte = *in++;
+    bits |= static_cast<uint64_t>(byte & 0x7Fu) << shift;
+    if (!(byte & 0x80u)) {
+      val = unzigzag(bits);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t len) {
+  while (len) {
+    const auto written = ::write(fd, data, len);
+    if (written < 0) {
+      return false;
+    }
+    data += written;
+    len -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+fix_history::segment::~segment() noexcept {
+  if (data) {
+    munmap(const_cast<uint8_t*>(data), mapped);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+fix_history::fix_history(fs::path dir, bool read_only) :
+  _dir{std::move(dir)}, _read_only{read_only}, _decoded{}
+{
+  std::error_code err;
+  if (!fs::exists(_dir)) {
+    if (_read_only) {
+      logger::warning("[fix_history] History directory \"{}\" not found", _dir.c_str());
+      return;
+    }
+    logger::info("[fix_history] Creating history directory \"{}\"", _dir.c_str());
+    if (!fs::create_directories(_dir, err)) {
+      logger::warning("[fix_history] Failed to create history directory: {}", err.message());
+      return;
+    }
+  }
+  uint64_t total = 0u;
+  for (const auto& dir_entry : fs::directory_iterator{_dir, err}) {
+    uint32 device;
+    char ext[8] = {};
+    const auto filename = dir_entry.path().filename().string();
+    if (std::sscanf(filename.c_str(), "device-%u.%7s", &device, ext) != 2 ||
+        std::strcmp(ext, "seg") != 0 || device > UINT16_MAX) {
+      continue;
+    }
+    if (auto* seg = _segment(static_cast<uint16_t>(device), false)) {
+      total += seg->count;
+    }
+  }
+  logger::info("[fix_history] Loaded {} fixes of {} devices from \"{}\"",
+               total, _segments.size(), _dir.c_str());
+}
+
+fix_history::~fix_history() noexcept { flush(); }
+
+bool fix_history::append(uint16_t device, const fix_t& fix) {
+  if (_read_only) {
+    return false;
+  }
+  auto* seg = _segment(device, true);
+  if (!seg) {
+    return false;
+  }
+  auto& added = seg->tail.emplace_back(fix);
+  if (seg->tail.size() > 1u) {
+    added.time = std::max(added.time, seg->tail[seg->tail.size()-2u].time);
+  } else if (!seg->index.empty()) {
+    added.time = std::max(added.time, seg->index.back().last_time);
+  }
+  ++seg->count;
+  if (seg->tail.size() == BLOCK_FIXES || added.time - seg->tail.front().time >= SEAL_AFTER_MS) {
+    return _seal(*seg);
+  }
+  return true;
+}
+
+void fix_history::flush() {
+  for (auto& [device, seg] : _segments) {
+    _seal(seg);
+  }
+}
+
+auto fix_history::time_range(uint16_t device) -> std::optional<std::pair<int64_t, int64_t>> {
+  auto* seg = _segment(device, false);
+  if (!seg || (seg->index.empty() && seg->tail.empty())) {
+    return std::nullopt;
+  }
+  const int64_t first = seg->index.empty() ? seg->tail.front().time
+                                           : seg->index.front().first_time;
+  const int64_t last = seg->tail.empty() ? seg->index.back().last_time : seg->tail.back().time;
+  return std::make_pair(first, last);
+}
+
+uint64_t fix_history::fix_count(uint16_t device) {
+  auto* seg = _segment(device, false);
+  return seg ? seg->count : 0u;
+}
+
+std::vector<uint16_t> fix_history::devices() const {
+  std::vector<uint16_t> out;
+  out.reserve(_segments.size());
+  for (const auto& [device, seg] : _segments) {
+    out.emplace_back(device);
+  }
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+uint64_t fix_history::disk_size() const {
+  uint64_t size = 0u;
+  for (const auto& [device, seg] : _segments) {
+    size += seg.size;
+  }
+  return size;
+}
+
+auto fix_history::_segment(uint16_t device, bool create) -> segment* {
+  auto it = _segments.find(device);
+  if (it != _segments.end()) {
+    return &it->second;
+  }
+  it = _segments.try_emplace(device).first;
+  if (!_open(device, it->second, create)) {
+    _segments.erase(it);
+    return nullptr;
+  }
+  return &it->second;
+}
+
+bool fix_history::_open(uint16_t device, segment& seg, bool create) {
+  seg.path = _dir / fmt::format("device-{}.seg", device);
+  const int flags = _read_only ? O_RDONLY : O_RDWR | O_APPEND | (create ? O_CREAT : 0);
+  seg.fd = ::open(seg.path.c_str(), flags, 0644);
+  if (seg.fd < 0) {
+    if (create) {
+      logger::error("[fix_history] Failed to open \"{}\"", seg.path.c_str());
+    }
+    return false;
+  }
+  struct stat st;
+  if (fstat(seg.fd, &st) < 0) {
+    logger::error("[fix_history] Failed to stat \"{}\"", seg.path.c_str());
+    return false;
+  }
+
+  seg.size = static_cast<size_t>(st.st_size);
+  if (seg.size == 0u && _read_only) {
+    return false;
+  }
+  if (seg.size == 0u) {
+    header_t header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.device = device;
+    if (!write_all(seg.fd, reinterpret_cast<const uint8_t*>(&header), sizeof(header))) {
+      logger::error("[fix_history] Failed to write \"{}\"", seg.path.c_str());
+      return false;
+    }
+    seg.size = sizeof(header);
+    return true;
+  }
+
+  if (seg.size < sizeof(header_t) || !_remap(seg)) {
+    logger::error("[fix_history] Invalid segment \"{}\"", seg.path.c_str());
+    return false;
+  }
+  header_t header;
+  std::memcpy(&header, seg.data, sizeof(header));
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION ||
+      header.device != device) {
+    logger::error("[fix_history] Bad header in \"{}\"", seg.path.c_str());
+    return false;
+  }
+
+  // Only the headers get read, they are the time index
+  size_t offset = sizeof(header_t);
+  while (offset + sizeof(block_t) <= seg.size) {
+    block_t block;
+    std::memcpy(&block, seg.data+offset, sizeof(block));
+    const size_t columns = offset + sizeof(block_t);
+    if (block.count == 0u || block.count > BLOCK_FIXES || block.size > seg.size - columns ||
+        block.last_time < block.first_time ||
+        (!seg.index.empty() && block.first_time < seg.index.back().last_time)) {
+      break;
+    }
+    seg.index.emplace_back(block.first_time, block.last_time, columns, block.size, block.count);
+    seg.count += block.count;
+    offset = columns + block.size;
+  }
+  if (offset != seg.size && _read_only) {
+    logger::warning("[fix_history] Skipping {} torn bytes at the end of \"{}\"",
+                    seg.size - offset, seg.path.c_str());
+    seg.size = offset;
+  } else if (offset != seg.size) {
+    // Interrupted while writing the last block
+    logger::warning("[fix_history] Dropping {} torn bytes at the end of \"{}\"",
+                    seg.size - offset, seg.path.c_str());
+    if (ftruncate(seg.fd, static_cast<off_t>(offset)) < 0) {
+      logger::error("[fix_history] Failed to truncate \"{}\"", seg.path.c_str());
+      return false;
+    }
+    seg.size = offset;
+  }
+  return true;
+}
+
+bool fix_history::_seal(segment& seg) {
+  if (seg.tail.empty()) {
+    return true;
+  }
+  const auto& tail = seg.tail;
+  std::vector<uint8_t> buffer(sizeof(block_t));
+  buffer.reserve(sizeof(block_t) + tail.size()*12u);
+
+  // Fixes come at a steady rate, the delta between two timestamps barely changes
+  int64_t prev_delta = 0;
+  for (size_t i = 1u; i < tail.size(); ++i) {
+    const int64_t delta = tail[i].time - tail[i-1u].time;
+    put_varint(buffer, delta - prev_delta);
+    prev_delta = delta;
+  }
+  const auto put_deltas = [&](auto field) {
+    int64_t prev = 0;
+    for (const auto& fix : tail) {
+      const int64_t val = fix.*field;
+      put_varint(buffer, val - prev);
+      prev = val;
+    }
+  };
+  put_deltas(&fix_t::lat_e7);
+  put_deltas(&fix_t::lng_e7);
+  put_deltas(&fix_t::rssi);
+  for (const auto& fix : tail) {
+    buffer.emplace_back(fix.sat_count);
+  }
+
+  const block_t block{
+    .size = static_cast<uint32>(buffer.size() - sizeof(block_t)),
+    .count = static_cast<uint32>(tail.size()),
+    .first_time = tail.front().time,
+    .last_time = tail.back().time,
+  };
+  std::memcpy(buffer.data(), &block, sizeof(block));
+  if (!write_all(seg.fd, buffer.data(), buffer.size())) {
+    logger::error("[fix_history] Failed to write {} fixes to \"{}\"",
+                  tail.size(), seg.path.c_str());
+    // Don't leave half a block behind, the next one would be unreadable
+    if (ftruncate(seg.fd, static_cast<off_t>(seg.size)) < 0) {
+      logger::error("[fix_history] Failed to truncate \"{}\"", seg.path.c_str());
+    }
+    seg.count -= tail.size();
+    seg.tail.clear();
+    return false;
+  }
+  seg.index.emplace_back(block.first_time, block.last_time, seg.size + sizeof(block_t),
+                         block.size, block.count);
+  seg.size += buffer.size();
+  seg.tail.clear();
+  return true;
+}
+
+bool fix_history::_remap(segment& seg) {
+  if (seg.data) {
+    munmap(const_cast<uint8_t*>(seg.data), seg.mapped);
+    seg.data = nullptr;
+    seg.mapped = 0u;
+  }
+  void* ptr = mmap(nullptr, seg.size, PROT_READ, MAP_SHARED, seg.fd, 0);
+  if (ptr == MAP_FAILED) {
+    logger::error("[fix_history] Failed to map \"{}\"", seg.path.c_str());
+    return false;
+  }
+  seg.data = static_cast<const uint8_t*>(ptr);
+  seg.mapped = seg.size;
+  return true;
+}
+
+auto fix_history::_decode_block(segment& seg, const block_ref& block) -> ntf::cspan<fix_t> {
+  // Blocks written since the last query are past the end of the mapping
+  if (block.offset + block.size > seg.mapped && !_remap(seg)) {
+    return {};
+  }
+  const uint8_t* in = seg.data + block.offset;
+  const uint8_t* end = in + block.size;
+  const auto corrupt = [&]() {
+    logger::error("[fix_history] Corrupt block at {} in \"{}\"", block.offset, seg.path.c_str());
+    return ntf::cspan<fix_t>{};
+  };
+
+  int64_t delta = 0;
+  _decoded[0].time = block.first_time;
+  for (uint32 i = 1u; i < block.count; ++i) {
+    int64_t dod;
+    if (!get_varint(in, end, dod)) {
+      return corrupt();
+    }
+    delta += dod;
+    _decoded[i].time = _decoded[i-1u].time + delta;
+  }
+  const auto get_deltas = [&](auto field) {
+    int64_t val = 0;
+    for (uint32 i = 0u; i < block.count; ++i) {
+      int64_t diff;
+      if (!get_varint(in, end, diff)) {
+        return false;
+      }
+      val += diff;
+      _decoded[i].*field = static_cast<std::remove_reference_t<decltype(_decoded[i].*field)>>(val);
+    }
+    return true;
+  };
+  if (!get_deltas(&fix_t::lat_e7) || !get_deltas(&fix_t::lng_e7) ||
+      !get_deltas(&fix_t::rssi) || static_cast<size_t>(end - in) != block.count) {
+    return corrupt();
+  }
+  for (uint32 i = 0u; i < block.count; ++i) {
+    _decoded[i].sat_count = *in++;
+  }
+  return {_decoded.data(), block.count};
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "./renderer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <optional>
+#include <unordered_map>
+
+// Append only on disk store of every fix received, one segment file per device.
+// Fixes are packed in blocks of up to BLOCK_FIXES, each block column by column: timestamps
+// as delta of deltas, coordinates and rssi as deltas, all zigzag varints. A 2 second track
+// takes 6 to 9 bytes per fix instead of 24.
+// The block headers double as a sparse time index, loaded when a segment gets opened, so a
+// time range query only decodes the blocks that overlap it. Segments are mmaped for reading.
+//
+// Layout (host endianness):
+//   header_t
+//   block_t, followed by block_t::size bytes of columns
+//   block_t, ...
+//
+// The newest fixes are kept in memory until their block fills up or spans SEAL_AFTER_MS,
+// so a crash loses about that much. A torn block at the end of a segment
+// gets truncated away on open.
+// A read only history never creates nor modifies anything, torn blocks just get skipped.
+// Not thread safe, every call has to come from the same thread.
+class fix_history {
+public:
+  static constexpr char MAGIC[4] = {'O', 'S', 'M', 'H'};
+  static constexpr uint32 VERSION = 1u;
+  static constexpr uint32 BLOCK_FIXES = 256u;
+  static constexpr int64_t SEAL_AFTER_MS = 60000;
+
+  struct fix_t {
+    int64_t time; // unix time, milliseconds
+    int32 lat_e7, lng_e7; // degrees * 1e7
+    int16_t rssi;
+    uint8_t sat_count;
+  };
+
+  struct header_t {
+    char magic[4];
+    uint32 version;
+    uint32 device;
+    uint32 reserved;
+  };
+
+  struct block_t {
+    uint32 size;  // column bytes following the header
+    uint32 count; // fixes in the block
+    int64_t first_time, last_time;
+  };
+
+private:
+  struct block_ref {
+    int64_t first_time, last_time;
+    size_t offset; // of the column bytes
+    uint32 size, count;
+  };
+
+  class segment {
+  public:
+    segment() noexcept : fd{-1}, data{nullptr}, mapped{0u}, size{0u}, count{0u} {}
+    ~segment() noexcept;
+    segment(const segment&) = delete;
+    segment& operator=(const segment&) = delete;
+
+  public:
+    std::filesystem::path path;
+    int fd;
+    const uint8_t* data;
+    size_t mapped; // bytes of the file in the mapping
+    size_t size;   // bytes written to the file
+    std::vector<block_ref> index; // sorted by time
+    std::vector<fix_t> tail;      // not written yet
+    uint64_t count;
+  };
+
+public:
+  // Creates `dir` if needed and opens every segment already in it
+  explicit fix_history(std::filesystem::path dir, bool read_only = false);
+  ~fix_history() noexcept;
+
+  fix_history(const fix_history&) = delete;
+  fix_history& operator=(const fix_history&) = delete;
+
+public:
+  // Fixes older than the last one of the device get the same time, segments stay sorted.
+  // Always false on a read only history
+  bool append(uint16_t device, const fix_t& fix);
+
+  // Writes every fix still in memory
+  void flush();
+
+  // Calls fun(fix) for every fix of `device` with from <= time <= to, oldest first
+  template<typename F>
+  size_t query(uint16_t device, int64_t from, int64_t to, F&& fun) {
+    auto* seg = _segment(device, false);
+    if (!seg || from > to) {
+      return 0u;
+    }
+    size_t count = 0u;
+    const auto emit = [&](const fix_t& fix) {
+      if (fix.time >= from && fix.time <= to) {
+        fun(fix);
+        ++count;
+      }
+    };
+    const auto first = std::lower_bound(seg->index.begin(), seg->index.end(), from,
+      [](const block_ref& block, int64_t time) { return block.last_time < time; });
+    for (auto it = first; it != seg->index.end() && it->first_time <= to; ++it) {
+      const auto decoded = _decode_block(*seg, *it);
+      std::for_each(decoded.begin(), decoded.end(), emit);
+    }
+    std::for_each(seg->tail.begin(), seg->tail.end(), emit);
+    return count;
+  }
+
+  std::optional<std::pair<int64_t, int64_t>> time_range(uint16_t device);
+  uint64_t fix_count(uint16_t device);
+  std::vector<uint16_t> devices() const;
+  uint64_t disk_size() const;
+  const std::filesystem::path& dir() const { return _dir; }
+  bool read_only() const { return _read_only; }
+
+private:
+  segment* _segment(uint16_t device, bool create);
+  bool _open(uint16_t device, segment& seg, bool create);
+  bool _seal(segment& seg);
+  bool _remap(segment& seg);
+  ntf::cspan<fix_t> _decode_block(segment& seg, const block_ref& block);
+
+private:
+  std::filesystem::path _dir;
+  bool _read_only;
+  std::unordered_map<uint16_t, segment> _segments;
+  std::array<fix_t, BLOCK_FIXES> _decoded; // scratch for queries
+};
@@ -0,0 +1,165 @@
+#include "./geofence.hpp"
+
+// Even-odd rule, branchless so it runs over several edges at once
+static bool polygon_contains(const float* ax, const float* ay, const float* bx, const float* by,
+                             uint32 count, vec2 pos) {
+  uint32 crossings = 0u;
+  for (uint32 i = 0u; i < count; ++i) {
+    const bool straddles = (ay[i] > pos.y) != (by[i] > pos.y);
+    // Horizontal edges never straddle, whatever the division gives gets discarded
+    const float x = ax[i] + (pos.y - ay[i])*(bx[i] - ax[i])/(by[i] - ay[i]);
+    crossings += static_cast<uint32>(straddles & (pos.x < x));
+  }
+  return crossings & 1u;
+}
+
+geofence_engine::geofence_engine(chrono_clock::duration dwell_time, float cell_size) noexcept :
+  _dwell_time{dwell_time}, _grid{cell_size} {}
+
+uint32 geofence_engine::add_circle(vec2 center, float radius) {
+  return _add_zone(zone_t{0u, center, radius, 0u, 0u, true}, radius);
+}
+
+std::optional<uint32> geofence_engine::add_polygon(ntf::cspan<vec2> points) {
+  if (points.size() < 3u) {
+    return std::nullopt;
+  }
+  zone_t zone{0u, vec2{0.f}, 0.f, 0u, 0u, true};
+  const float bound_radius = _push_edges(zone, points);
+  return _add_zone(zone, bound_radius);
+}
+
+bool geofence_engine::update(uint32 zone_id, ntf::cspan<vec2> points) {
+  NTF_ASSERT(zone_id < _zones.size() && _zones[zone_id].alive && _zones[zone_id].edge_count);
+  if (points.size() < 3u) {
+    return false;
+  }
+  _erase_edges(zone_id);
+  auto& zone = _zones[zone_id];
+  const float bound_radius = _push_edges(zone, points);
+  _grid.remove(zone.handle);
+  zone.handle = _grid.insert(zone.center, bound_radius, zone_id);
+  return true;
+}
+
+float geofence_engine::_push_edges(zone_t& zone, ntf::cspan<vec2> points) {
+  vec2 min = points[0], max = points[0];
+  zone.first_edge = static_cast<uint32>(_edge_ax.size());
+  zone.edge_count = static_cast<uint32>(points.size());
+  for (size_t i = 0u; i < points.size(); ++i) {
+    const auto a = points[i];
+    const auto b = points[(i+1u) % points.size()];
+    _edge_ax.emplace_back(a.x);
+    _edge_ay.emplace_back(a.y);
+    _edge_bx.emplace_back(b.x);
+    _edge_by.emplace_back(b.y);
+    min = glm::min(min, a);
+    max = glm::max(max, a);
+  }
+  zone.center = (min+max)*.5f;
+  return glm::length(max-zone.center);
+}
+
+void geofence_engine::_erase_edges(uint32 zone_id) {
+  auto& zone = _zones[zone_id];
+  if (!zone.edge_count) {
+    return;
+  }
+  // Keep the arrays packed, the polygons after this one slide down
+  const auto first = static_cast<ptrdiff_t>(zone.first_edge);
+  const auto last = first + static_cast<ptrdiff_t>(zone.edge_count);
+  for (auto* edges : {&_edge_ax, &_edge_ay, &_edge_bx, &_edge_by}) {
+    edges->erase(edges->begin()+first, edges->begin()+last);
+  }
+  for (auto& other : _zones) {
+    if (other.alive && other.edge_count && other.first_edge > zone.first_edge) {
+      other.first_edge -= zone.edge_count;
+    }
+  }
+  zone.first_edge = 0u;
+  zone.edge_count = 0u;
+}
+
+uint32 geofence_engine::_add_zone(zone_t zone, float bound_radius) {
+  uint32 id;
+  if (_free.empty()) {
+    id = static_cast<uint32>(_zones.size());
+    _zones.emplace_back();
+  } else {
+    id = _free.back();
+    _free.pop_back();
+  }
+  zone.handle = _grid.insert(zone.center, bound_radius, id);
+  _zones[id] = zone;
+  return id;
+}
+
+void geofence_engine::remove(uint32 zone) {
+  NTF_ASSERT(zone < _zones.size() && _zones[zone].alive);
+  _grid.remove(_zones[zone].handle);
+  _erase_edges(zone);
+  _zones[zone].alive = false;
+  _free.emplace_back(zone);
+  for (auto& [device, visits] : _inside) {
+    std::erase_if(visits, [zone](const visit_t& visit) { return visit.zone == zone; });
+  }
+}
+
+void geofence_engine::clear() {
+  _grid.clear();
+  _zones.clear();
+  _free.clear();
+  _edge_ax.clear();
+  _edge_ay.clear();
+  _edge_bx.clear();
+  _edge_by.clear();
+  _inside.clear();
+}
+
+bool geofence_engine::contains(uint32 zone_id, vec2 pos) const {
+  const auto& zone = _zones[zone_id];
+  if (!zone.edge_count) {
+    const vec2 diff = pos - zone.center;
+    return glm::dot(diff, diff) <= zone.radius*zone.radius;
+  }
+  const auto first = zone.first_edge;
+  return polygon_contains(_edge_ax.data()+first, _edge_ay.data()+first,
+                          _edge_bx.data()+first, _edge_by.data()+first, zone.edge_count, pos);
+}
+
+void geofence_engine::evaluate(ntf::cspan<fix_t> fixes, std::vector<event_t>& events) {
+  for (const auto& fix : fixes) {
+    _candidates.clear();
+    _grid.query_radius(fix.pos, 0.f, [&](auto, uint32 zone, vec2) {
+      if (contains(zone, fix.pos)) {
+        _candidates.emplace_back(zone);
+      }
+    });
+    std::sort(_candidates.begin(), _candidates.end());
+
+    // Both sorted by zone, walk them side by side
+    auto& visits = _inside[fix.device];
+    auto& next = _next;
+    next.clear();
+    size_t i = 0u;
+    for (const auto zone : _candidates) {
+      while (i < visits.size() && visits[i].zone < zone) {
+        events.emplace_back(event_type::exit, fix.device, visits[i++].zone, fix.time);
+      }
+      if (i < visits.size() && visits[i].zone == zone) {
+        auto& visit = next.emplace_back(visits[i++]);
+        if (!visit.dwelled && fix.time - visit.since >= _dwell_time) {
+          visit.dwelled = true;
+          events.emplace_back(event_type::dwell, fix.device, zone, fix.time);
+        }
+        continue;
+      }
+      next.emplace_back(zone, fix.time, false);
+      events.emplace_back(event_type::enter, fix.device, zone, fix.time);
+    }
+    while (i < visits.size()) {
+      events.emplace_back(event_type::exit, fix.device, visits[i++].zone, fix.time);
+    }
+    visits.swap(next);
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "./osm.hpp"
+#include "./spatial_grid.hpp"
+
+// Tells when each tracker enters, stays in or leaves a set of zones, circles or polygons in
+// world units. Fixes get evaluated in batches: a spatial grid over the zone bounds narrows
+// each fix down to a few candidates, then polygons get an even-odd crossing test over their
+// edges, stored as flat arrays so the loop vectorizes.
+// A dwell event fires once per visit, after a tracker has stayed `dwell_time` in a zone.
+class geofence_engine {
+public:
+  enum class event_type {
+    enter,
+    exit,
+    dwell,
+  };
+
+  struct event_t {
+    event_type type;
+    uint16_t device;
+    uint32 zone;
+    chrono_clock::time_point time;
+  };
+
+  struct fix_t {
+    uint16_t device;
+    vec2 pos;
+    chrono_clock::time_point time;
+  };
+
+private:
+  struct zone_t {
+    spatial_grid<uint32>::handle handle;
+    vec2 center;
+    float radius;      // of the circle, 0 for polygons
+    uint32 first_edge; // polygon edges
+    uint32 edge_count;
+    bool alive;
+  };
+
+  struct visit_t {
+    uint32 zone;
+    chrono_clock::time_point since;
+    bool dwelled;
+  };
+
+public:
+  explicit geofence_engine(chrono_clock::duration dwell_time, float cell_size = 64.f) noexcept;
+
+public:
+  uint32 add_circle(vec2 center, float radius);
+  // Closed polygon, the last point connects back to the first. Needs at least 3 points
+  std::optional<uint32> add_polygon(ntf::cspan<vec2> points);
+
+  // Replaces the outline of a polygon zone, false if there are less than 3 points. The id
+  // stays the same and trackers already inside keep their visit, they only get events if the
+  // new outline left them on the other side
+  bool update(uint32 zone, ntf::cspan<vec2> points);
+
+  // Trackers inside the zone forget about it, without an exit event
+  void remove(uint32 zone);
+  void clear();
+
+  // Appends the events caused by `fixes` to `events`, fixes of each device oldest first
+  void evaluate(ntf::cspan<fix_t> fixes, std::vector<event_t>& events);
+
+  bool contains(uint32 zone, vec2 pos) const;
+
+public:
+  size_t zone_count() const { return _grid.size(); }
+
+private:
+  uint32 _add_zone(zone_t zone, float bound_radius);
+  float _push_edges(zone_t& zone, ntf::cspan<vec2> points); // returns the bound radius
+  void _erase_edges(uint32 zone);
+
+private:
+  chrono_clock::duration _dwell_time;
+  spatial_grid<uint32> _grid;
+  std::vector<zone_t> _zones;
+  std::vector<uint32> _free;
+  std::vector<float> _edge_ax, _edge_ay, _edge_bx, _edge_by;
+  std::unordered_map<uint16_t, std::vector<visit_t>> _inside; // sorted by zone
+  std::vector<uint32> _candidates; // scratch for evaluate()
+  std::vector<visit_t> _next;
+};
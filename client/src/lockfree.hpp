@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Single writer snapshot. Readers never block the writer or each other, a read that
+// overlaps a write just fails and the reader keeps whatever it had.
+// The payload is stored as relaxed atomic words so torn reads are detected, not UB.
+template<typename T>
+class seqlock {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+  static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1u) / sizeof(uint64_t);
+
+public:
+  seqlock() noexcept : _seq{0u} { store(T{}); }
+  seqlock(const seqlock&) = delete;
+  seqlock& operator=(const seqlock&) = delete;
+
+public:
+  // Writer thread only
+  void store(const T& value) noexcept {
+    uint64_t words[WORDS] = {};
+    std::memcpy(words, &value, sizeof(T));
+
+    const auto seq = _seq.load(std::memory_order_relaxed);
+    _seq.store(seq+1u, std::memory_order_relaxed); // odd while writing
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0u; i < WORDS; ++i) {
+      _words[i].store(words[i], std::memory_order_relaxed);
+    }
+    _seq.store(seq+2u, std::memory_order_release);
+  }
+
+  // Any thread, wait-free. False if a write was in progress
+  bool try_load(T& out) const noexcept {
+    const auto seq = _seq.load(std::memory_order_acquire);
+    if (seq & 1u) {
+      return false;
+    }
+    uint64_t words[WORDS];
+    for (size_t i = 0u; i < WORDS; ++i) {
+      words[i] = _words[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_seq.load(std::memory_order_relaxed) != seq) {
+      return false;
+    }
+    std::memcpy(&out, words, sizeof(T));
+    return true;
+  }
+
+  // Bumped on every store, readers can tell whether anything changed
+  uint32_t version() const noexcept { return _seq.load(std::memory_order_acquire) >> 1u; }
+
+private:
+  std::atomic<uint32_t> _seq;
+  std::array<std::atomic<uint64_t>, WORDS> _words;
+};
+
+// Bounded single producer, single consumer queue. Both ends are wait-free, pushing into
+// a full ring fails instead of overwriting.
+template<typename T, size_t N>
+class spsc_ring {
+  static_assert(N > 0u && (N & (N-1u)) == 0u, "N must be a power of two");
+
+public:
+  spsc_ring() noexcept : _head{0u}, _tail{0u}, _dropped{0u} {}
+  spsc_ring(const spsc_ring&) = delete;
+  spsc_ring& operator=(const spsc_ring&) = delete;
+
+public:
+  // Producer only
+  bool push(const T& value) noexcept(std::is_nothrow_copy_assignable_v<T>) {
+    const auto tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == N) {
+      _dropped.fetch_add(1u, std::memory_order_relaxed);
+      return false;
+    }
+    _items[tail & (N-1u)] = value;
+    _tail.store(tail+1u, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only
+  bool pop(T& out) noexcept(std::is_nothrow_move_assignable_v<T>) {
+    const auto head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    out = std::move(_items[head & (N-1u)]);
+    _head.store(head+1u, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only, calls `fun` for every queued item
+  template<typename F>
+  size_t drain(F&& fun) {
+    size_t count = 0u;
+    T item;
+    while (pop(item)) {
+      fun(item);
+      ++count;
+    }
+    return count;
+  }
+
+  size_t dropped() const noexcept { return _dropped.load(std::memory_order_relaxed); }
+  static constexpr size_t capacity() { return N; }
+
+private:
+  // Separate cache lines, each end only writes its own index
+  alignas(64) std::atomic<size_t> _head;
+  alignas(64) std::atomic<size_t> _tail;
+  alignas(64) std::atomic<size_t> _dropped;
+  std::array<T, N> _items;
+};
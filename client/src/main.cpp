@@ -1,69 +1,190 @@
 #include "renderer.hpp"
 #include "osm.hpp"
 #include "marker.hpp"
+#include "tile_manager.hpp"
+#include "tile_prefetch.hpp"
+#include "fix_history.hpp"
+#include "track_layer.hpp"
+#include "spatial_grid.hpp"
+#include "geofence.hpp"
+#include "motion_model.hpp"
+
+#include <gps_frame.h>
 
 static gps_coord map_min{-24.737526, -65.394627}; // top left
 static gps_coord map_max{-24.744542, -65.387117}; // bottom right
 static uint32 map_zoom = 19u;
+static bool decoded_tile_cache = false;
+static constexpr tile_manager::config_t tile_config {
+  .cpu_budget = 256u << 20u,
+  .gpu_budget = 128u << 20u,
+  .margin = 2u,
+  .uploads_per_tick = 8u,
+  .min_zoom = 12u,
+  .retry_ticks = 60u,
+};
+static constexpr tile_prefetcher::config_t prefetch_config {
+  .lookahead = 30.f,
+  .step = 2.f,
+  .radius = 1u,
+  .history = 8u,
+  .min_speed = .5f,
+};
+// World units are pixels at map_zoom, around 3.7 per meter here
+static constexpr motion_model::config_t motion_config {
+  .fix_noise = 18.f,
+  .accel_noise = 4.f,
+  .max_speed = 55.f,
+  .max_predict = 4.f, // two fixes
+  .blend_time = .5f,
+};
+// https://operations.osmfoundation.org/policies/tiles/
+static constexpr net_reactor::config_t net_config {
+  .user_agent = "lora_gps_tracking/0.1 (+https://github.com/nesktf/lora_gps_tracking)",
+  .max_host_connections = 2u,
+  .max_total_connections = 8u,
+};
+static constexpr download_scheduler::config_t download_config {
+  .max_in_flight = 2u,
+  .host_interval = std::chrono::milliseconds{100},
+  .max_retries = 4u,
+  .backoff = std::chrono::milliseconds{500},
+  .stale_after = std::chrono::days{7},
+  .negative_ttl = std::chrono::hours{1},
+};
+static constexpr std::chrono::seconds gps_poll_interval{5};
+static constexpr uint32 max_tracks = 16u;
+static constexpr uint32 track_points = 1u << 16u; // ~36 hours of 2 second fixes
+static constexpr std::chrono::hours track_backfill{24}; // drawn from the history on start
+static constexpr float pick_cell_size = 64.f; // world units
+static constexpr float pick_radius = 10.f;    // screen pixels
+static constexpr float checkpoint_zone_radius = 30.f; // world units
+static constexpr std::chrono::seconds zone_dwell{30};
+static constexpr uint32 shape_capacity = 64u; // to start with, the layer grows as needed
+static constexpr float MAX_CAM_ZOOM = 4.f;
+static constexpr float zoom_snap = 1e-3f; // relative, the eased zoom jumps to the target
 
 static const char* cache_dir = "tile_cache/";
-static const char* nodemcu_url = "http://192.168.89.53:80";
+static constexpr std::string_view history_dir = "history"; // inside the cache dir
+// "/devices" and "/stream" serve the fixes of every tracker as JSON, "/devices.bin" and
+// "/frames" in binary
+static const char* nodemcu_url = "http://192.168.89.53:80/devices.bin";
+static const char* nodemcu_stream_url = "http://192.168.89.53:81/frames"; // empty to poll
 
-struct map_object {
-  size_t tex;
-  ntf::transform2d<float> transform;
-};
+// Same format as the receiver time of a fix
+static uint32 utc_hhmmss(int64_t unix_ms) {
+  const auto secs = static_cast<uint32>((unix_ms/1000) % 86400);
+  return secs/3600u*10000u + secs/60u%60u*100u + secs%60u;
+}
+
+// The fixes only carry the receiver clock, stamp them with the wall clock for the history
+static fix_history::fix_t history_fix(const osm_map::gps_data& gps) {
+  const auto age = chrono_clock::now() - gps.last_update;
+  const auto when = std::chrono::system_clock::now() -
+    std::chrono::duration_cast<std::chrono::system_clock::duration>(age);
+  return {
+    .time = std::chrono::duration_cast<std::chrono::milliseconds>(
+      when.time_since_epoch()).count(),
+    .lat_e7 = gps_frame_to_e7(gps.lat),
+    .lng_e7 = gps_frame_to_e7(gps.lng),
+    .rssi = static_cast<int16_t>(gps.rssi),
+    .sat_count = static_cast<uint8_t>(std::min(gps.sat_c, 255u)),
+  };
+}
 
 int main(int argc, const char* argv[]) {
   logger::set_level(ntf::log_level::verbose);
-  if (argc >= 2) {
-    cache_dir = argv[1];
+  if (argc >= 2 && std::string_view{argv[1]} == "--pack-cache") {
+    // Migrate the loose tiles in the cache dir to the tile archive
+    const fs::path dir = argc >= 3 ? argv[2] : cache_dir;
+    const auto count = tile_archive::import_dir(dir, dir / osm_tile_loader::ARCHIVE_NAME, true);
+    return count ? 0 : 1;
+  }
+  // Replays recorded fixes instead of following the NodeMCU, "max" replays at full speed
+  const char* replay_path = nullptr;
+  float replay_speed = 1.f;
+  int arg = 1;
+  if (argc >= 4 && std::string_view{argv[1]} == "--replay") {
+    replay_path = argv[2];
+    char* end = nullptr;
+    if (std::string_view{argv[3]} == "max") {
+      replay_speed = 0.f;
+    } else {
+      replay_speed = std::strtof(argv[3], &end);
+    }
+    if ((end && *end) || replay_speed < 0.f) {
+      logger::error("[main] Invalid replay speed \"{}\"", argv[3]);
+      return 1;
+    }
+    arg = 4;
   }
-  if (argc >= 3) {
-    nodemcu_url = argv[2];
+  if (argc >= arg+1) {
+    cache_dir = argv[arg];
+  }
+  if (argc >= arg+2) {
+    nodemcu_url = argv[arg+1];
+  }
+  if (argc >= arg+3) {
+    nodemcu_stream_url = argv[arg+2];
   }
   logger::info("[main] Tile cache dir: \"{}\"", cache_dir);
-  logger::info("[main] NodeMCU API url: \"{}\"", nodemcu_url);
+  if (replay_path) {
+    logger::info("[main] Replaying: \"{}\"", replay_path);
+  } else {
+    logger::info("[main] NodeMCU API url: \"{}\"", nodemcu_url);
+    logger::info("[main] NodeMCU stream url: \"{}\"", nodemcu_stream_url);
+  }
 
   {
-    auto vert_src = ntf::file_contents("res/shader/tile.vs.glsl").value(); 
-    auto frag_src = ntf::file_contents("res/shader/tile.fs.glsl").value();
     auto font_atlas = ntf::load_font_atlas<char>("res/font/CousineNerdFont-Regular.ttf").value();
-    render_ctx::construct(vert_src, frag_src, std::move(font_atlas), {1280, 720});
+    render_ctx::construct(std::move(font_atlas), {1280, 720});
   }
   auto& render = render_ctx::instance();
   render.cam_pos(1280.f, -1280.f);
 
-  auto sdf = gps_marker::make_marker(10.f, 35.f);
-  // auto sdf2 = map_shape::make_shape(map_shape::S_TRIANGLE, 20.f, color4{0.f, 1.f, 1.f, 1.f});
+  auto tracks = track_layer::make_layer(max_tracks, track_points, 3.f);
+  // One marker per tracker plus the cursor
+  auto markers = marker_layer::make_layer(osm_map::MAX_DEVICES+1u);
+  auto shapes = shape_layer::make_layer(shape_capacity);
+  vec2 cursor_pos{};
   auto sdf3 = map_shape::make_shape(map_shape::S_TRIANGLE, 7.f, color4{1.f, 0.f, 0.f, 1.f});
   auto sdf4 = map_shape::make_shape(map_shape::S_SQUARE, 6.f, color4{1.f, 0.f, 0.f, 1.f});
-  // sdf2.set_outline_color(color4{1.f, 0.f, 0.f, 1.f});
-  // sdf2.set_pos({1280, -1280});
   std::vector<map_shape> checkpoints;
+  spatial_grid<size_t> checkpoint_grid{pick_cell_size}; // index in checkpoints
+  // A circle around every checkpoint, and the area they enclose once there are 3 of them
+  geofence_engine geofences{zone_dwell, pick_cell_size};
+  std::optional<uint32> route_zone;
+  std::vector<geofence_engine::fix_t> fence_fixes;
+  std::vector<geofence_engine::event_t> fence_events;
   size_t selected = 0u;
 
-  // bezier_thing bez{};
-
   vec2 mouse_pos{};
+  // The camera eases towards the target zoom, each tile level is a power of two
+  float target_zoom = 1.f;
+  const float min_cam_zoom = std::ldexp(1.f, static_cast<int>(tile_config.min_zoom) -
+                                             static_cast<int>(map_zoom));
   render.window().set_key_press_callback([&](auto& win, const ntf::win_key_data& key) {
     auto cam_pos = render.cam_pos();
+    const float step = 256.f/render.cam_zoom();
     if (key.action == ntf::win_action::press) {
       if (key.key == ntf::win_key::escape) {
         win.close();
       }
       if (key.key == ntf::win_key::up) {
-        cam_pos.y += 256.f;
+        cam_pos.y += step;
       } else if (key.key == ntf::win_key::down){
-        cam_pos.y -= 256.f;
+        cam_pos.y -= step;
       }
       if (key.key == ntf::win_key::left) {
-        cam_pos.x -= 256.f;
+        cam_pos.x -= step;
       } else if (key.key == ntf::win_key::right) {
-        cam_pos.x += 256.f;
+        cam_pos.x += step;
       }
       if (key.key == ntf::win_key::backspace) {
         checkpoints.clear();
+        checkpoint_grid.clear();
+        geofences.clear();
+        route_zone.reset();
         selected = 0u;
       }
     }
@@ -74,34 +195,88 @@ int main(int argc, const char* argv[]) {
       mouse_pos.x = pos.x;
       mouse_pos.y = -pos.y;
     // mouse_pos = render.raycast(pos.x, pos.y);
+  }).set_scroll_callback([&](auto&, dvec2 offset) {
+    target_zoom *= std::pow(1.15f, static_cast<float>(offset.y));
+    target_zoom = glm::clamp(target_zoom, min_cam_zoom, MAX_CAM_ZOOM);
   });
 
-  osm_map map{cache_dir};
-  std::vector<map_object> objs;
+  net_reactor reactor{net_config};
+  osm_map map{reactor, cache_dir, download_config, 4u, decoded_tile_cache};
+  if (replay_path) {
+    map.start_gps_replay(replay_path, replay_speed);
+  } else if (*nodemcu_stream_url) {
+    map.start_gps_stream(nodemcu_stream_url);
+  } else {
+    map.start_gps(nodemcu_url, gps_poll_interval);
+  }
   gps_coord cino_coord{-24.741087, -65.389729};
-  const auto tileset = map.load_tiles(map_min, map_max, map_zoom);
-  objs.reserve(tileset.tiles().size()+1u);
+  const auto tileset = map.make_tileset(map_min, map_max, map_zoom);
+  auto tile_arr = tile_layer::make_layer(
+    ntf::file_contents("res/shader/tile_array.vs.glsl").value(),
+    ntf::file_contents("res/shader/tile_array.fs.glsl").value(),
+    tile_config.gpu_budget/tile_layer::TILE_BYTES
+  );
+  tile_manager tiles{map, tileset, std::move(tile_arr), tile_config};
 
-  for (const auto& tile : tileset.tiles()) {
-    auto tile_transf = ntf::transform2d<float>{}
-      .pos(tile.pos.x, tile.pos.y).scale(tileset.TILE_SIZE);
-    logger::debug(" => {} {}", tile_transf.pos_x(), tile_transf.pos_y());
-    objs.emplace_back(render.make_texture(tile.image), tile_transf);
+  // Every tracker and the fixes still drawn in its track, for picking
+  struct fix_ref {
+    uint16_t device;
+    uint32 time;
+  };
+  spatial_grid<uint16_t> tracker_grid{pick_cell_size};
+  spatial_grid<fix_ref> fix_grid{pick_cell_size};
+  std::unordered_map<uint16_t, spatial_grid<uint16_t>::handle> tracker_handles;
+  std::unordered_map<uint16_t, std::deque<spatial_grid<fix_ref>::handle>> fix_handles;
+  const auto index_fix = [&](uint16_t device, uint32 time, vec2 pos) {
+    const auto [tracker, added] = tracker_handles.try_emplace(device);
+    if (added) {
+      tracker->second = tracker_grid.insert(pos, 0.f, device);
+    } else {
+      tracker_grid.move(tracker->second, pos);
+    }
+    auto& fixes = fix_handles[device];
+    fixes.emplace_back(fix_grid.insert(pos, 0.f, fix_ref{device, time}));
+    if (fixes.size() > track_points) {
+      fix_grid.remove(fixes.front());
+      fixes.pop_front();
+    }
+  };
+
+  // Replayed fixes are already recorded somewhere
+  std::optional<fix_history> history;
+  if (!replay_path) {
+    history.emplace(fs::path{cache_dir} / history_dir);
   }
-  auto marker_data = ntf::load_image<ntf::uint8>("res/cirno.png").value();
-  // cino_coord = tileset.max_coord();
-  // const auto cino_pos = tileset.pos_from_coord(cino_coord);
-  // logger::debug("CINO: {} {}", cino_pos.x, cino_pos.y);
-  // objs.emplace_back(render.make_texture(marker_data), ntf::transform2d<float>{}
-  //   .pos(cino_pos).scale(64.f));
-  // sdf.set_pos(cino_pos);
-  // render.cam_pos(cino_pos.x, cino_pos.y);
+  if (history) {
+    const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+    const auto from = now - std::chrono::milliseconds{track_backfill}.count();
+    for (const auto device : history->devices()) {
+      history->query(device, from, now, [&](const fix_history::fix_t& fix) {
+        const gps_coord coord{gps_frame_from_e7(fix.lat_e7), gps_frame_from_e7(fix.lng_e7)};
+        const auto pos = tileset.pos_from_coord(coord);
+        tracks.push(device, pos);
+        index_fix(device, utc_hhmmss(fix.time), pos);
+      });
+    }
+  }
+  std::unordered_map<uint16_t, tile_prefetcher> prefetchers; // per device
 
   render.window().set_button_press_callback([&](auto&, const ntf::win_button_data& butt) {
     if (butt.action == ntf::win_action::press) {
       if (butt.button == ntf::win_button::m1) {
         auto coso = tileset.coord_from_pos(mouse_pos);
         logger::debug("LCLICK! {}, {}", coso.x, coso.y);
+        const auto world = render.raycast(mouse_pos.x, -mouse_pos.y);
+        const float radius = pick_radius/render.cam_zoom();
+        if (const auto tracker = tracker_grid.nearest(world, radius)) {
+          logger::debug("[main] Picked device {}", tracker_grid[*tracker]);
+        } else if (const auto check = checkpoint_grid.nearest(world, radius)) {
+          logger::debug("[main] Picked checkpoint {}", checkpoint_grid[*check]);
+        } else if (const auto fix = fix_grid.nearest(world, radius)) {
+          logger::debug("[main] Picked a fix of device {} at {:06} UTC",
+                        fix_grid[*fix].device, fix_grid[*fix].time);
+        }
       }
       if (butt.button == ntf::win_button::m2) {
         auto wp = render.raycast(mouse_pos.x, -mouse_pos.y);
@@ -109,6 +284,19 @@ int main(int argc, const char* argv[]) {
                                                        color4{0.f, 1.f, 0.f, .75f}));
         checkpoints.back().set_pos(wp);
         checkpoints.back().set_outline_color(color4{1.f, 0.f, 0.f, .75f});
+        checkpoint_grid.insert(wp, 0.f, checkpoints.size()-1u);
+        const auto zone = geofences.add_circle(wp, checkpoint_zone_radius);
+        logger::info("[main] Checkpoint {} is zone {}", checkpoints.size()-1u, zone);
+        std::vector<vec2> route;
+        for (const auto& check : checkpoints) {
+          route.emplace_back(check.pos());
+        }
+        // Same zone id, trackers already inside the route don't enter it again
+        if (route_zone) {
+          geofences.update(*route_zone, route);
+        } else {
+          route_zone = geofences.add_polygon(route);
+        }
       }
     }
   });
@@ -118,14 +306,22 @@ int main(int argc, const char* argv[]) {
   vec2 last_mouse_pos{};
   float angle{};
   vec2 dir{};
+  // Markers are drawn where the motion model puts them at the time of the frame, between
+  // the last tick and the next one
+  motion_model motion{motion_config};
+  chrono_clock::time_point tick_time = chrono_clock::now();
+  chrono_clock::duration tick_len{};
   render.start_loop(60u, ntf::overload{
     // Update call
     [&](uint32 ups) {
       const float dt = 1/static_cast<float>(ups);
+      tick_time = chrono_clock::now();
+      tick_len = std::chrono::duration_cast<chrono_clock::duration>(
+        std::chrono::duration<float>{dt});
       auto cam_pos = render.cam_pos();
       // auto& cino = objs.back();
       const auto mouse_world = render.raycast(mouse_pos.x, -mouse_pos.y);
-      sdf.set_pos(mouse_world);
+      cursor_pos = mouse_world;
 
       const auto mouse_delta = (mouse_pos - last_mouse_pos)*dt;
 
@@ -134,9 +330,7 @@ int main(int argc, const char* argv[]) {
       // cino.transform.rot(0.f, 0.f, angle);
 
       if (render.window().poll_button(ntf::win_button::m1) == ntf::win_action::press) {
-        cam_pos += mouse_delta*-60.f;
-        cam_pos.x = glm::clamp(cam_pos.x, 850.f, 3000.f);
-        cam_pos.y = glm::clamp(cam_pos.y, -3000.f, -450.f);
+        cam_pos += mouse_delta*(-60.f/render.cam_zoom());
         render.cam_pos(cam_pos.x, cam_pos.y);
       }
 
@@ -149,7 +343,7 @@ int main(int argc, const char* argv[]) {
           obj.set_outline_width(0.f);
         }
         // logger::debug("{}", selected);
-        dir = glm::normalize(obj.pos()-sdf.pos());
+        dir = glm::normalize(obj.pos()-cursor_pos);
         const vec2 up{0.f, 1.f};
 
         angle = glm::acos(glm::dot(dir, up));
@@ -163,49 +357,107 @@ int main(int argc, const char* argv[]) {
       }
 
       last_mouse_pos = mouse_pos;
+
+      // Snap the last bit, the tile cache only gets redrawn once the zoom stops changing
+      const float zoom = glm::mix(render.cam_zoom(), target_zoom, .25f);
+      render.cam_zoom(std::abs(zoom - target_zoom) < target_zoom*zoom_snap ? target_zoom : zoom);
+      tiles.update(render.cam_pos(), render.viewport(), render.cam_zoom());
+      tracks.update(render.cam_zoom());
+
+      map.poll_fixes([&](const osm_map::gps_data& fix) {
+        if (history) {
+          history->append(fix.device, history_fix(fix));
+        }
+        const auto pos = tileset.pos_from_coord({fix.lat, fix.lng});
+        tracks.push(fix.device, pos);
+        index_fix(fix.device, fix.time, pos);
+        fence_fixes.emplace_back(fix.device, pos, fix.last_update);
+        motion.correct(fix.device, pos, fix.last_update);
+        prefetchers.try_emplace(fix.device, prefetch_config).first->second
+          .push_fix({fix.lat, fix.lng}, fix.last_update);
+      });
+      for (auto& [device, prefetch] : prefetchers) {
+        prefetch.update(map, tiles.stats().zoom);
+      }
+
+      geofences.evaluate(fence_fixes, fence_events);
+      for (const auto& event : fence_events) {
+        constexpr std::string_view what[] = {"entered", "left", "is staying in"};
+        logger::info("[main] Device {} {} zone {}{}", event.device,
+                     what[static_cast<size_t>(event.type)], event.zone,
+                     event.zone == route_zone ? " (route)" : "");
+      }
+      fence_fixes.clear();
+      fence_events.clear();
     },
 
     // Render call
-    [&]([[maybe_unused]] double dt, [[maybe_unused]] double alpha) {
+    [&]([[maybe_unused]] double dt, double alpha) {
       render.start_render();
+      tiles.prepare();
+      const auto frame_time = tick_time + std::chrono::duration_cast<chrono_clock::duration>(
+        tick_len*alpha);
 
       // auto& cino = objs.back().transform;
       auto cam_pos = tileset.coord_from_pos(render.cam_pos());
-      auto ppos = tileset.coord_from_pos(sdf.pos());
+      auto ppos = tileset.coord_from_pos(cursor_pos);
       render.render_text(20.f, 200.f, 1.f, "pos {:.7f} {:.7f}",
                          ppos.x, ppos.y);
       // render.render_string(20.f, 600.f, 1.f, query.info);
       // render.render_text(100.f, 100.f, 1.f, "~ze");
       render.render_text(20.f, 150.f, 1.f, "map_pos {:.7f},{:.7f}", cam_pos.x, cam_pos.y);
+      const auto devices = map.devices();
+      const auto online = std::count_if(devices.begin(), devices.end(),
+                                        [](const auto& gps) { return gps.available; });
+      render.render_text(20.f, 300.f, 1.f, "gps {}/{} devices online", online, devices.size());
+      render.render_text(20.f, 350.f, 1.f, "tracks {}/{} points, lod {}",
+                         tracks.point_count(), tracks.raw_point_count(), tracks.level());
+      const auto gpu = render.resource_stats();
+      render.render_text(20.f, 400.f, 1.f, "gpu {} buffers {} KiB, {} textures {} MiB (peak {})",
+                         gpu.buffers.live, gpu.buffers.bytes >> 10u, gpu.textures.live,
+                         gpu.textures.bytes >> 20u, gpu.textures.peak_bytes >> 20u);
+      const auto pf = map.prefetch_stats();
+      render.render_text(20.f, 250.f, 1.f, "prefetch {}/{} hits ({:.0f}%)",
+                         pf.hits, pf.fetched, pf.hit_rate()*100.f);
       // render.render_text(100.f, 250.f, 1.f, "cino_coord {:.7f},{:.7f}",
       //                    cino_coord.x, cino_coord.y);
       // render.render_text(100.f, 300.f, 1.f, "cino_pos {:.2f},{:.2f}", cino.pos_x(), cino.pos_y());
-      for (auto& obj : objs) {
-        render.render_texture(obj.tex, obj.transform.world());
+      tiles.render();
+      tracks.render();
+      shapes.clear();
+      for (const auto& check : checkpoints) {
+        shapes.push(check);
       }
-      for (auto& check : checkpoints) {
-        render.render_thing(check, 1u);
+      markers.clear();
+      for (const auto& gps : devices) {
+        const auto color = gps.available ? color4{.164f, .715f, .965f, 1.f}
+                                         : color4{.5f, .5f, .5f, .75f};
+        // Lost trackers stay at their last fix
+        const auto fix_pos = tileset.pos_from_coord({gps.lat, gps.lng});
+        const auto pos = gps.available ? motion.predict(gps.device, frame_time) : std::nullopt;
+        markers.push(pos.value_or(fix_pos), 8.f, 24.f, color);
       }
-      render.render_thing(sdf);
+      markers.push(cursor_pos, 10.f, 35.f, color4{.164f, .715f, .965f, 1.f});
+      markers.render();
       if (!checkpoints.empty()) {{
         auto pos = tileset.coord_from_pos(checkpoints[selected].pos());
         render.render_text(20.f, 100.f, 1.f, "check_pos {:.7f},{:.7f}",
                            pos.x, pos.y);
         render.render_text(20.f, 50.f, 1.f, "angle {:.2f},{:.2f} ({:.2f} deg)",
                            dir.x, dir.y, glm::degrees(angle+M_PIf));
-        render.render_thing(sdf4);
-        render.render_thing(sdf3);
+        shapes.push(sdf4);
+        shapes.push(sdf3);
       }}
-
-      // render.render_thing(sdf2);
+      shapes.render(1u);
 
       // render.render_text(mouse_pos.x-180.f, 50.f+mouse_pos.y+render.viewport().y, 1.f,
       //                    "BAKA DETECTED");
-      // render.render_thing(bez);
 
       render.end_render();
     },
   });
+  // Nothing running on the reactor may outlive the map
+  reactor.stop();
   render_ctx::destroy();
 
 // ntf::thread_pool threadpool;
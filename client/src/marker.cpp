@@ -1,70 +1,111 @@
 #include "./marker.hpp"
 
-gps_marker::gps_marker(pipeline_t handle, buffer_t uniform_buffer,
-                       float point_rad, float pres_rad) noexcept :
-  _pipeline{handle}, _uniform_buffer{uniform_buffer},
-  _point_rad{point_rad}, _pres_rad{pres_rad},
-  _pos{0.f, 0.f} {}
+marker_layer::marker_layer(pipeline_t pipeline, buffer_t instance_buffer,
+                           uint32 capacity) noexcept :
+  _pipeline{pipeline}, _instance_buffer{instance_buffer}, _capacity{capacity}
+{
+  _instances.reserve(capacity);
+}
+
+void marker_layer::render(uint32 sort) {
+  if (_instances.empty()) {
+    return;
+  }
+  auto& r = render_ctx::instance();
+  r.get_buffer(_instance_buffer).upload(0u, _instances.size()*sizeof(instance_data),
+                                        _instances.data());
+  r.render_instanced(_pipeline, _instance_buffer, INSTANCE_BINDING,
+                     static_cast<uint32>(_instances.size()), sort);
+}
 
-std::pair<pipeline_t, buffer_t> gps_marker::write_uniforms() {
+shape_layer::shape_layer(pipeline_t pipeline, buffer_t instance_buffer,
+                         uint32 capacity) noexcept :
+  _pipeline{pipeline}, _instance_buffer{instance_buffer}, _capacity{capacity}
+{
+  _instances.reserve(capacity);
+}
+
+void shape_layer::render(uint32 sort) {
+  if (_instances.empty()) {
+    return;
+  }
   auto& r = render_ctx::instance();
-  const auto buff = r.get_buffer(_uniform_buffer); 
-  const shader_data data {
-    .view = r.get_view(),
-    .pos = _pos,
-    .point_rad = _point_rad,
-    .pres_rad = _pres_rad,
-  };
-  buff.upload(0u, sizeof(shader_data), &data);
-  return std::make_pair(_pipeline, _uniform_buffer);
-}
-
-map_shape::map_shape(pipeline_t pipeline, buffer_t uniform_buffer, const color4& color,
-                     float nsides, float radius, float rot) noexcept :
-  _pipeline{pipeline}, _uniform_buffer{uniform_buffer},
+  if (_instances.size() > _capacity) {
+    while (_capacity < _instances.size()) {
+      _capacity *= 2u;
+    }
+    logger::debug("[shape_layer] Growing to {} shapes", _capacity);
+    r.destroy_buffer(_instance_buffer);
+    _instance_buffer = r.make_buffer(_capacity*sizeof(instance_data),
+                                     ntf::r_buffer_type::shader_storage);
+  }
+  r.get_buffer(_instance_buffer).upload(0u, _instances.size()*sizeof(instance_data),
+                                        _instances.data());
+  r.render_instanced(_pipeline, _instance_buffer, INSTANCE_BINDING,
+                     static_cast<uint32>(_instances.size()), sort);
+}
+
+map_shape::map_shape(const color4& color, float nsides, float radius, float rot) noexcept :
   _color{color}, _color_out{0.f, 0.f, 0.f, 1.f},
   _nsides{nsides}, _radius{radius}, _rot{rot}, _out_width{0.f},
   _pos{0.f, 0.f} {}
 
-std::pair<pipeline_t, buffer_t> map_shape::write_uniforms() {
-  auto& r = render_ctx::instance();
-  const auto buff = r.get_buffer(_uniform_buffer); 
-  const shader_data data {
-    .view = r.get_view(),
-    .color = _color,
-    .out_color = _color_out,
-    .pos = _pos,
-    .radius = _radius,
-    .rot = _rot,
-    .out_width = _out_width,
-    .nsides = _nsides,
-  };
-  buff.upload(0u, sizeof(shader_data), &data);
-  return std::make_pair(_pipeline, _uniform_buffer);
-}
-
-static constexpr std::string_view frag_gps_marker = R"glsl(
+static constexpr std::string_view vert_marker = R"glsl(
 #version 460 core
 
-out vec4 frag_color;
+layout (location = 0) in vec3 att_coords;
+layout (location = 1) in vec3 att_normals;
+layout (location = 2) in vec2 att_texcoords;
 
-layout (std140, binding = 1) uniform frag_data {
-  mat4 u_view;
-  vec2 u_pos;
-  float u_point_rad;
-  float u_pres_rad;
+struct marker_instance {
+  vec4 color;
+  vec2 pos;
+  float point_rad;
+  float pres_rad;
 };
 
-const vec4 point_color = vec4(.164f, .715f, .965f, 1.f);
+layout (std430, binding = 3) readonly buffer marker_instances {
+  marker_instance instances[];
+};
+
+out vec2 local_pos; // pixels from the marker center
+flat out vec4 point_color;
+flat out float point_rad;
+flat out float pres_rad;
+
+void main() {
+  marker_instance marker = instances[gl_InstanceID];
+
+  // Markers keep their size on screen, the quad gets scaled in pixels around the center
+  float extent = max(marker.point_rad, marker.pres_rad) + 2.f;
+  local_pos = att_coords.xy*2.f*extent;
+  vec4 center = u_proj*u_view*vec4(marker.pos, 0.f, 1.f);
+  vec2 pixel_size = vec2(u_proj[0][0], u_proj[1][1]);
+  gl_Position = vec4(center.xy + local_pos*pixel_size*center.w, center.z, center.w);
+
+  point_color = marker.color;
+  point_rad = marker.point_rad;
+  pres_rad = marker.pres_rad;
+}
+)glsl";
+
+static constexpr std::string_view frag_marker = R"glsl(
+#version 460 core
+
+in vec2 local_pos;
+flat in vec4 point_color;
+flat in float point_rad;
+flat in float pres_rad;
+out vec4 frag_color;
+
 const vec4 point_outline_color = vec4(.1f, .1f, .1f, 1.f);
 const float point_outline_width = 1.5f;
 
-const vec4 pres_color = vec4(.703f, .898f, .988f, .3f);
 const vec4 pres_outline_color = vec4(.4f, .4f, .4f, .5f);
 const float pres_outline_width = 1.f;
 
 float circle_dist(vec2 p, float radius) {
-	return length(p) - radius;
+  return length(p) - radius;
 }
 
 float sdf_mask(float dist) {
@@ -77,20 +118,15 @@ float sdf_outline_mask(float dist, float width) {
   return alpha1 - alpha2;
 }
 
-vec4 fill_sdf(float dist, vec4 color) {
-  return mix(vec4(0.f), color, clamp(-dist, 0.f, 1.f));
-}
-
 void main() {
-	vec4 pos = u_view*vec4(-gl_FragCoord.xy+u_pos, 0.f, 1.f);
-
+  vec4 pres_color = vec4(mix(point_color.rgb, vec3(1.f), .65f), .3f*point_color.a);
   vec4 out_color = vec4(0.f);
 
-  float pres_dist = circle_dist(pos.xy, u_pres_rad);
+  float pres_dist = circle_dist(local_pos, pres_rad);
   out_color = mix(out_color, pres_color, sdf_mask(pres_dist));
   out_color = mix(out_color, pres_outline_color, sdf_outline_mask(pres_dist, pres_outline_width));
 
-  float point_dist = circle_dist(pos.xy, u_point_rad);
+  float point_dist = circle_dist(local_pos, point_rad);
   out_color = mix(out_color, point_color,
                   sdf_mask(point_dist));
   out_color = mix(out_color, point_outline_color,
@@ -100,6 +136,58 @@ void main() {
 }
 )glsl";
 
+static constexpr std::string_view vert_shape = R"glsl(
+#version 460 core
+
+#define PI 3.14159
+
+layout (location = 0) in vec3 att_coords;
+layout (location = 1) in vec3 att_normals;
+layout (location = 2) in vec2 att_texcoords;
+
+struct shape_instance {
+  vec4 color;
+  vec4 out_color;
+  vec2 pos;
+  float radius;
+  float rot;
+  float out_width;
+  float nsides;
+};
+
+layout (std430, binding = 5) readonly buffer shape_instances {
+  shape_instance instances[];
+};
+
+out vec2 local_pos; // pixels from the shape center
+flat out vec4 shape_color;
+flat out vec4 shape_out_color;
+flat out float shape_radius; // pixels
+flat out float shape_rot;
+flat out float shape_out_width;
+flat out float shape_nsides;
+
+void main() {
+  shape_instance shape = instances[gl_InstanceID];
+
+  // Shapes scale with the map, the quad has to reach the corners of the polygon
+  float radius = shape.radius*u_zoom;
+  float corner = shape.nsides <= 1.f ? radius : radius/cos(PI/shape.nsides);
+  float extent = corner + 1.f;
+  local_pos = att_coords.xy*2.f*extent;
+  vec4 center = u_proj*u_view*vec4(shape.pos, 0.f, 1.f);
+  vec2 pixel_size = vec2(u_proj[0][0], u_proj[1][1]);
+  gl_Position = vec4(center.xy + local_pos*pixel_size*center.w, center.z, center.w);
+
+  shape_color = shape.color;
+  shape_out_color = shape.out_color;
+  shape_radius = radius;
+  shape_rot = shape.rot;
+  shape_out_width = shape.out_width;
+  shape_nsides = shape.nsides;
+}
+)glsl";
+
 static constexpr std::string_view frag_shape = R"glsl(
 #version 460 core
 
@@ -107,19 +195,15 @@ static constexpr std::string_view frag_shape = R"glsl(
 #define PI2 (.5 * PI)
 #define TAU (2. * PI)
 
+in vec2 local_pos;
+flat in vec4 shape_color;
+flat in vec4 shape_out_color;
+flat in float shape_radius;
+flat in float shape_rot;
+flat in float shape_out_width;
+flat in float shape_nsides;
 out vec4 frag_color;
 
-layout (std140, binding = 1) uniform frag_data {
-  mat4 u_view;
-  vec4 u_color;
-  vec4 u_out_color;
-  vec2 u_pos;
-  float u_radius;
-  float u_rot;
-  float u_out_width;
-  float u_nsides;
-};
-
 float circle_dist(vec2 p, float radius) {
 	return length(p) - radius;
 }
@@ -146,54 +230,60 @@ float sdf_outline_mask(float dist, float width) {
 }
 
 void main() {
-  vec4 pos = u_view*vec4(-gl_FragCoord.xy+u_pos, 0.f, 1.f);
-
-  vec4 out_color = vec4(0.f);
-
   float dist;
-  if (u_nsides <= 1.f) {
-    dist = circle_dist(pos.xy, u_radius);
+  if (shape_nsides <= 1.f) {
+    dist = circle_dist(local_pos, shape_radius);
   } else {
-    dist = nshape_dist(pos.xy, u_radius, u_nsides, u_rot);
+    dist = nshape_dist(local_pos, shape_radius, shape_nsides, shape_rot);
+  }
+  vec4 out_color = vec4(0.f);
+  out_color = mix(out_color, shape_color, sdf_mask(dist));
+  out_color = mix(out_color, shape_out_color, sdf_outline_mask(dist, shape_out_width));
+  if (out_color.a <= 0.f) {
+    discard;
   }
-  out_color = mix(out_color, u_color, sdf_mask(dist));
-  out_color = mix(out_color, u_out_color, sdf_outline_mask(dist, u_out_width));
 
   frag_color = out_color;
 }
 )glsl";
 
-gps_marker gps_marker::make_marker(float size, float radius) {
+marker_layer marker_layer::make_layer(uint32 capacity) {
   auto& r = render_ctx::instance();
-  auto pip = r.make_pipeline(vert_frag_only_src, frag_gps_marker);
-  auto buff = r.make_buffer(sizeof(shader_data));
-  return gps_marker{pip, buff, size, radius};
+  capacity = std::max(capacity, 1u);
+  auto pip = r.make_pipeline(vert_marker, frag_marker);
+  auto buff = r.make_buffer(capacity*sizeof(instance_data), ntf::r_buffer_type::shader_storage);
+  return marker_layer{pip, buff, capacity};
+}
+
+shape_layer shape_layer::make_layer(uint32 capacity) {
+  auto& r = render_ctx::instance();
+  capacity = std::max(capacity, 1u);
+  auto pip = r.make_pipeline(vert_shape, frag_shape);
+  auto buff = r.make_buffer(capacity*sizeof(instance_data), ntf::r_buffer_type::shader_storage);
+  return shape_layer{pip, buff, capacity};
 }
 
 map_shape map_shape::make_shape(shape_enum shape, float size, const color4& color)
 {
-  auto& r = render_ctx::instance();
-  auto pip = r.make_pipeline(vert_frag_only_src, frag_shape);
-  auto buff = r.make_buffer(sizeof(shader_data));
   switch (shape) {
     case shape_enum::S_CIRCLE: {
-      return map_shape{pip, buff, color, 0.f, size, 0.f};
+      return map_shape{color, 0.f, size, 0.f};
       break;
     }
     case shape_enum::S_TRIANGLE: {
-      return map_shape{pip, buff, color, 3.f, size, M_PIf};
+      return map_shape{color, 3.f, size, M_PIf};
       break;
     }
     case shape_enum::S_SQUARE: {
-      return map_shape{pip, buff, color, 4.f, size, 0.f};
+      return map_shape{color, 4.f, size, 0.f};
       break;
     }
     case shape_enum::S_DIAMOND: {
-      return map_shape{pip, buff, color, 4.f, size, M_PIf*.25f};
+      return map_shape{color, 4.f, size, M_PIf*.25f};
       break;
     }
     case shape_enum::S_PENTAGON: {
-      return map_shape{pip, buff, color, 5.f, size, M_PIf};
+      return map_shape{color, 5.f, size, M_PIf};
       break;
     }
   }
@@ -2,53 +2,51 @@
 
 #include "./renderer.hpp"
 
-class gps_marker final : public rendering_rule {
+// Every tracker marker in one instanced draw. Each instance is a quad just big enough to
+// cover its marker, the circles are drawn with signed distance functions
+class marker_layer {
+public:
+  static constexpr uint32 INSTANCE_BINDING = 3u;
+
 private:
-  struct shader_data {
-    ntf::mat4 view;
-    ntf::vec2 pos;
-    float point_rad;
+  // std430, has to match the shaders in marker.cpp
+  struct instance_data {
+    color4 color;
+    vec2 pos;
+    float point_rad; // screen pixels
     float pres_rad;
   };
 
 private:
-  gps_marker(pipeline_t pipeline, buffer_t uniform_buffer,
-             float point_rad, float pres_rad) noexcept;
+  marker_layer(pipeline_t pipeline, buffer_t instance_buffer, uint32 capacity) noexcept;
 
 public:
-  static gps_marker make_marker(float size, float radius);
+  static marker_layer make_layer(uint32 capacity);
 
 public:
-  std::pair<pipeline_t, buffer_t> write_uniforms() override;
+  void clear() { _instances.clear(); }
 
-  void set_pos(vec2 pos) { _pos = pos; }
-  void set_radius(float radius) { _pres_rad = radius; }
-  void set_size(float size) { _point_rad = size; }
+  // Markers past the capacity get dropped
+  void push(vec2 pos, float size, float radius, const color4& color) {
+    if (_instances.size() < _capacity) {
+      _instances.emplace_back(color, pos, size, radius);
+    }
+  }
+  void render(uint32 sort = 0u);
 
 public:
-  vec2 pos() const { return _pos; }
-  float size() const { return _point_rad; }
+  uint32 capacity() const { return _capacity; }
+  uint32 size() const { return static_cast<uint32>(_instances.size()); }
 
 private:
   pipeline_t _pipeline;
-  buffer_t _uniform_buffer;
-  float _point_rad, _pres_rad;
-  vec2 _pos;
+  buffer_t _instance_buffer;
+  uint32 _capacity;
+  std::vector<instance_data> _instances;
 };
 
-class map_shape final : public rendering_rule {
-private:
-  struct shader_data {
-    ntf::mat4 view;
-    color4 color;
-    color4 out_color;
-    vec2 pos;
-    float radius;
-    float rot;
-    float out_width;
-    float nsides;
-  };
-
+// Plain description of a shape pinned to the map, see shape_layer
+class map_shape {
 public:
   enum shape_enum {
     S_CIRCLE,
@@ -59,20 +57,18 @@ public:
   };
 
 private:
-  map_shape(pipeline_t pipeline, buffer_t uniform_buffer, const color4& color,
-            float nsides, float radius, float rot) noexcept;
+  map_shape(const color4& color, float nsides, float radius, float rot) noexcept;
 
 public:
+  // `size` in world units, the distance from the center to the sides
   static map_shape make_shape(shape_enum shape, float size, const color4& color);
 
 public:
-  std::pair<pipeline_t, buffer_t> write_uniforms() override;
-
   void set_pos(vec2 pos) { _pos = pos; }
   void set_size(float size) { _radius = size; }
   void set_color(const color4& col) { _color = col; }
   void set_outline_color(const color4& col) { _color_out = col; }
-  void set_outline_width(float width) { _out_width = width; }
+  void set_outline_width(float width) { _out_width = width; } // screen pixels
   void set_rot(float rot) { _rot = rot; }
 
 public:
@@ -80,20 +76,57 @@ public:
   float size() const { return _radius; }
 
 private:
-  pipeline_t _pipeline;
-  buffer_t _uniform_buffer;
   color4 _color, _color_out;
   float _nsides, _radius, _rot, _out_width;
   vec2 _pos;
+
+private:
+  friend class shape_layer;
 };
 
-class bezier_thing : public rendering_rule {
+// Every map_shape of a frame in one instanced draw, same as marker_layer. The quads are
+// sized after each shape so the fragment cost follows the pixels they cover
+class shape_layer {
 public:
-  bezier_thing(pipeline_t pipeline);
+  static constexpr uint32 INSTANCE_BINDING = 5u;
+
+private:
+  // std430, has to match the shaders in marker.cpp
+  struct instance_data {
+    color4 color;
+    color4 out_color;
+    vec2 pos;
+    float radius;
+    float rot;
+    float out_width;
+    float nsides;
+    float pad[2];
+  };
+  static_assert(sizeof(instance_data) == 64u);
+
+private:
+  shape_layer(pipeline_t pipeline, buffer_t instance_buffer, uint32 capacity) noexcept;
 
 public:
-  std::pair<pipeline_t, buffer_t> write_uniforms() override;
+  static shape_layer make_layer(uint32 capacity);
 
 public:
+  void clear() { _instances.clear(); }
+
+  void push(const map_shape& shape) {
+    _instances.emplace_back(shape._color, shape._color_out, shape._pos, shape._radius,
+                            shape._rot, shape._out_width, shape._nsides);
+  }
+  // The instance buffer doubles when the shapes don't fit anymore
+  void render(uint32 sort = 0u);
+
+public:
+  uint32 capacity() const { return _capacity; }
+  uint32 size() const { return static_cast<uint32>(_instances.size()); }
+
+private:
   pipeline_t _pipeline;
+  buffer_t _instance_buffer;
+  uint32 _capacity;
+  std::vector<instance_data> _instances;
 };
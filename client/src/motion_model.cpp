@@ -0,0 +1,78 @@
+#include "./motion_model.hpp"
+
+static float seconds(chrono_clock::duration dt) {
+  return std::chrono::duration<float>(dt).count();
+}
+
+motion_model::motion_model(const config_t& config) noexcept :
+  _config{config}
+{
+  _config.fix_noise = std::max(_config.fix_noise, 1e-3f);
+  _config.blend_time = std::max(_config.blend_time, 1e-3f);
+}
+
+void motion_model::correct(uint16_t device, vec2 pos, chrono_clock::time_point time) {
+  const float r = _config.fix_noise*_config.fix_noise;
+  auto [it, added] = _tracks.try_emplace(device);
+  auto& track = it->second;
+  if (added) {
+    track.pos = pos;
+    track.vel = vec2{0.f};
+    track.p00 = r;
+    track.p01 = 0.f;
+    track.p11 = _config.max_speed*_config.max_speed;
+    track.time = time;
+    track.offset = vec2{0.f};
+    return;
+  }
+  if (time < track.time) {
+    return;
+  }
+
+  // Where the marker is right now, the correction starts from there
+  const vec2 shown = _display(track, time);
+
+  // Predict up to the fix, the acceleration noise grows the covariance with dt
+  const float dt = seconds(time - track.time);
+  const float q = _config.accel_noise*_config.accel_noise;
+  const float dt2 = dt*dt;
+  track.pos += track.vel*dt;
+  track.p00 += dt*(2.f*track.p01 + dt*track.p11) + q*dt2*dt2*.25f;
+  track.p01 += dt*track.p11 + q*dt2*dt*.5f;
+  track.p11 += q*dt2;
+
+  // Update, only the position gets measured
+  const float s = track.p00 + r;
+  const float k0 = track.p00/s;
+  const float k1 = track.p01/s;
+  const vec2 innovation = pos - track.pos;
+  track.pos += innovation*k0;
+  track.vel += innovation*k1;
+  track.p11 -= k1*track.p01;
+  track.p00 *= 1.f - k0;
+  track.p01 *= 1.f - k0;
+  track.time = time;
+  track.offset = shown - track.pos;
+}
+
+std::optional<vec2> motion_model::predict(uint16_t device, chrono_clock::time_point time) const {
+  const auto it = _tracks.find(device);
+  if (it == _tracks.end()) {
+    return std::nullopt;
+  }
+  return _display(it->second, time);
+}
+
+std::optional<vec2> motion_model::velocity(uint16_t device) const {
+  const auto it = _tracks.find(device);
+  if (it == _tracks.end()) {
+    return std::nullopt;
+  }
+  return it->second.vel;
+}
+
+vec2 motion_model::_display(const track_t& track, chrono_clock::time_point time) const {
+  const float dt = std::max(seconds(time - track.time), 0.f);
+  const float ahead = std::min(dt, _config.max_predict);
+  return track.pos + track.vel*ahead + track.offset*std::exp(-dt/_config.blend_time);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "./osm.hpp"
+
+// Where every tracker should be drawn between two fixes. Each device runs a constant
+// velocity Kalman filter in world units, corrected by every fix and extrapolated to the time
+// of each frame. Both axes share the same covariance, so a prediction costs a handful of
+// multiplications.
+// A fix that disagrees with the prediction doesn't snap the marker, the difference gets
+// eased out over `blend_time` seconds.
+class motion_model {
+public:
+  struct config_t {
+    float fix_noise;   // world units, standard deviation of a fix
+    float accel_noise; // world units/s^2, how fast a tracker may change its velocity
+    float max_speed;   // world units/s, velocity uncertainty of a new tracker
+    float max_predict; // seconds past the last fix, then the marker waits for the next one
+    float blend_time;  // seconds
+  };
+
+private:
+  struct track_t {
+    vec2 pos, vel; // at `time`
+    float p00, p01, p11; // covariance of (pos, vel), same for x and y
+    chrono_clock::time_point time;
+    vec2 offset; // displayed minus estimated position when the last fix landed
+  };
+
+public:
+  explicit motion_model(const config_t& config) noexcept;
+
+public:
+  // Fixes older than the last one of the device get ignored
+  void correct(uint16_t device, vec2 pos, chrono_clock::time_point time);
+
+  // Nothing if the device has no fixes yet
+  std::optional<vec2> predict(uint16_t device, chrono_clock::time_point time) const;
+  std::optional<vec2> velocity(uint16_t device) const;
+
+  void remove(uint16_t device) { _tracks.erase(device); }
+  void clear() { _tracks.clear(); }
+
+public:
+  size_t size() const { return _tracks.size(); }
+
+private:
+  vec2 _display(const track_t& track, chrono_clock::time_point time) const;
+
+private:
+  config_t _config;
+  std::unordered_map<uint16_t, track_t> _tracks;
+};
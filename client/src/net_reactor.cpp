@@ -0,0 +1,287 @@
+#include "./net_reactor.hpp"
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <cctype>
+
+static constexpr long CONNECT_TIMEOUT_MS = 10000;
+static constexpr int MAX_POLL_MS = 1000;
+
+// "Name: value\r\n" -> "value", if the name matches (case insensitive)
+static std::optional<std::string> header_value(std::string_view line, std::string_view name) {
+  if (line.size() <= name.size() || line[name.size()] != ':') {
+    return std::nullopt;
+  }
+  for (size_t i = 0u; i < name.size(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(line[i])) !=
+        std::tolower(static_cast<unsigned char>(name[i]))) {
+      return std::nullopt;
+    }
+  }
+  line.remove_prefix(name.size()+1u);
+  while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+    line.remove_prefix(1u);
+  }
+  while (!line.empty() && (line.back() == '\r' || line.back() == '\n' || line.back() == ' ')) {
+    line.remove_suffix(1u);
+  }
+  return std::string{line};
+}
+
+static size_t write_header(char* ptr, size_t size, size_t nmemb, void* user) {
+  auto& res = *static_cast<net_reactor::response_t*>(user);
+  const std::string_view line{ptr, size*nmemb};
+  if (line.starts_with("HTTP/")) {
+    // New response after a redirect or a 100 Continue
+    res.etag.clear();
+    res.last_modified.clear();
+  } else if (auto etag = header_value(line, "ETag")) {
+    res.etag = std::move(*etag);
+  } else if (auto modified = header_value(line, "Last-Modified")) {
+    res.last_modified = std::move(*modified);
+  }
+  return size*nmemb;
+}
+
+bool net_reactor::fetch_op::await_suspend(std::coroutine_handle<> handle) {
+  _handle = handle;
+  return _reactor._submit(this);
+}
+
+bool net_reactor::sleep_op::await_suspend(std::coroutine_handle<> handle) {
+  _handle = handle;
+  return _reactor._add_timer(this);
+}
+
+net_reactor::net_reactor(const config_t& config) :
+  _user_agent{config.user_agent}, _multi{nullptr}, _stop{false}, _stopped{false}
+{
+  static std::once_flag curl_init;
+  std::call_once(curl_init, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+  _multi = curl_multi_init();
+  curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(_multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    static_cast<long>(std::max(config.max_host_connections, 1u)));
+  curl_multi_setopt(_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                    static_cast<long>(std::max(config.max_total_connections, 1u)));
+  _thread = std::thread{[this]() { _run(); }};
+  logger::debug("[net_reactor] Started");
+}
+
+net_reactor::~net_reactor() noexcept {
+  stop();
+  curl_multi_cleanup(_multi);
+}
+
+void net_reactor::stop() {
+  {
+    std::unique_lock lock{_mtx};
+    _stop = true;
+  }
+  curl_multi_wakeup(_multi);
+  if (_thread.joinable()) {
+    _thread.join();
+    logger::debug("[net_reactor] Stopped");
+  }
+}
+
+bool net_reactor::stopping() const {
+  std::unique_lock lock{_mtx};
+  return _stop;
+}
+
+bool net_reactor::post(std::coroutine_handle<> handle) {
+  {
+    std::unique_lock lock{_mtx};
+    if (_stopped) {
+      return false;
+    }
+    _ready.emplace_back(handle);
+  }
+  curl_multi_wakeup(_multi);
+  return true;
+}
+
+bool net_reactor::_submit(fetch_op* op) {
+  {
+    std::unique_lock lock{_mtx};
+    if (_stopped) {
+      op->_res.error = "cancelled";
+      op->_res.cancelled = true;
+      return false;
+    }
+    _submitted.emplace_back(op);
+  }
+  curl_multi_wakeup(_multi);
+  return true;
+}
+
+bool net_reactor::_add_timer(sleep_op* op) {
+  {
+    std::unique_lock lock{_mtx};
+    if (_stopped) {
+      op->_cancelled = true;
+      return false;
+    }
+    _timers.emplace_back(op);
+    std::push_heap(_timers.begin(), _timers.end(), _timer_later);
+  }
+  curl_multi_wakeup(_multi);
+  return true;
+}
+
+size_t net_reactor::_write_body(char* ptr, size_t size, size_t nmemb, void* user) {
+  auto* op = static_cast<fetch_op*>(user);
+  if (op->_req.on_data) {
+    op->_req.on_data({ptr, size*nmemb});
+  } else {
+    op->_res.body.append(ptr, size*nmemb);
+  }
+  return size*nmemb;
+}
+
+bool net_reactor::_timer_later(const sleep_op* a, const sleep_op* b) {
+  return a->_when > b->_when;
+}
+
+void net_reactor::_run() {
+  std::vector<fetch_op*> submitted;
+  std::vector<std::coroutine_handle<>> ready;
+  std::vector<sleep_op*> expired;
+  while (true) {
+    bool stop;
+    int timeout_ms = MAX_POLL_MS;
+    {
+      std::unique_lock lock{_mtx};
+      stop = _stop;
+      submitted.swap(_submitted);
+      ready.swap(_ready);
+      const auto now = clock::now();
+      while (!_timers.empty() && (stop || _timers.front()->_when <= now)) {
+        std::pop_heap(_timers.begin(), _timers.end(), _timer_later);
+        _timers.back()->_cancelled = stop;
+        expired.emplace_back(_timers.back());
+        _timers.pop_back();
+      }
+      if (!_timers.empty()) {
+        const auto wait =
+          std::chrono::ceil<std::chrono::milliseconds>(_timers.front()->_when - now);
+        timeout_ms = std::min(timeout_ms, static_cast<int>(wait.count()));
+      }
+      if (stop && submitted.empty() && ready.empty() && expired.empty() && _transfers.empty()) {
+        // Anything awaited from now on completes right away
+        _stopped = true;
+        break;
+      }
+    }
+
+    for (auto* op : submitted) {
+      if (stop) {
+        _finish(op, 0, "cancelled", true);
+      } else {
+        _start(op);
+      }
+    }
+    submitted.clear();
+    for (auto handle : ready) {
+      handle.resume();
+    }
+    ready.clear();
+    for (auto* op : expired) {
+      op->_handle.resume();
+    }
+    expired.clear();
+
+    if (stop) {
+      auto transfers = std::move(_transfers);
+      _transfers.clear();
+      for (auto& [easy, op] : transfers) {
+        _finish(op, 0, "cancelled", true);
+      }
+      continue;
+    }
+
+    int running = 0;
+    curl_multi_perform(_multi, &running);
+    int left = 0;
+    while (CURLMsg* msg = curl_multi_info_read(_multi, &left)) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      const auto it = _transfers.find(msg->easy_handle);
+      if (it == _transfers.end()) {
+        continue;
+      }
+      auto* op = it->second;
+      _transfers.erase(it);
+      long code = 0;
+      std::string error;
+      if (msg->data.result == CURLE_OK) {
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+      } else {
+        error = curl_easy_strerror(msg->data.result);
+      }
+      _finish(op, code, std::move(error), false);
+    }
+
+    std::unique_lock lock{_mtx};
+    if (!_submitted.empty() || !_ready.empty() || _stop) {
+      continue;
+    }
+    lock.unlock();
+    curl_multi_poll(_multi, nullptr, 0u, std::max(timeout_ms, 0), nullptr);
+  }
+}
+
+void net_reactor::_start(fetch_op* op) {
+  CURL* easy = curl_easy_init();
+  if (!easy) {
+    _finish(op, 0, "curl_easy_init failed", false);
+    return;
+  }
+  curl_slist* headers = nullptr;
+  for (const auto& header : op->_req.headers) {
+    headers = curl_slist_append(headers, header.c_str());
+  }
+  op->_easy = easy;
+  op->_headers = headers;
+
+  curl_easy_setopt(easy, CURLOPT_URL, op->_req.url.c_str());
+  curl_easy_setopt(easy, CURLOPT_USERAGENT, _user_agent.c_str());
+  curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, _write_body);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, op);
+  curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, write_header);
+  curl_easy_setopt(easy, CURLOPT_HEADERDATA, &op->_res);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, static_cast<long>(op->_req.timeout.count()));
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS, CONNECT_TIMEOUT_MS);
+  if (op->_req.idle_timeout.count() > 0) {
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME,
+                     static_cast<long>(op->_req.idle_timeout.count()));
+  }
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  // Wait for an existing connection to multiplex on instead of opening a new one
+  curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+  curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+
+  _transfers.emplace(easy, op);
+  curl_multi_add_handle(_multi, easy);
+}
+
+void net_reactor::_finish(fetch_op* op, long code, std::string error, bool cancelled) {
+  if (op->_easy) {
+    curl_multi_remove_handle(_multi, op->_easy);
+    curl_easy_cleanup(op->_easy);
+    curl_slist_free_all(static_cast<curl_slist*>(op->_headers));
+    op->_easy = nullptr;
+    op->_headers = nullptr;
+  }
+  op->_res.code = code;
+  op->_res.error = std::move(error);
+  op->_res.cancelled = cancelled;
+  op->_handle.resume();
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "./renderer.hpp"
+
+#include <chrono>
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Fire and forget coroutine, the frame gets destroyed once it returns.
+// It starts on the calling thread, co_await net_reactor::schedule() to move onto the reactor.
+struct net_job {
+  struct promise_type {
+    net_job get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+// Lazy coroutine that hands a T back to whoever co_awaits it
+template<typename T>
+class net_task {
+public:
+  struct promise_type {
+    std::optional<T> value;
+    std::coroutine_handle<> continuation;
+
+    net_task get_return_object() noexcept {
+      return net_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+      };
+      return final_awaiter{};
+    }
+    template<typename U>
+    void return_value(U&& val) { value.emplace(std::forward<U>(val)); }
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+private:
+  explicit net_task(std::coroutine_handle<promise_type> handle) noexcept : _handle{handle} {}
+
+public:
+  ~net_task() noexcept { if (_handle) { _handle.destroy(); } }
+  net_task(net_task&& other) noexcept : _handle{std::exchange(other._handle, {})} {}
+  net_task(const net_task&) = delete;
+  net_task& operator=(net_task&&) = delete;
+  net_task& operator=(const net_task&) = delete;
+
+public:
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+    _handle.promise().continuation = continuation;
+    return _handle;
+  }
+  T await_resume() { return std::move(*_handle.promise().value); }
+
+private:
+  std::coroutine_handle<promise_type> _handle;
+};
+
+// Runs every HTTP transfer of the client on a single thread over one curl multi handle,
+// so connections are kept alive and shared (HTTP/2 streams get multiplexed when the
+// server supports it). Coroutines awaiting fetch(), sleep_*() or schedule() are resumed on
+// the reactor thread, keep them short and hand heavy work back to other threads.
+//
+// stop() cancels every pending transfer and timer and runs the coroutines to completion,
+// call it before destroying anything they reference.
+class net_reactor {
+public:
+  using clock = std::chrono::steady_clock;
+
+  struct config_t {
+    std::string_view user_agent;
+    uint32 max_host_connections;
+    uint32 max_total_connections;
+  };
+
+  struct request_t {
+    std::string url;
+    std::vector<std::string> headers{}; // "Name: value"
+    std::chrono::milliseconds timeout{30000}; // whole transfer, 0 to disable
+    std::chrono::seconds idle_timeout{0};     // abort if nothing arrives for this long
+
+    // Streams the body in chunks from the reactor thread instead of filling response_t::body
+    std::function<void(std::string_view)> on_data{};
+  };
+
+  struct response_t {
+    long code; // 0 if the transfer failed
+    std::string body;
+    std::string etag;
+    std::string last_modified;
+    std::string error;
+    bool cancelled;
+  };
+
+  class fetch_op {
+  public:
+    fetch_op(net_reactor& reactor, request_t&& req) noexcept :
+      _reactor{reactor}, _req{std::move(req)}, _res{}, _easy{nullptr}, _headers{nullptr} {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    response_t await_resume() noexcept { return std::move(_res); }
+
+  private:
+    net_reactor& _reactor;
+    request_t _req;
+    response_t _res;
+    std::coroutine_handle<> _handle;
+    void* _easy;
+    void* _headers;
+
+    friend class net_reactor;
+  };
+
+  // Resumes with false if the reactor stopped before the deadline
+  class sleep_op {
+  public:
+    sleep_op(net_reactor& reactor, clock::time_point when) noexcept :
+      _reactor{reactor}, _when{when}, _cancelled{false} {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() const noexcept { return !_cancelled; }
+
+  private:
+    net_reactor& _reactor;
+    clock::time_point _when;
+    std::coroutine_handle<> _handle;
+    bool _cancelled;
+
+    friend class net_reactor;
+  };
+
+  class schedule_op {
+  public:
+    schedule_op(net_reactor& reactor) noexcept : _reactor{reactor} {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) { return _reactor.post(handle); }
+    void await_resume() const noexcept {}
+
+  private:
+    net_reactor& _reactor;
+  };
+
+public:
+  net_reactor(const config_t& config);
+  ~net_reactor() noexcept;
+
+  net_reactor(const net_reactor&) = delete;
+  net_reactor& operator=(const net_reactor&) = delete;
+
+public:
+  fetch_op fetch(request_t req) { return {*this, std::move(req)}; }
+  sleep_op sleep_until(clock::time_point when) { return {*this, when}; }
+  sleep_op sleep_for(clock::duration delay) { return {*this, clock::now() + delay}; }
+
+  // Moves the awaiting coroutine onto the reactor thread. Once the reactor is stopped
+  // it just keeps running where it was, and every fetch() or sleep gets cancelled.
+  schedule_op schedule() { return {*this}; }
+
+  // Resumes `handle` on the reactor thread, false if the reactor already stopped
+  bool post(std::coroutine_handle<> handle);
+
+  void stop();
+  bool stopping() const;
+
+private:
+  void _run();
+  bool _submit(fetch_op* op);
+  bool _add_timer(sleep_op* op);
+  void _start(fetch_op* op);
+  void _finish(fetch_op* op, long code, std::string error, bool cancelled);
+  static bool _timer_later(const sleep_op* a, const sleep_op* b);
+  static size_t _write_body(char* ptr, size_t size, size_t nmemb, void* user);
+
+private:
+  std::string _user_agent;
+  void* _multi;
+  std::thread _thread;
+
+  mutable std::mutex _mtx;
+  std::vector<fetch_op*> _submitted;
+  std::vector<std::coroutine_handle<>> _ready;
+  std::vector<sleep_op*> _timers; // min heap on the deadline
+  bool _stop, _stopped;
+
+  std::unordered_map<void*, fetch_op*> _transfers; // reactor thread only
+};
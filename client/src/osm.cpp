@@ -1,72 +1,175 @@
 #include "osm.hpp"
-
-#include <curlpp/cURLpp.hpp>
-#include <curlpp/Easy.hpp>
-#include <curlpp/Options.hpp>
+#include "fix_history.hpp"
 
 #include <nlohmann/json.hpp>
 
-namespace curlopts = curlpp::Options;
+#include <gps_frame.h>
+
+#include <stb_image.h>
+
+#include <cstring>
 
-static const char* CURL_UA =
-  "Mozilla/5.0 (Windows NT 6.1; Win64; x64; rv:47.0) Gecko/20100101 Firefox/47.0";
 
 static std::string format_osm_url(tile_coord tile, uint32 zoom) {
   return fmt::format("https://tile.openstreetmap.org/{}/{}/{}.png",
                      zoom, tile.x, tile.y);
 }
 
-// Synchronous
-static bool download_to_file(std::string_view url, const fs::path& path) {
-  try {
-    std::ofstream stream{path.c_str(), std::ios::out | std::ios::binary};
-    curlpp::Easy req;
-    req.setOpt(curlopts::Url{url.data()});
-    req.setOpt(curlopts::UserAgent{CURL_UA});
-    req.setOpt(curlopts::WriteStream{&stream});
-    req.setOpt(curlopts::WriteFunction([&](const char* p, size_t sz, size_t nmemb) {
-      stream.write(p, sz*nmemb);
-      return sz*nmemb;
-    }));
-    req.perform();
-    return true;
-  } 
-  catch (curlpp::LogicError& e) {
-    std::cout << e.what() << std::endl;
+static std::string tile_filename(const osm_tile_loader::request_t& req, std::string_view ext) {
+  return fmt::format("osm-{}_{}_{}.{}", req.zoom, req.tile.x, req.tile.y, ext);
+}
+
+static std::optional<tile_image> decode_png(ntf::cspan<uint8_t> data) {
+  int w, h, comp;
+  auto* texels = stbi_load_from_memory(data.data(), static_cast<int>(data.size()),
+                                       &w, &h, &comp, 4);
+  if (!texels) {
+    return std::nullopt;
   }
-  catch (curlpp::RuntimeError& e) {
-    std::cout << e.what() << std::endl;
+  const size_t size = static_cast<size_t>(w)*static_cast<size_t>(h)*4u;
+  tile_image image{
+    .texels = {texels, texels+size},
+    .extent = {static_cast<uint32>(w), static_cast<uint32>(h)},
+    .levels = 1u,
+  };
+  stbi_image_free(texels);
+  return image;
+}
+
+static bool read_file(const fs::path& path, std::vector<uint8_t>& contents) {
+  std::ifstream stream{path, std::ios::in | std::ios::binary | std::ios::ate};
+  if (!stream) {
+    return false;
   }
-  return false;
+  contents.resize(static_cast<size_t>(stream.tellg()));
+  stream.seekg(0);
+  return static_cast<bool>(stream.read(reinterpret_cast<char*>(contents.data()),
+                                       contents.size()));
 }
 
-// Synchronous
-static bool download_string(std::string_view url, std::string& contents) {
-  std::string out;
-  try {
-    curlpp::Easy req;
-    req.setOpt(curlopts::Url{url.data()});
-    req.setOpt(curlopts::Timeout{1});
-    req.setOpt(curlopts::UserAgent{CURL_UA});
-    req.setOpt(curlopts::WriteFunction{[&](const char* p, size_t sz, size_t nmemb) {
-      out.append(p, sz*nmemb);
-      return sz*nmemb;
-    }});
-    req.perform();
-    contents = std::move(out);
-    return true;
+// Levels down to 1x1
+static uint32 mip_levels(ntf::extent2d extent) {
+  uint32 levels = 1u;
+  for (uint32 size = std::max(extent.x, extent.y); size > 1u; size >>= 1u) {
+    ++levels;
   }
-  catch (curlpp::LogicError& e) {
-    std::cout << e.what() << std::endl;
+  return levels;
+}
+
+static size_t mip_chain_bytes(ntf::extent2d extent, uint32 levels) {
+  size_t total = 0u;
+  for (uint32 level = 0u; level < levels; ++level) {
+    total += size_t{std::max(extent.x >> level, 1u)}*std::max(extent.y >> level, 1u)*4u;
   }
-  catch (curlpp::RuntimeError& e) {
-    std::cout << e.what() << std::endl;
+  return total;
+}
+
+// Box filtered mip chain down to 1x1, done by the workers to keep it out of the render thread
+static void generate_mipmaps(tile_image& image) {
+  const uint32 levels = mip_levels(image.extent);
+  image.texels.resize(mip_chain_bytes(image.extent, levels));
+
+  size_t src_offset = 0u;
+  for (uint32 level = 1u; level < levels; ++level) {
+    const auto src_ext = image.level_extent(level-1u);
+    const auto dst_ext = image.level_extent(level);
+    const size_t dst_offset = src_offset + src_ext.x*src_ext.y*4u;
+    const auto* src = image.texels.data() + src_offset;
+    auto* dst = image.texels.data() + dst_offset;
+    for (uint32 y = 0u; y < dst_ext.y; ++y) {
+      const uint32 y0 = std::min(2u*y, src_ext.y-1u);
+      const uint32 y1 = std::min(2u*y+1u, src_ext.y-1u);
+      for (uint32 x = 0u; x < dst_ext.x; ++x) {
+        const uint32 x0 = std::min(2u*x, src_ext.x-1u);
+        const uint32 x1 = std::min(2u*x+1u, src_ext.x-1u);
+        for (uint32 c = 0u; c < 4u; ++c) {
+          const uint32 sum =
+            src[(y0*src_ext.x + x0)*4u + c] + src[(y0*src_ext.x + x1)*4u + c] +
+            src[(y1*src_ext.x + x0)*4u + c] + src[(y1*src_ext.x + x1)*4u + c];
+          dst[(y*dst_ext.x + x)*4u + c] = static_cast<ntf::uint8>((sum + 2u) / 4u);
+        }
+      }
+    }
+    src_offset = dst_offset;
+  }
+  image.levels = levels;
+}
+
+// Decoded tile cache file, every mip level follows the header, largest first
+struct decoded_header {
+  static constexpr char MAGIC[4] = {'O', 'S', 'M', 'R'};
+  static constexpr uint32 FORMAT_RGBA8_MIPS = 1u; // 0 was RGBA8 with level 0 only
+
+  char magic[4];
+  uint32 format;
+  uint32 width, height;
+  uint32 levels;
+};
+
+// Only full mip chains of TILE_SIZE tiles get cached, anything else is an outdated, corrupt
+// or foreign file and gets decoded from the PNG again
+static std::optional<tile_image> read_decoded(const fs::path& path) {
+  std::ifstream stream{path, std::ios::in | std::ios::binary | std::ios::ate};
+  if (!stream) {
+    return std::nullopt;
+  }
+  const auto file_size = static_cast<size_t>(stream.tellg());
+  stream.seekg(0);
+  decoded_header header;
+  if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, decoded_header::MAGIC, sizeof(header.magic)) != 0 ||
+      header.format != decoded_header::FORMAT_RGBA8_MIPS) {
+    return std::nullopt;
+  }
+  const ntf::extent2d extent{osm_tileset::TILE_SIZE, osm_tileset::TILE_SIZE};
+  const uint32 levels = mip_levels(extent);
+  const size_t texel_bytes = mip_chain_bytes(extent, levels);
+  if (header.width != extent.x || header.height != extent.y || header.levels != levels ||
+      file_size - sizeof(header) < texel_bytes) {
+    logger::warning("[osm_tile_loader] Invalid decoded tile \"{}\" ({}x{}, {} levels, {} bytes)",
+                    path.c_str(), header.width, header.height, header.levels, file_size);
+    return std::nullopt;
   }
-  return false;
+  tile_image image{
+    .texels = std::vector<ntf::uint8>(texel_bytes),
+    .extent = extent,
+    .levels = levels,
+  };
+  if (!stream.read(reinterpret_cast<char*>(image.texels.data()), image.texels.size())) {
+    return std::nullopt;
+  }
+  return image;
+}
+
+static bool write_decoded(const fs::path& path, const tile_image& image) {
+  // Write to a temp file first, other workers might be reading the same tile
+  auto tmp_path = path;
+  tmp_path += fmt::format(".{}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  {
+    std::ofstream stream{tmp_path, std::ios::out | std::ios::binary | std::ios::trunc};
+    decoded_header header{};
+    std::memcpy(header.magic, decoded_header::MAGIC, sizeof(header.magic));
+    header.format = decoded_header::FORMAT_RGBA8_MIPS;
+    header.width = image.extent.x;
+    header.height = image.extent.y;
+    header.levels = image.levels;
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    const size_t texel_bytes = mip_chain_bytes(image.extent, image.levels);
+    stream.write(reinterpret_cast<const char*>(image.texels.data()), texel_bytes);
+    if (!stream.flush()) {
+      stream.close();
+      std::error_code err;
+      fs::remove(tmp_path, err);
+      return false;
+    }
+  }
+  std::error_code err;
+  fs::rename(tmp_path, path, err);
+  return !err;
 }
 
 // https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames#Common_programming_languages
-static tile_coord coord2tile(gps_coord coord, uint32 zoom) {
+tile_coord coord2tile(gps_coord coord, uint32 zoom) {
   const auto lat = glm::radians(coord.x);
   const auto n = static_cast<float>(int{1 << zoom});
   const int xtile = static_cast<int>(n*(coord.y + 180.) / 360.);
@@ -74,16 +177,21 @@ static tile_coord coord2tile(gps_coord coord, uint32 zoom) {
   return {xtile, ytile};
 }
 
-static gps_coord tile2coord(tile_coord tile, uint32 zoom) {
+gps_coord tile2coord(tile_coord tile, uint32 zoom) {
   const auto n = static_cast<float>(int{1 << zoom});
   const float lon = (tile.x/n)*360. - 180.;
   const float lat = glm::degrees(std::atan(std::sinh(M_PI*(1-2*tile.y / n))));
   return {lat, lon};
 }
 
-osm_tileset::osm_tileset(std::vector<tile_t>&& tiles, vec2 min_coord,
-                         vec2 max_coord, vec2 size) noexcept :
-  _tiles{std::move(tiles)}, _min_coord{min_coord}, _max_coord{max_coord}, _size{size} {}
+osm_tileset::osm_tileset(tile_coord min_tile, tile_coord max_tile, uint32 zoom) noexcept :
+  _min_tile{min_tile}, _max_tile{max_tile}, _zoom{zoom},
+  // Convert the tiles again to clamp set the gps coordinate at the corner of the tile
+  _min_coord{tile2coord(min_tile, zoom)}, _max_coord{tile2coord(max_tile, zoom)},
+  _size{
+    (max_tile.x - min_tile.x) *  static_cast<float>(TILE_SIZE),
+    (max_tile.y - min_tile.y) * -static_cast<float>(TILE_SIZE) // Negate to match opengl coordinates
+  } {}
 
 vec2 osm_tileset::pos_from_coord(gps_coord coord) const {
   // In world space, lat maps to y and lng to x
@@ -97,69 +205,768 @@ gps_coord osm_tileset::coord_from_pos(vec2 pos) const {
   return {pos.y*fac_lat + _min_coord.x, pos.x*fac_lng + _min_coord.y};
 }
 
-osm_map::osm_map(fs::path cache_path) :
-  _cache{cache_path}, _gps{} {}
+vec2 osm_tileset::tile_pos(tile_coord tile, uint32 zoom) const {
+  NTF_ASSERT(zoom <= _zoom);
+  // The rendering quad is centered at (0,0) instead of (.5, .5)
+  constexpr float QUAD_CORRECTION = .5f;
+  constexpr float SIZE = static_cast<float>(TILE_SIZE);
+  const int32 span = 1 << (_zoom - zoom); // tileset tiles per tile side
+  return {
+    (tile.x*span-_min_tile.x+QUAD_CORRECTION*span)*SIZE,
+    (tile.y*span-_min_tile.y+QUAD_CORRECTION*span)*-SIZE
+  };
+}
 
-osm_tileset osm_map::load_tiles(gps_coord min_coord, gps_coord max_coord, uint32 zoom) {
-  const auto min_tile = coord2tile(min_coord, zoom);
-  const auto max_tile = coord2tile(max_coord, zoom);
-  logger::debug("[osm_map] min: ({} {}), max: ({} {})",
-                min_tile.x, min_tile.y, max_tile.x, max_tile.y);
+tile_coord osm_tileset::tile_from_pos(vec2 pos, uint32 zoom) const {
+  NTF_ASSERT(zoom <= _zoom);
+  constexpr double SIZE = static_cast<double>(TILE_SIZE);
+  const double span = static_cast<double>(1 << (_zoom - zoom));
+  return {
+    static_cast<int32>(std::floor((pos.x/SIZE + _min_tile.x)/span)),
+    static_cast<int32>(std::floor((-pos.y/SIZE + _min_tile.y)/span))
+  };
+}
+
+osm_tile_loader::osm_tile_loader(net_reactor& reactor, fs::path cache_path,
+                                 const download_scheduler::config_t& downloads,
+                                 uint32 worker_count, bool decoded_cache) :
+  _reactor{reactor}, _downloads{reactor, downloads},
+  _cache{cache_path}, _archive{tile_archive::open(cache_path / ARCHIVE_NAME)},
+  _decoded{decoded_cache ? cache_path / DECODED_DIR : fs::path{}},
+  _in_flight{0u}, _fetching{0u}, _stop{false}, _stats{}
+{
+  worker_count = std::max(worker_count, 1u);
+  _workers.reserve(worker_count);
+  for (uint32 i = 0; i < worker_count; ++i) {
+    _workers.emplace_back([this]() { _worker_loop(); });
+  }
+  logger::debug("[osm_tile_loader] Started {} workers", worker_count);
+}
+
+osm_tile_loader::~osm_tile_loader() noexcept {
+  {
+    std::unique_lock lock{_queue_mtx};
+    _stop = true;
+    _queue.clear();
+    _prefetch.clear();
+    _fetched.clear();
+  }
+  _queue_cv.notify_all();
+  for (auto& worker : _workers) {
+    worker.join();
+  }
+
+  // Downloads still running on the reactor point back to the loader
+  std::unique_lock lock{_queue_mtx};
+  _queue_cv.wait(lock, [this]() { return _fetching == 0u; });
+}
+
+void osm_tile_loader::enqueue(std::vector<request_t>&& reqs, tile_coord center, bool urgent) {
+  std::stable_sort(reqs.begin(), reqs.end(), [center](const request_t& a, const request_t& b) {
+    const auto da = a.tile - center;
+    const auto db = b.tile - center;
+    return da.x*da.x + da.y*da.y < db.x*db.x + db.y*db.y;
+  });
+  {
+    std::unique_lock lock{_queue_mtx};
+    _queue.insert(urgent ? _queue.begin() : _queue.end(),
+                  std::make_move_iterator(reqs.begin()), std::make_move_iterator(reqs.end()));
+  }
+  _queue_cv.notify_all();
+}
+
+void osm_tile_loader::clear_pending() {
+  std::unique_lock lock{_queue_mtx};
+  _queue.clear();
+}
+
+void osm_tile_loader::prefetch(std::vector<request_t>&& reqs) {
+  {
+    std::unique_lock lock{_queue_mtx};
+    _prefetch.insert(_prefetch.end(),
+                     std::make_move_iterator(reqs.begin()), std::make_move_iterator(reqs.end()));
+    // The path ahead changes with every fix, stale predictions are the least useful
+    while (_prefetch.size() > MAX_PREFETCH) {
+      _prefetch.pop_front();
+    }
+  }
+  {
+    std::unique_lock lock{_stats_mtx};
+    _stats.queued += static_cast<uint32>(reqs.size());
+  }
+  _queue_cv.notify_all();
+}
+
+auto osm_tile_loader::prefetch_stats() const -> prefetch_stats_t {
+  std::unique_lock lock{_stats_mtx};
+  return _stats;
+}
+
+uint32 osm_tile_loader::pending() const {
+  std::unique_lock lock{_queue_mtx};
+  return static_cast<uint32>(_queue.size() + _fetched.size()) + _in_flight + _fetching;
+}
+
+void osm_tile_loader::_worker_loop() {
+  while (true) {
+    std::unique_lock lock{_queue_mtx};
+    _queue_cv.wait(lock, [this]() {
+      return _stop || !_fetched.empty() || !_queue.empty() || !_prefetch.empty();
+    });
+    if (_stop) {
+      return;
+    }
+
+    // Downloaded tiles first, the network round trip was already paid for
+    request_t req;
+    bool refreshed = false;
+    if (!_fetched.empty()) {
+      req = _fetched.front().req;
+      refreshed = _fetched.front().refreshed;
+      _fetched.pop_front();
+    } else if (!_queue.empty()) {
+      req = _queue.front();
+      _queue.pop_front();
+      if (_needs_fetch(req)) {
+        ++_fetching;
+        lock.unlock();
+        _fetch_tile(req, false);
+        continue;
+      }
+    } else {
+      req = _prefetch.front();
+      _prefetch.pop_front();
+      lock.unlock();
+      _prefetch_tile(req);
+      continue;
+    }
+    ++_in_flight;
+    lock.unlock();
+
+    auto tile = _load_tile(req, refreshed);
+    {
+      std::unique_lock done_lock{_done_mtx};
+      _done.emplace_back(req, std::move(tile));
+    }
+
+    lock.lock();
+    --_in_flight;
+  }
+}
 
-  const uint32 tile_count = (1 + max_tile.x - min_tile.x)*(1 + max_tile.y - min_tile.y);
-  logger::info("[osm_map] Fetching {} tiles!", tile_count);
+bool osm_tile_loader::_needs_fetch(const request_t& req) const {
+  // Only loose files get revalidated, archived tiles stay as they were packed
+  const auto file = _cache / tile_filename(req, "png");
+  if (fs::exists(file)) {
+    return _downloads.is_stale(file);
+  }
+  if (_archive && !_archive->find(req.zoom, req.tile.x, req.tile.y).empty()) {
+    return false;
+  }
+  return _decoded.empty() || !fs::exists(_decoded / tile_filename(req, "rgba"));
+}
+
+net_job osm_tile_loader::_fetch_tile(request_t req, bool prefetch) {
+  co_await _reactor.schedule();
+  if (_reactor.stopping()) {
+    // schedule() resumes inline once the reactor is gone, don't race the loader threads
+    std::unique_lock lock{_queue_mtx};
+    --_fetching;
+    _queue_cv.notify_all();
+    co_return;
+  }
+
+  const auto file = _cache / tile_filename(req, "png");
+  const auto url = format_osm_url(req.tile, req.zoom);
+  const bool existed = fs::exists(file);
+  if (existed) {
+    logger::debug(" - ({}, {}) -> [REVALIDATE]", req.tile.x, req.tile.y);
+  }
+  const auto status = co_await _downloads.fetch(url, file);
+  const bool downloaded = status == download_scheduler::fetch_status::downloaded;
+
+  if (prefetch) {
+    logger::debug(" - ({}, {}) -> [PREFETCH {}]",
+                  req.tile.x, req.tile.y, downloaded ? "OK" : "FAILED");
+    std::unique_lock lock{_stats_mtx};
+    if (downloaded) {
+      ++_stats.fetched;
+      _prefetched.emplace(tile_key{req.tile, req.zoom});
+    } else {
+      ++_stats.failed;
+    }
+  } else if (!downloaded && !existed && status != download_scheduler::fetch_status::not_found) {
+    logger::error("Failed to download from url \"{}\"", url);
+  }
+
+  // A failed revalidation still leaves the old copy around
+  std::unique_lock lock{_queue_mtx};
+  if (!prefetch && !_stop) {
+    if (downloaded || existed) {
+      _fetched.emplace_back(req, downloaded);
+    } else {
+      std::unique_lock done_lock{_done_mtx};
+      _done.emplace_back(req, std::nullopt);
+    }
+  }
+  --_fetching;
+  _queue_cv.notify_all();
+}
 
+std::optional<osm_tileset::tile_t> osm_tile_loader::_load_tile(const request_t& req,
+                                                               bool refreshed) {
+  {
+    std::unique_lock lock{_stats_mtx};
+    if (_prefetched.erase({req.tile, req.zoom})) {
+      ++_stats.hits;
+    }
+  }
+
+  fs::path decoded_file;
+  if (!_decoded.empty()) {
+    decoded_file = _decoded / tile_filename(req, "rgba");
+  }
+  if (!decoded_file.empty() && !refreshed) {
+    auto image = read_decoded(decoded_file);
+    if (image) {
+      logger::debug(" - ({}, {}) -> [DECODED]", req.tile.x, req.tile.y);
+      return osm_tileset::tile_t{std::move(*image), req.pos, req.tile, req.zoom};
+    }
+    // Outdated or corrupt, without a PNG to rebuild it from the retry has to download it
+    std::error_code err;
+    fs::remove(decoded_file, err);
+  }
+
+  const auto make_tile = [&](ntf::cspan<uint8_t> png) -> std::optional<osm_tileset::tile_t> {
+    auto image = decode_png(png);
+    if (!image) {
+      return std::nullopt;
+    }
+    generate_mipmaps(*image);
+    if (!decoded_file.empty() && !write_decoded(decoded_file, *image)) {
+      logger::warning("Failed to write decoded tile \"{}\"", decoded_file.c_str());
+    }
+    return osm_tileset::tile_t{std::move(*image), req.pos, req.tile, req.zoom};
+  };
+
+  if (_archive && !refreshed) {
+    const auto blob = _archive->find(req.zoom, req.tile.x, req.tile.y);
+    if (!blob.empty()) {
+      logger::debug(" - ({}, {}) -> [IN ARCHIVE]", req.tile.x, req.tile.y);
+      auto tile = make_tile(blob);
+      if (tile) {
+        return tile;
+      }
+      logger::error("Failed to decode archived tile ({}, {})", req.tile.x, req.tile.y);
+    }
+  }
+
+  const fs::path file = _cache / tile_filename(req, "png");
+  logger::debug(" - ({}, {}) -> \"{}\" [IN CACHE]", req.tile.x, req.tile.y, file.c_str());
+  std::vector<uint8_t> png;
+  if (!read_file(file, png)) {
+    logger::error("Failed to read tile \"{}\"", file.c_str());
+    return std::nullopt;
+  }
+  auto tile = make_tile(png);
+  if (!tile) {
+    logger::error("Failed to decode tile \"{}\"", file.c_str());
+  }
+  return tile;
+}
+
+void osm_tile_loader::_prefetch_tile(const request_t& req) {
+  const bool cached = fs::exists(_cache / tile_filename(req, "png")) ||
+    (_archive && !_archive->find(req.zoom, req.tile.x, req.tile.y).empty()) ||
+    (!_decoded.empty() && fs::exists(_decoded / tile_filename(req, "rgba")));
+  if (cached) {
+    std::unique_lock lock{_stats_mtx};
+    ++_stats.cached;
+    return;
+  }
+  {
+    std::unique_lock lock{_queue_mtx};
+    ++_fetching;
+  }
+  _fetch_tile(req, true);
+}
+
+osm_map::osm_map(net_reactor& reactor, fs::path cache_path,
+                 const download_scheduler::config_t& downloads,
+                 uint32 loader_threads, bool decoded_cache) :
+  _reactor{reactor}, _cache{cache_path}, _decoded_cache{decoded_cache}, _device_count{0u},
+  _devices{},
+  _loader{reactor, cache_path, downloads, loader_threads, decoded_cache}
+{
   if (!fs::exists(_cache)) {
     logger::info("Creating tile cache directory \"{}\"", _cache.c_str());
     if (!fs::create_directory(_cache)) {
       logger::warning("Failed to create cache directory!!!");
     }
   }
-  constexpr float TILE_SIZE = static_cast<float>(osm_tileset::TILE_SIZE);
-  const vec2 tileset_sz {
-    (max_tile.x - min_tile.x) *  TILE_SIZE,
-    (max_tile.y - min_tile.y) * -TILE_SIZE // Negate to match opengl coordinates
-  }; //in world space
-  logger::debug("TILESET: {}x{}", tileset_sz.x, tileset_sz.y);
-  
-  std::vector<osm_tileset::tile_t> tiles;
-  tiles.reserve(tile_count);
-
-  // The rendering quad is centered at (0,0) instead of (.5, .5)
-  constexpr float QUAD_CORRECTION = .5f;
-  for (int32 tile_x = min_tile.x; tile_x <= max_tile.x; ++tile_x) {
-    for (int32 tile_y = min_tile.y; tile_y <= max_tile.y; ++tile_y) {
-      const vec2 world_pos{
-        (tile_x-min_tile.x+QUAD_CORRECTION)*TILE_SIZE,
-        (tile_y-min_tile.y+QUAD_CORRECTION)*-TILE_SIZE
-      };
-      const auto filename = fmt::format("osm-{}_{}_{}.png", zoom, tile_x, tile_y);
-      const fs::path file = _cache / filename;
-      const bool exists = fs::exists(file);
-      logger::debug(" - ({}, {}) -> \"{}\" [{}]",
-                    tile_x, tile_y, file.c_str(),
-                    exists ? "IN CACHE" : "NOT IN CACHE");
-      if (!exists) {
-        const auto url = format_osm_url({tile_x, tile_y}, zoom);
-        if (!download_to_file(url, file.c_str())) {
-          logger::error("Failed to download from url \"{}\"", url);
-          continue;
-        }
-      }
-      tiles.emplace_back(ntf::load_image<ntf::uint8>(file.string()).value(), world_pos);
+  const auto decoded_dir = _cache / osm_tile_loader::DECODED_DIR;
+  if (_decoded_cache && !fs::exists(decoded_dir)) {
+    logger::info("Creating decoded tile cache directory \"{}\"", decoded_dir.c_str());
+    if (!fs::create_directory(decoded_dir)) {
+      logger::warning("Failed to create decoded cache directory!!!");
     }
   }
-  // Convert the tiles again to clamp set the gps coordinate at the corner of the tile
-  return {std::move(tiles), tile2coord(min_tile, zoom), tile2coord(max_tile, zoom), tileset_sz};
+}
+
+osm_tileset osm_map::make_tileset(gps_coord min_coord, gps_coord max_coord, uint32 zoom) const {
+  const auto min_tile = coord2tile(min_coord, zoom);
+  const auto max_tile = coord2tile(max_coord, zoom);
+  logger::debug("[osm_map] min: ({} {}), max: ({} {})",
+                min_tile.x, min_tile.y, max_tile.x, max_tile.y);
+  return {min_tile, max_tile, zoom};
 }
 
 auto osm_map::query_gps() -> gps_query {
   gps_query query;
-  query.info = fmt::format("conn: {}\npos: ({}, {})\nsat: {}\nlast update: {}",
-                           _gps.available, _gps.lat, _gps.lng, _gps.sat_c, _gps.last_update);
+  for (const auto& gps : devices()) {
+    query.info += fmt::format("device {}\nconn: {}\npos: ({}, {})\nsat: {}\nlast update: {}\n",
+                              gps.device, gps.available, gps.lat, gps.lng, gps.sat_c,
+                              gps.last_update);
+  }
   return query;
 }
 
+auto osm_map::devices() -> std::span<const gps_data> {
+  const auto count = _device_count.load(std::memory_order_acquire);
+  for (uint32 i = 0u; i < count; ++i) {
+    _device_state[i].try_load(_devices[i]);
+  }
+  return {_devices.data(), count};
+}
+
+void osm_map::start_gps(std::string url, std::chrono::milliseconds interval) {
+  _poll_gps(std::move(url), interval);
+}
+
+// One device of the receiver JSON, see json_encode() in lora_gps_recv.ino. Calls
+// fun(gps, stamp, seq), the stamp is the receiver timestamp of the last packet and only
+// changes when a new fix arrives. Throws if a field is missing
+template<typename F>
+static void parse_gps_object(const nlohmann::json& contents, F&& fun) {
+  osm_map::gps_data gps{};
+  gps.device = contents.value("id", uint16_t{0}); // older receivers only had one tracker
+  gps.available = static_cast<bool>(contents.at("available").get<int>());
+  gps.rssi = contents.at("rssi").get<int>();
+  gps.time = contents.at("time").get<uint32_t>();
+  gps.sat_c = contents.at("sat_count").get<uint32_t>();
+  gps.lat = contents.at("lat").get<float>();
+  gps.lng = contents.at("lng").get<float>();
+  gps.last_update = chrono_clock::now();
+  fun(gps, contents.at("last_update").get<uint32_t>(), contents.value("seq", uint32_t{0}));
+}
+
+// Either a single device or a "/devices" listing
+template<typename F>
+static bool parse_gps_json(std::string_view str, F&& fun) {
+  using nlohmann::json;
+  try {
+    const auto contents = json::parse(str);
+    if (!contents.contains("devices")) {
+      parse_gps_object(contents, fun);
+      return true;
+    }
+    for (const auto& device : contents.at("devices")) {
+      parse_gps_object(device, fun);
+    }
+    return true;
+  }
+  catch (json::exception& e) {
+    logger::error("[osm_map] Failed to parse GPS json {}", e.what());
+    return false;
+  }
+}
+
+// Receiver binary frame, see gps_frame.h. Read in place out of `data`
+template<typename F>
+static bool parse_gps_frame(const uint8_t* data, size_t len, F&& fun) {
+  gps_frame_t frame;
+  if (!gps_frame_decode(data, len, frame)) {
+    logger::error("[osm_map] Invalid GPS frame ({} bytes)", len);
+    return false;
+  }
+  if (frame.flags & GPS_FRAME_KEEPALIVE) {
+    return true;
+  }
+  osm_map::gps_data gps;
+  gps.device = frame.device;
+  gps.available = (frame.flags & GPS_FRAME_AVAILABLE) != 0;
+  gps.rssi = frame.rssi;
+  gps.time = frame.time;
+  gps.sat_c = frame.sat_count;
+  gps.lat = static_cast<float>(gps_frame_from_e7(frame.lat_e7));
+  gps.lng = static_cast<float>(gps_frame_from_e7(frame.lng_e7));
+  gps.last_update = chrono_clock::now();
+  fun(gps, frame.last_update, frame.seq);
+  return true;
+}
+
+// The receiver serves either format, a frame never starts like a JSON object does.
+// Binary responses may hold any number of frames back to back
+template<typename F>
+static bool parse_gps(std::string_view body, F&& fun) {
+  // An empty binary response is zero frames, the receiver had nothing new
+  if (body.empty()) {
+    return true;
+  }
+  const auto* data = reinterpret_cast<const uint8_t*>(body.data());
+  if (!gps_frame_header(data, body.size())) {
+    return parse_gps_json(body, fun);
+  }
+  if (body.size() % GPS_FRAME_SIZE) {
+    logger::error("[osm_map] Truncated GPS frames ({} bytes)", body.size());
+    return false;
+  }
+  for (size_t off = 0u; off < body.size(); off += GPS_FRAME_SIZE) {
+    if (!parse_gps_frame(data+off, GPS_FRAME_SIZE, fun)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Splits a byte stream into GPS frames. Frames are decoded in place out of each chunk,
+// only one split across two chunks gets copied. Garbage between frames is skipped
+class frame_splitter {
+public:
+  template<typename F>
+  void feed(std::string_view chunk, F&& fun) {
+    const auto* data = reinterpret_cast<const uint8_t*>(chunk.data());
+    size_t len = chunk.size();
+    // Finish the split frame, a byte at a time so it can resync on a false start
+    while (_carry_len && len) {
+      _carry[_carry_len++] = *data++;
+      --len;
+      const size_t skip = gps_frame_sync(_carry, _carry_len);
+      std::memmove(_carry, _carry+skip, _carry_len-skip);
+      _carry_len -= skip;
+      if (_carry_len == GPS_FRAME_SIZE) {
+        fun(_carry);
+        _carry_len = 0u;
+      }
+    }
+    if (_carry_len) {
+      return;
+    }
+    while (true) {
+      const size_t skip = gps_frame_sync(data, len);
+      data += skip;
+      len -= skip;
+      if (len < GPS_FRAME_SIZE) {
+        break;
+      }
+      fun(data);
+      data += GPS_FRAME_SIZE;
+      len -= GPS_FRAME_SIZE;
+    }
+    std::memcpy(_carry, data, len);
+    _carry_len = len;
+  }
+
+  void reset() { _carry_len = 0u; }
+
+private:
+  uint8_t _carry[GPS_FRAME_SIZE];
+  size_t _carry_len{0u};
+};
+
+void osm_map::_publish_gps(const gps_data& gps, std::optional<uint32_t> stamp) {
+  auto it = _device_slots.find(gps.device);
+  if (it == _device_slots.end()) {
+    const auto count = _device_count.load(std::memory_order_relaxed);
+    if (count == MAX_DEVICES) {
+      logger::warning("[osm_map] Too many devices, ignoring device {}", gps.device);
+      return;
+    }
+    logger::info("[osm_map] New device {}", gps.device);
+    it = _device_slots.emplace(gps.device, device_slot{count, std::nullopt}).first;
+    _device_state[count].store(gps);
+    _device_count.store(count+1u, std::memory_order_release);
+  }
+
+  // The same packet gets served again until the next one arrives
+  auto& slot = it->second;
+  if (stamp && stamp != slot.stamp && gps.available) {
+    logger::info("[osm_map] GPS data updated for device {}", gps.device);
+    if (!_gps_history.push(gps)) {
+      logger::warning("[osm_map] GPS history full, fix dropped");
+    }
+  }
+  if (stamp) {
+    slot.stamp = stamp;
+  }
+  _device_state[slot.index].store(gps);
+}
+
+void osm_map::_lost_receiver() {
+  for (const auto& [device, slot] : _device_slots) {
+    gps_data gps;
+    _device_state[slot.index].try_load(gps); // never fails, this is the only writer
+    gps.available = false;
+    _device_state[slot.index].store(gps);
+  }
+}
+
+net_job osm_map::_poll_gps(std::string url, std::chrono::milliseconds interval) {
+  co_await _reactor.schedule();
+
+  const char sep = url.find('?') == std::string::npos ? '?' : '&';
+  uint32_t since = 0u;
+  while (!_reactor.stopping()) {
+    auto res = co_await _reactor.fetch({
+      .url = fmt::format("{}{}since={}", url, sep, since),
+      .timeout = std::chrono::seconds{1},
+    });
+    if (res.cancelled) {
+      break;
+    }
+
+    if (res.code == 204) {
+      // Nothing heard from any tracker yet
+    } else if (res.code != 200) {
+      logger::error("[osm_map] Failed to connect to NodeMCU: {}",
+                    res.code ? fmt::format("HTTP {}", res.code) : res.error);
+      _lost_receiver();
+    } else {
+      // The receiver sends everything again after a reboot, its sequence numbers restart
+      std::optional<uint32_t> newest;
+      parse_gps(res.body, [&](const gps_data& gps, uint32_t stamp, uint32_t seq) {
+        newest = std::max(newest.value_or(0u), seq);
+        _publish_gps(gps, stamp);
+      });
+      if (newest) {
+        since = *newest;
+      }
+    }
+
+    if (!co_await _reactor.sleep_for(interval)) {
+      break;
+    }
+  }
+}
+
+void osm_map::start_gps_stream(std::string url) {
+  _stream_gps(std::move(url));
+}
+
+net_job osm_map::_stream_gps(std::string url) {
+  using namespace std::chrono_literals;
+  co_await _reactor.schedule();
+
+  // Fixes get sent again on reconnects, _publish_gps() tells them apart by their stamp
+  bool received = false;
+  const auto publish = [&](const gps_data& gps, uint32_t stamp, uint32_t) {
+    received = true;
+    _publish_gps(gps, stamp);
+  };
+
+  // Either Server-Sent Events (/stream) or raw back to back frames (/frames), told apart
+  // by the first byte of each connection
+  enum class stream_format { unknown, events, frames } format{stream_format::unknown};
+  sse_parser parser;
+  frame_splitter frames;
+  net_reactor::request_t req;
+  req.url = std::move(url);
+  req.headers.emplace_back("Accept: text/event-stream, application/octet-stream");
+  req.timeout = 0ms;
+  req.idle_timeout = GPS_STREAM_IDLE;
+  req.on_data = [&](std::string_view chunk) {
+    if (chunk.empty()) {
+      return;
+    }
+    if (format == stream_format::unknown) {
+      const bool binary = gps_frame_header(reinterpret_cast<const uint8_t*>(chunk.data()), 1u);
+      format = binary ? stream_format::frames : stream_format::events;
+    }
+    if (format == stream_format::frames) {
+      frames.feed(chunk, [&](const uint8_t* frame) {
+        received = true;
+        parse_gps_frame(frame, GPS_FRAME_SIZE, publish);
+      });
+      return;
+    }
+    parser.feed(chunk);
+    sse_parser::event_t event;
+    while (parser.next(event)) {
+      if (event.type == "fix") {
+        parse_gps_json(event.data, publish);
+      }
+    }
+  };
+
+  auto backoff = 1s;
+  while (!_reactor.stopping()) {
+    format = stream_format::unknown;
+    parser.reset();
+    frames.reset();
+    received = false;
+    auto res = co_await _reactor.fetch(req);
+    if (res.cancelled) {
+      break;
+    }
+
+    logger::error("[osm_map] GPS stream closed: {}",
+                  res.code && res.error.empty() ? fmt::format("HTTP {}", res.code) : res.error);
+    _lost_receiver();
+
+    // Reconnect right away after a dropped stream, back off if the receiver is unreachable
+    backoff = received ? 1s : std::min(backoff*2, 30s);
+    if (!co_await _reactor.sleep_for(backoff)) {
+      break;
+    }
+  }
+}
+
+// Recorded fixes, either a fix history directory or a file with one receiver JSON object
+// per line (the "data:" lines of /stream). JSON lines get parsed as they are replayed, so
+// they go through the same parsing as the live ones
+class replay_source {
+public:
+  struct fix_t {
+    osm_map::gps_data gps;
+    uint32_t stamp; // tells fixes apart, see _publish_gps()
+    int64_t time; // milliseconds, only meaningful relative to the other fixes
+  };
+
+public:
+  bool open(const fs::path& path) {
+    if (fs::is_directory(path)) {
+      fix_history history{path, true};
+      for (const auto device : history.devices()) {
+        // Recorded times can repeat, the position of the fix in its segment can't
+        uint32_t seq = 0u;
+        history.query(device, INT64_MIN, INT64_MAX, [&](const fix_history::fix_t& fix) {
+          _fixes.emplace_back(history_gps(device, fix), ++seq, fix.time);
+        });
+      }
+      std::stable_sort(_fixes.begin(), _fixes.end(), [](const fix_t& a, const fix_t& b) {
+        return a.time < b.time;
+      });
+      return true;
+    }
+    std::vector<uint8_t> contents;
+    if (!read_file(path, contents)) {
+      return false;
+    }
+    _lines.assign(contents.begin(), contents.end());
+    return true;
+  }
+
+  // The next recorded fixes, false once there's nothing left
+  bool next(std::vector<fix_t>& out) {
+    out.clear();
+    if (_next < _fixes.size()) {
+      out.emplace_back(_fixes[_next++]);
+      return true;
+    }
+    while (out.empty() && _pos < _lines.size()) {
+      auto end = _lines.find('\n', _pos);
+      if (end == std::string::npos) {
+        end = _lines.size();
+      }
+      const std::string_view line{_lines.data()+_pos, end-_pos};
+      _pos = end+1u;
+      if (line.find_first_not_of(" \t\r") == std::string_view::npos) {
+        continue;
+      }
+      parse_gps_json(line, [&](const osm_map::gps_data& gps, uint32_t stamp, uint32_t) {
+        // The receiver timestamps are millis() since it booted
+        out.emplace_back(gps, stamp, static_cast<int64_t>(stamp));
+      });
+    }
+    return !out.empty();
+  }
+
+private:
+  static osm_map::gps_data history_gps(uint16_t device, const fix_history::fix_t& fix) {
+    const auto secs = (fix.time/1000) % 86400;
+    osm_map::gps_data gps{};
+    gps.device = device;
+    gps.available = true;
+    gps.rssi = fix.rssi;
+    gps.time = static_cast<uint32>((secs/3600)*10000 + (secs/60 % 60)*100 + secs % 60);
+    gps.sat_c = fix.sat_count;
+    gps.lat = static_cast<float>(gps_frame_from_e7(fix.lat_e7));
+    gps.lng = static_cast<float>(gps_frame_from_e7(fix.lng_e7));
+    return gps;
+  }
+
+private:
+  std::vector<fix_t> _fixes;
+  size_t _next{0u};
+  std::string _lines;
+  size_t _pos{0u};
+};
+
+void osm_map::start_gps_replay(fs::path path, float speed) {
+  _replay_gps(std::move(path), speed);
+}
+
+net_job osm_map::_replay_gps(fs::path path, float speed) {
+  using namespace std::chrono_literals;
+  using clock = net_reactor::clock;
+  co_await _reactor.schedule();
+
+  replay_source source;
+  if (!source.open(path)) {
+    logger::error("[osm_map] Failed to open replay \"{}\"", path.c_str());
+    co_return;
+  }
+  if (speed > 0.f) {
+    logger::info("[osm_map] Replaying \"{}\" at {}x", path.c_str(), speed);
+  } else {
+    logger::info("[osm_map] Replaying \"{}\" as fast as possible", path.c_str());
+  }
+
+  const auto start = clock::now();
+  auto report = start;
+  std::optional<int64_t> first_time;
+  int64_t last_time = 0;
+  uint64_t published = 0u, reported = 0u;
+  const size_t dropped = _gps_history.dropped();
+  std::vector<replay_source::fix_t> batch;
+  while (!_reactor.stopping() && source.next(batch)) {
+    for (auto& fix : batch) {
+      if (!first_time) {
+        first_time = fix.time;
+      }
+      // A receiver reboot in the middle of the recording restarts its clock
+      last_time = std::max(last_time, fix.time);
+      if (speed > 0.f) {
+        const std::chrono::duration<double, std::milli> offset{(last_time - *first_time)/speed};
+        const auto when = start + std::chrono::duration_cast<clock::duration>(offset);
+        if (when > clock::now() && !co_await _reactor.sleep_until(when)) {
+          break;
+        }
+      } else if (published % REPLAY_BATCH == 0u) {
+        // Let the tile downloads through
+        co_await _reactor.schedule();
+      }
+      fix.gps.last_update = chrono_clock::now();
+      _publish_gps(fix.gps, fix.stamp);
+      ++published;
+    }
+
+    const auto now = clock::now();
+    if (now - report >= 1s) {
+      const std::chrono::duration<double> elapsed = now - report;
+      logger::info("[osm_map] Replay: {:.0f} fixes/s", (published - reported)/elapsed.count());
+      report = now;
+      reported = published;
+    }
+  }
+
+  const std::chrono::duration<double> elapsed = clock::now() - start;
+  logger::info("[osm_map] Replay done, {} fixes in {:.2f}s ({:.0f} fixes/s), {} dropped",
+               published, elapsed.count(), published/std::max(elapsed.count(), 1e-6),
+               _gps_history.dropped() - dropped);
+  _lost_receiver();
+}
+
   //
   // shader_loader loader;
   // auto vert = ntf::file_contents("res/shader/framebuffer.vs.glsl");
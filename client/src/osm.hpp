@@ -1,11 +1,24 @@
 #pragma once
 
 #include "./renderer.hpp"
+#include "./tile_archive.hpp"
+#include "./download_scheduler.hpp"
+#include "./lockfree.hpp"
+#include "./sse_parser.hpp"
 
 #include <filesystem>
 #include <atomic>
 #include <fstream>
 #include <cstdint>
+#include <deque>
+#include <algorithm>
+#include <optional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_set>
+#include <unordered_map>
+#include <span>
 
 namespace fs = std::filesystem;
 
@@ -14,40 +27,219 @@ using chrono_clock = std::chrono::high_resolution_clock;
 using gps_coord = dvec2;
 using tile_coord = ivec2;
 
+// https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
+tile_coord coord2tile(gps_coord coord, uint32 zoom);
+gps_coord tile2coord(tile_coord tile, uint32 zoom);
+
+struct tile_key {
+  tile_coord tile;
+  uint32 zoom;
+
+  bool operator==(const tile_key& other) const {
+    return tile == other.tile && zoom == other.zoom;
+  }
+};
+
+struct tile_key_hash {
+  size_t operator()(const tile_key& key) const {
+    // zoom <= 24 and tiles < 2^zoom, pack everything in 64 bits
+    return std::hash<uint64_t>{}((static_cast<uint64_t>(key.zoom) << 58) |
+                                 (static_cast<uint64_t>(key.tile.x) << 29) |
+                                 static_cast<uint64_t>(key.tile.y));
+  }
+};
+
+// Decoded RGBA8 texels
+struct tile_image {
+  std::vector<ntf::uint8> texels; // Every mip level, largest first
+  ntf::extent2d extent;
+  uint32 levels;
+
+  ntf::extent2d level_extent(uint32 level) const {
+    return {std::max(extent.x >> level, 1u), std::max(extent.y >> level, 1u)};
+  }
+
+  ntf::cspan<ntf::uint8> level_texels(uint32 level) const {
+    size_t offset = 0u;
+    for (uint32 i = 0u; i < level; ++i) {
+      const auto ext = level_extent(i);
+      offset += ext.x*ext.y*4u;
+    }
+    const auto ext = level_extent(level);
+    return {texels.data()+offset, ext.x*ext.y*4u};
+  }
+};
+
 class osm_tileset {
 public:
   static constexpr uint32 TILE_SIZE = 256u; // pixels
 
   struct tile_t {
-    ntf::image_data image;
+    tile_image image;
     vec2 pos;
+    tile_coord tile;
+    uint32 zoom;
   };
 
 public:
-  osm_tileset(std::vector<tile_t>&& tiles, vec2 min_coord, vec2 max_coord, vec2 size) noexcept;
+  osm_tileset(tile_coord min_tile, tile_coord max_tile, uint32 zoom) noexcept;
 
 public:
   vec2 pos_from_coord(gps_coord coord) const;
   gps_coord coord_from_pos(vec2 pos) const;
 
+  // Tiles below the tileset zoom cover 2^(zoom()-zoom) tiles per side
+  vec2 tile_pos(tile_coord tile, uint32 zoom) const;
+  tile_coord tile_from_pos(vec2 pos, uint32 zoom) const;
+  float tile_scale(uint32 zoom) const {
+    return static_cast<float>(TILE_SIZE*(1u << (_zoom - zoom)));
+  }
+
+  vec2 tile_pos(tile_coord tile) const { return tile_pos(tile, _zoom); }
+  tile_coord tile_from_pos(vec2 pos) const { return tile_from_pos(pos, _zoom); }
+
   gps_coord min_coord() const { return _min_coord; }
   gps_coord max_coord() const { return _max_coord;}
-
-public:
-  ntf::cspan<tile_t> tiles() const { return {_tiles.data(), _tiles.size()}; }
+  tile_coord min_tile() const { return _min_tile; }
+  tile_coord max_tile() const { return _max_tile; }
+  uint32 zoom() const { return _zoom; }
+  uint32 tile_count() const {
+    return (1 + _max_tile.x - _min_tile.x)*(1 + _max_tile.y - _min_tile.y);
+  }
 
 private:
-  std::vector<tile_t> _tiles;
+  tile_coord _min_tile, _max_tile;
+  uint32 _zoom;
   gps_coord _min_coord, _max_coord;
   vec2 _size;
 };
 
+// Downloads and decodes tiles in a worker pool, the render thread picks them up with poll()
+class osm_tile_loader {
+public:
+  struct request_t {
+    tile_coord tile;
+    uint32 zoom;
+    vec2 pos;
+  };
+
+  struct result_t {
+    request_t req;
+    std::optional<osm_tileset::tile_t> tile; // empty if the tile couldn't be fetched or decoded
+  };
+
+  struct prefetch_stats_t {
+    uint32 queued;  // prefetch requests accepted
+    uint32 fetched; // tiles downloaded by the prefetcher
+    uint32 cached;  // already on disk, nothing to do
+    uint32 failed;
+    uint32 hits;    // prefetched tiles later requested for display
+
+    float hit_rate() const { return fetched ? static_cast<float>(hits)/fetched : 0.f; }
+  };
+
+public:
+  // Downloads run on `reactor`, the workers only read and decode tiles
+  osm_tile_loader(net_reactor& reactor, fs::path cache_path,
+                  const download_scheduler::config_t& downloads,
+                  uint32 worker_count, bool decoded_cache);
+  ~osm_tile_loader() noexcept;
+
+  osm_tile_loader(const osm_tile_loader&) = delete;
+  osm_tile_loader& operator=(const osm_tile_loader&) = delete;
+
+public:
+  static constexpr std::string_view ARCHIVE_NAME = "tiles.pack";
+  static constexpr std::string_view DECODED_DIR = "rgba";
+  static constexpr size_t MAX_PREFETCH = 256u; // oldest prefetch requests get dropped first
+
+public:
+  // Requests are served nearest to `center` first. Urgent ones jump ahead of everything
+  // already queued, for tiles the screen is waiting on
+  void enqueue(std::vector<request_t>&& reqs, tile_coord center, bool urgent = false);
+  void clear_pending();
+
+  // Low priority, only served when no regular request is queued. Prefetched tiles are just
+  // downloaded into the cache, nothing gets decoded or returned through poll()
+  void prefetch(std::vector<request_t>&& reqs);
+  prefetch_stats_t prefetch_stats() const;
+
+  // Drops every queued request matching `pred`, in flight requests are not affected
+  template<typename F>
+  uint32 cancel_if(F&& pred) {
+    std::unique_lock lock{_queue_mtx};
+    const auto it = std::remove_if(_queue.begin(), _queue.end(), std::forward<F>(pred));
+    const auto count = static_cast<uint32>(std::distance(it, _queue.end()));
+    _queue.erase(it, _queue.end());
+    return count;
+  }
+
+  // Every regular request ends up here once, failed ones with an empty tile
+  template<typename F>
+  uint32 poll(uint32 max_count, F&& fun) {
+    uint32 count = 0u;
+    while (count < max_count) {
+      std::unique_lock lock{_done_mtx};
+      if (_done.empty()) {
+        break;
+      }
+      auto result = std::move(_done.front());
+      _done.pop_front();
+      lock.unlock();
+
+      fun(std::move(result));
+      ++count;
+    }
+    return count;
+  }
+
+  uint32 pending() const;
+
+private:
+  struct fetched_t {
+    request_t req;
+    bool refreshed; // the file changed, skip the decoded and archived copies
+  };
+
+private:
+  void _worker_loop();
+  bool _needs_fetch(const request_t& req) const;
+  net_job _fetch_tile(request_t req, bool prefetch);
+  std::optional<osm_tileset::tile_t> _load_tile(const request_t& req, bool refreshed);
+  void _prefetch_tile(const request_t& req);
+
+private:
+  net_reactor& _reactor;
+  download_scheduler _downloads; // reactor thread only
+  fs::path _cache;
+  std::optional<tile_archive> _archive;
+  fs::path _decoded; // empty if the decoded tier is disabled
+  std::vector<std::thread> _workers;
+
+  mutable std::mutex _queue_mtx;
+  std::condition_variable _queue_cv;
+  std::deque<request_t> _queue;
+  std::deque<request_t> _prefetch;
+  std::deque<fetched_t> _fetched; // downloaded, waiting for a worker to decode them
+  uint32 _in_flight;
+  uint32 _fetching; // on the reactor
+  bool _stop;
+
+  std::mutex _done_mtx;
+  std::deque<result_t> _done;
+
+  mutable std::mutex _stats_mtx;
+  prefetch_stats_t _stats;
+  std::unordered_set<tile_key, tile_key_hash> _prefetched; // fetched but not requested yet
+};
+
 class osm_map {
 public:
   struct gps_data {
     float lat, lng;
     uint32 sat_c, time;
     int rssi;
+    uint16_t device;
     bool available;
     chrono_clock::time_point last_update;
   };
@@ -59,17 +251,96 @@ public:
   };
 
 public:
-  osm_map(fs::path cache_path);
+  // The decoded cache keeps raw RGBA8 copies of the tiles and their mipmaps so warm starts
+  // skip all the decoding, at the cost of ~341KiB of disk per tile
+  osm_map(net_reactor& reactor, fs::path cache_path,
+          const download_scheduler::config_t& downloads,
+          uint32 loader_threads = 4u, bool decoded_cache = false);
 
 public:
-  osm_tileset load_tiles(gps_coord min_coord, gps_coord max_coord, uint32 zoom);
+  osm_tileset make_tileset(gps_coord min_coord, gps_coord max_coord, uint32 zoom) const;
+
+  // Non blocking, the tiles nearest to `center` get loaded first
+  void request_tiles(std::vector<osm_tile_loader::request_t>&& reqs, tile_coord center,
+                     bool urgent = false) {
+    _loader.enqueue(std::move(reqs), center, urgent);
+  }
+
+  template<typename F>
+  uint32 cancel_tiles(F&& pred) {
+    return _loader.cancel_if(std::forward<F>(pred));
+  }
+
+  template<typename F>
+  uint32 poll_tiles(uint32 max_count, F&& fun) {
+    return _loader.poll(max_count, std::forward<F>(fun));
+  }
+
+  uint32 pending_tiles() const { return _loader.pending(); }
+
+  void prefetch_tiles(std::vector<osm_tile_loader::request_t>&& reqs) {
+    _loader.prefetch(std::move(reqs));
+  }
+
+  osm_tile_loader::prefetch_stats_t prefetch_stats() const { return _loader.prefetch_stats(); }
+
+  static constexpr size_t GPS_HISTORY = 256u; // fixes buffered between two poll_fixes()
+  static constexpr uint32 MAX_DEVICES = 64u;   // trackers after this one get ignored
+  static constexpr std::chrono::seconds GPS_STREAM_IDLE{40}; // the receiver beats every 15s
+  static constexpr uint64_t REPLAY_BATCH = 1024u; // fixes between yields of a full speed replay
 
 public:
   gps_query query_gps();
 
+  // Latest state of every tracker heard from, in the order they showed up. Render thread
+  // only, wait-free, a device the reactor is halfway through updating keeps its previous
+  // snapshot
+  std::span<const gps_data> devices();
+
+  // Every fix received since the last call from any device, oldest first.
+  // Render thread only, wait-free
+  template<typename F>
+  uint32 poll_fixes(F&& fun) {
+    return static_cast<uint32>(_gps_history.drain(std::forward<F>(fun)));
+  }
+
+  // Polls the NodeMCU at `url` every `interval` from the reactor thread. Only the devices
+  // changed since the previous poll are requested, with "?since=<seq>"
+  void start_gps(std::string url, std::chrono::milliseconds interval);
+
+  // Follows the receiver event stream at `url`, reconnecting whenever it drops.
+  // Each fix is published as soon as its packet reaches the receiver
+  void start_gps_stream(std::string url);
+
+  // Feeds recorded fixes through the same path as the receiver ones, for testing without
+  // hardware. `path` is either a fix history directory or a file with one receiver JSON
+  // object per line. Recorded time runs `speed` times faster, 0 replays everything as fast
+  // as possible. Logs how many fixes per second got through
+  void start_gps_replay(fs::path path, float speed);
+
+private:
+  struct device_slot {
+    uint32 index;
+    std::optional<uint32_t> stamp; // receiver timestamp of the last fix
+  };
+
+private:
+  net_job _poll_gps(std::string url, std::chrono::milliseconds interval);
+  net_job _stream_gps(std::string url);
+  net_job _replay_gps(fs::path path, float speed);
+  void _publish_gps(const gps_data& gps, std::optional<uint32_t> stamp);
+  void _lost_receiver();
+
 private:
+  net_reactor& _reactor;
   fs::path _cache;
-  gps_data _gps;
+  bool _decoded_cache;
+  std::unordered_map<uint16_t, device_slot> _device_slots;    // reactor thread only
+  std::array<seqlock<gps_data>, MAX_DEVICES> _device_state;   // written by the reactor
+  std::atomic<uint32> _device_count;
+  spsc_ring<gps_data, GPS_HISTORY> _gps_history;              // reactor -> render thread
+  std::array<gps_data, MAX_DEVICES> _devices;                 // render thread copies
+  osm_tile_loader _loader;
 };
 
 // class osm_map {
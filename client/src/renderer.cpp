@@ -1,32 +1,51 @@
 #include "renderer.hpp"
 
-std::string_view vert_frag_only_src = R"glsl(
-#version 460 core
+// Inserted in every shader, see render_ctx::frame_data
+static constexpr std::string_view FRAME_PRELUDE = R"glsl(
+layout (std140, binding = 0) uniform frame_data {
+  mat4 u_proj;
+  mat4 u_view;
+  vec2 u_viewport;
+  float u_zoom;
+  float u_time;
+};
+)glsl";
 
-layout (location = 0) in vec3 att_coords;
-layout (location = 1) in vec3 att_normals;
-layout (location = 2) in vec2 att_texcoords;
+static std::string with_prelude(std::string_view src) {
+  // #version has to stay the first thing in the source
+  size_t at = src.find("#version");
+  at = at == std::string_view::npos ? 0u : src.find('\n', at);
+  at = at == std::string_view::npos ? src.size() : at+1u;
+  std::string out;
+  out.reserve(src.size() + FRAME_PRELUDE.size());
+  out.append(src.substr(0u, at)).append(FRAME_PRELUDE).append(src.substr(at));
+  return out;
+}
 
-void main() {
-  gl_Position = vec4(att_coords.x*2.f, att_coords.y*2.f, att_coords.z*2.f, 1.f);
+// RGBA8, close enough for the stats whatever the format
+static size_t texture_bytes(ntf::extent3d extent, uint32 layers, uint32 levels) {
+  size_t bytes = 0u;
+  for (uint32 level = 0u; level < levels; ++level) {
+    bytes += size_t{std::max(extent.x >> level, 1u)}*std::max(extent.y >> level, 1u)*4u;
+  }
+  return bytes*layers;
 }
-)glsl";
 
 render_ctx::render_ctx(ntf::renderer_window&& win, ntf::renderer_context&& render,
-                       ntf::quad_mesh&& quad, ntf::renderer_pipeline&& quad_pipeline,
-                       ntf::font_renderer&& frenderer, ntf::sdf_text_rule&& frule,
-                       const ntf::mat4& proj, ntf::extent2d viewport) :
+                       ntf::quad_mesh&& quad, ntf::font_renderer&& frenderer,
+                       ntf::sdf_text_rule&& frule, const ntf::mat4& proj,
+                       ntf::extent2d viewport) :
   _win{std::move(win)}, _ctx{std::move(render)},
-  _quad{std::move(quad)}, _tile_pipeline{std::move(quad_pipeline)},
-  _frenderer{std::move(frenderer)}, _frule{std::move(frule)},
+  _quad{std::move(quad)}, _frenderer{std::move(frenderer)}, _frule{std::move(frule)},
   _vp{viewport}, _proj{proj}, _inv_proj{glm::inverse(proj)},
-  _cam_pos{0.f, 0.f}, _cam_origin{(float)viewport.x / 2.f, (float)viewport.y / 2.f}
+  _cam_pos{0.f, 0.f}, _cam_zoom{1.f}, _cam_origin{(float)viewport.x / 2.f, (float)viewport.y / 2.f},
+  _start_time{std::chrono::steady_clock::now()}, _screen_drawn{false}
 {
   _gen_view();
+  _frame_buffer = make_buffer(sizeof(frame_data));
 }
 
-render_ctx& render_ctx::construct(std::string_view tile_vert_src, std::string_view tile_frag_src,
-                                  ntf::font_atlas_data&& font_atlas, ntf::extent2d win_sz) {
+render_ctx& render_ctx::construct(ntf::font_atlas_data&& font_atlas, ntf::extent2d win_sz) {
   const ntf::win_gl_params gl_param {
     .ver_major = 4,
     .ver_minor = 6,
@@ -49,7 +68,7 @@ render_ctx& render_ctx::construct(std::string_view tile_vert_src, std::string_vi
     .swap_interval = 1,
     .fb_viewport = {0, 0, win_sz.x, win_sz.y},
     .fb_clear = ntf::r_clear_flag::color_depth,
-    .fb_color = {.3f, .3f, .3f, 1.f},
+    .fb_color = CLEAR_COLOR,
     .alloc = nullptr,
   });
   if (!rctx) {
@@ -59,36 +78,6 @@ render_ctx& render_ctx::construct(std::string_view tile_vert_src, std::string_vi
 
   auto quad = ntf::quad_mesh::create(*rctx).value();
 
-  auto vert = ntf::renderer_shader::create(*rctx, {
-    .type = ntf::r_shader_type::vertex,
-    .source = {tile_vert_src},
-  }).value();
-  auto frag = ntf::renderer_shader::create(*rctx, {
-    .type = ntf::r_shader_type::fragment,
-    .source = {tile_frag_src},
-  }).value();
-
-  const auto attributes = ntf::quad_mesh::attribute_binding();
-  const ntf::r_blend_opts blending {
-    .mode = ntf::r_blend_mode::add,
-    .src_factor = ntf::r_blend_factor::src_alpha,
-    .dst_factor = ntf::r_blend_factor::inv_src_alpha,
-    .color = {0.f, 0.f, 0.f, 0.f},
-  };
-  ntf::r_shader stages[] {vert.handle(), frag.handle()};
-  auto pip = ntf::renderer_pipeline::create(*rctx, {
-    .attributes = attributes,
-    .stages = stages,
-    .primitive = ntf::r_primitive::triangles,
-    .poly_mode = ntf::r_polygon_mode::fill,
-    .poly_width = ntf::nullopt,
-    .stencil_test = nullptr,
-    .depth_test = nullptr,
-    .scissor_test = nullptr,
-    .face_culling = nullptr,
-    .blending = blending,
-  }).value();
-
   ntf::mat4 proj_mat = glm::ortho(0.f, (float)win_sz.x, 0.f, (float)win_sz.y);
   auto frenderer = ntf::font_renderer::create(*rctx, proj_mat, std::move(font_atlas)).value();
 
@@ -101,63 +90,203 @@ render_ctx& render_ctx::construct(std::string_view tile_vert_src, std::string_vi
                                              0.7f, 0.08f).value();
 
   return _construct(std::move(*win), std::move(*rctx),
-                    std::move(quad), std::move(pip),
-                    std::move(frenderer), std::move(sdf_rule),
+                    std::move(quad), std::move(frenderer), std::move(sdf_rule),
                     proj_mat, win_sz);
 }
 
 void render_ctx::start_render() {
   _text_buff.clear();
+  _screen_drawn = false;
+  const frame_data frame {
+    .proj = _proj,
+    .view = _view,
+    .viewport = viewport(),
+    .zoom = _cam_zoom,
+    .time = std::chrono::duration<float>(std::chrono::steady_clock::now() - _start_time).count(),
+  };
+  _buffs[_frame_buffer].upload(0u, sizeof(frame), &frame);
+}
+
+ntf::r_shader_buffer render_ctx::_frame_binding() const {
+  return {
+    .buffer = _buffs[_frame_buffer].handle(),
+    .binding = FRAME_BINDING,
+    .offset = 0u,
+    .size = sizeof(frame_data),
+  };
 }
 
 void render_ctx::end_render() {
-  auto fbo = ntf::renderer_framebuffer::default_fbo(_ctx);
+  auto fbo = _screen_fbo();
   _frenderer.clear_state();
   _frenderer.append_text(_text_buff);
   _frenderer.render(_quad, fbo, _frule);
 }
 
-size_t render_ctx::make_texture(const ntf::image_data& image) {
-  const auto desc = image.make_descriptor();
-  _texs.emplace_back(ntf::renderer_texture::create(_ctx, {
+texture_t render_ctx::make_texture_array(ntf::extent2d extent, uint32 layers, uint32 levels) {
+  // Mip levels get uploaded by the caller
+  auto tex = ntf::renderer_texture::create(_ctx, {
     .type = ntf::r_texture_type::texture2d,
-    .format = image.format,
-    .extent = image.extent,
-    .layers = 1,
-    .levels = 1,
-    .images = {desc},
+    .format = ntf::r_texture_format::rgba8nu,
+    .extent = {extent.x, extent.y, 1u},
+    .layers = layers,
+    .levels = levels,
+    .images = {},
     .gen_mipmaps = false,
-    .sampler = ntf::r_texture_sampler::nearest,
+    .sampler = levels > 1u ? ntf::r_texture_sampler::linear : ntf::r_texture_sampler::nearest,
     .addressing = ntf::r_texture_address::clamp_edge,
-  }).value());
-  return _texs.size()-1;
+  }).value();
+  return _texs.acquire(std::move(tex), texture_bytes({extent.x, extent.y, 1u}, layers, levels));
+}
+
+void render_ctx::upload_texture(texture_t tex, uint32 layer, uint32 level,
+                                ntf::cspan<ntf::uint8> rgba_texels, ntf::extent2d extent) {
+  NTF_ASSERT(rgba_texels.size() == extent.x*extent.y*4u);
+  _texs[tex].upload({
+    .texels = rgba_texels.data(),
+    .format = ntf::r_texture_format::rgba8nu,
+    .alignment = 4u,
+    .extent = {extent.x, extent.y, 1u},
+    .offset = {0u, 0u, 0u},
+    .layer = layer,
+    .level = level,
+  });
+}
+
+void render_ctx::destroy_texture(texture_t tex) {
+  if (!_texs.release(tex)) {
+    logger::warning("[render_ctx] Tried to destroy a stale texture ({}:{})", tex.index, tex.gen);
+  }
+}
+
+void render_ctx::destroy_buffer(buffer_t buff) {
+  if (!_buffs.release(buff)) {
+    logger::warning("[render_ctx] Tried to destroy a stale buffer ({}:{})",
+                    buff.index, buff.gen);
+  }
+}
+
+void render_ctx::destroy_render_target(const render_target_t& target) {
+  if (!_fbos.release(target.framebuffer)) {
+    logger::warning("[render_ctx] Tried to destroy a stale framebuffer ({}:{})",
+                    target.framebuffer.index, target.framebuffer.gen);
+  }
+  destroy_texture(target.texture);
+}
+
+void render_ctx::destroy_pipeline(pipeline_t pip) {
+  const auto it = std::find_if(_pip_cache.begin(), _pip_cache.end(), [pip](const auto& entry) {
+    return entry.second.pipeline == pip;
+  });
+  if (it == _pip_cache.end() || !_pips.alive(pip)) {
+    logger::warning("[render_ctx] Tried to destroy a stale pipeline ({}:{})", pip.index, pip.gen);
+    return;
+  }
+  if (--it->second.refs) {
+    return;
+  }
+  _pip_cache.erase(it);
+  _pips.release(pip);
 }
 
-void render_ctx::render_texture(size_t tex, const ntf::mat4& transf, uint32 sort) {
-  auto fbo = ntf::renderer_framebuffer::default_fbo(_ctx);
-  const ntf::r_push_constant unifs[] = {
-    ntf::r_format_pushconst(*_tile_pipeline.uniform("u_model"), transf),
-    ntf::r_format_pushconst(*_tile_pipeline.uniform("u_proj"), _proj),
-    ntf::r_format_pushconst(*_tile_pipeline.uniform("u_view"), _view),
-    ntf::r_format_pushconst(*_tile_pipeline.uniform("u_sampler"), 0),
+void render_ctx::render_instanced(pipeline_t pip, texture_t tex, buffer_t instance_buffer,
+                                  uint32 binding, uint32 instances, uint32 sort) {
+  if (!instances) {
+    return;
+  }
+  auto fbo = _screen_fbo();
+  const auto& pipeline = _pips[pip];
+  const ntf::r_shader_buffer inst_buff {
+    .buffer = _buffs[instance_buffer].handle(),
+    .binding = binding,
+    .offset = 0u,
+    .size = _buffs[instance_buffer].size(),
   };
   auto tex_binding = _texs[tex].handle();
   _ctx.submit_command({
     .target = fbo.handle(),
-    .pipeline = _tile_pipeline.handle(),
-    .buffers = _quad.bindings(),
+    .pipeline = pipeline.handle(),
+    .buffers = _quad.bindings({_frame_binding(), inst_buff}),
     .textures = {tex_binding},
-    .uniforms = unifs,
+    .uniforms = {},
+    .draw_opts = {
+      .count = 6,
+      .offset = 0,
+      .instances = instances,
+    },
+    .sort_group = sort,
+    .on_render = {},
+  });
+}
+
+void render_ctx::render_instanced(pipeline_t pip, buffer_t instance_buffer, uint32 binding,
+                                  uint32 instances, uint32 sort) {
+  render_instanced_range(pip, instance_buffer, binding, 0u, _buffs[instance_buffer].size(),
+                         instances, sort);
+}
+
+void render_ctx::render_instanced_range(pipeline_t pip, buffer_t instance_buffer,
+                                        uint32 binding, size_t offset, size_t size,
+                                        uint32 instances, uint32 sort) {
+  NTF_ASSERT(offset + size <= _buffs[instance_buffer].size());
+  if (!instances) {
+    return;
+  }
+  auto fbo = _screen_fbo();
+  const auto& pipeline = _pips[pip];
+  const ntf::r_shader_buffer inst_buff {
+    .buffer = _buffs[instance_buffer].handle(),
+    .binding = binding,
+    .offset = offset,
+    .size = size,
+  };
+  _ctx.submit_command({
+    .target = fbo.handle(),
+    .pipeline = pipeline.handle(),
+    .buffers = _quad.bindings({_frame_binding(), inst_buff}),
+    .textures = {},
+    .uniforms = {},
     .draw_opts = {
       .count = 6,
       .offset = 0,
-      .instances = 0,
+      .instances = instances,
     },
     .sort_group = sort,
     .on_render = {},
   });
 }
 
+void render_ctx::render_offscreen(framebuffer_t target, pipeline_t pip, texture_t tex,
+                                  buffer_t instance_buffer, uint32 binding, size_t offset,
+                                  size_t size, uint32 instances) {
+  NTF_ASSERT(offset + size <= _buffs[instance_buffer].size());
+  NTF_ASSERT(!_screen_drawn);
+  if (!instances) {
+    return;
+  }
+  const ntf::r_shader_buffer inst_buff {
+    .buffer = _buffs[instance_buffer].handle(),
+    .binding = binding,
+    .offset = offset,
+    .size = size,
+  };
+  auto tex_binding = _texs[tex].handle();
+  _ctx.submit_command({
+    .target = _fbos[target].handle(),
+    .pipeline = _pips[pip].handle(),
+    .buffers = _quad.bindings({_frame_binding(), inst_buff}),
+    .textures = {tex_binding},
+    .uniforms = {},
+    .draw_opts = {
+      .count = 6,
+      .offset = 0,
+      .instances = instances,
+    },
+    .sort_group = 0u,
+    .on_render = {},
+  });
+}
+
 void render_ctx::update_viewport(ntf::uint32 w, ntf::uint32 h) {
   ntf::renderer_framebuffer::default_fbo(_ctx).viewport({0, 0, w, h});
   _vp.x = w;
@@ -171,7 +300,8 @@ void render_ctx::update_viewport(ntf::uint32 w, ntf::uint32 h) {
 }
 
 void render_ctx::_gen_view() {
-  _view = ntf::build_view_matrix(_cam_pos, _cam_origin, vec2{1.f, 1.f}, ntf::vec3{0.f, 0.f, 0.f});
+  _view = ntf::build_view_matrix(_cam_pos, _cam_origin, vec2{_cam_zoom, _cam_zoom},
+                                 ntf::vec3{0.f, 0.f, 0.f});
 }
 
 vec2 render_ctx::raycast(float x, float y) const {
@@ -180,17 +310,29 @@ vec2 render_ctx::raycast(float x, float y) const {
     (1.f - (2.f*y)) / (float)_vp.y,
     -1.f, 0.f
   };
-  return {pos.x + _cam_pos.x, pos.y + _cam_pos.y + _vp.y*.5f};
+  return {pos.x/_cam_zoom + _cam_pos.x, (pos.y + _vp.y*.5f)/_cam_zoom + _cam_pos.y};
 }
 
 pipeline_t render_ctx::make_pipeline(std::string_view vert_src, std::string_view frag_src) {
+  // Every pipeline shares the same state, the sources are enough to tell them apart
+  std::string key;
+  key.reserve(vert_src.size() + frag_src.size() + 1u);
+  key.append(vert_src).push_back('\0');
+  key.append(frag_src);
+  if (const auto cached = _pip_cache.find(key); cached != _pip_cache.end()) {
+    ++cached->second.refs;
+    return cached->second.pipeline;
+  }
+
+  const auto vert_full = with_prelude(vert_src);
+  const auto frag_full = with_prelude(frag_src);
   auto vert = ntf::renderer_shader::create(_ctx, {
     .type = ntf::r_shader_type::vertex,
-    .source = {vert_src},
+    .source = {vert_full},
   }).value();
   auto frag = ntf::renderer_shader::create(_ctx, {
     .type = ntf::r_shader_type::fragment,
-    .source = {frag_src},
+    .source = {frag_full},
   }).value();
 
   const ntf::r_blend_opts blending {
@@ -202,7 +344,7 @@ pipeline_t render_ctx::make_pipeline(std::string_view vert_src, std::string_view
 
   const auto attributes = ntf::quad_mesh::attribute_binding();
   const ntf::r_shader stages[] {vert.handle(), frag.handle()};
-  _pips.emplace_back(ntf::renderer_pipeline::create(_ctx, {
+  auto pipeline = ntf::renderer_pipeline::create(_ctx, {
     .attributes = attributes,
     .stages = stages,
     .primitive = ntf::r_primitive::triangles,
@@ -213,45 +355,53 @@ pipeline_t render_ctx::make_pipeline(std::string_view vert_src, std::string_view
     .scissor_test = nullptr,
     .face_culling = nullptr,
     .blending = blending,
-  }).value());
+  }).value();
+  const auto pip = _pips.acquire(std::move(pipeline), 0u);
+  _pip_cache.emplace(std::move(key), pipeline_entry{pip, 1u});
+  logger::debug("[render_ctx] Compiled pipeline {}", pip.index);
 
-  return _pips.size()-1u;
+  return pip;
 }
 
-buffer_t render_ctx::make_buffer(size_t size) {
-  _buffs.emplace_back(ntf::renderer_buffer::create(_ctx, {
-    .type = ntf::r_buffer_type::uniform,
+buffer_t render_ctx::make_buffer(size_t size, ntf::r_buffer_type type) {
+  auto buffer = ntf::renderer_buffer::create(_ctx, {
+    .type = type,
     .flags = ntf::r_buffer_flag::dynamic_storage,
     .size = size,
     .data = nullptr,
-  }).value());
+  }).value();
 
-  return _buffs.size()-1u;
+  return _buffs.acquire(std::move(buffer), size);
 }
 
-void render_ctx::render_thing(rendering_rule& rule, uint32 sort) {
-  auto fbo = ntf::renderer_framebuffer::default_fbo(_ctx);
-  auto [pip, buff] = rule.write_uniforms();
-  NTF_ASSERT(buff < _buffs.size());
-  NTF_ASSERT(pip < _pips.size());
-  const ntf::r_shader_buffer unif_buff {
-    .buffer = _buffs[buff].handle(),
-    .binding = 1u,
-    .offset = 0u,
-    .size = _buffs[buff].size(),
+auto render_ctx::make_render_target(ntf::extent2d extent) -> render_target_t {
+  auto tex = ntf::renderer_texture::create(_ctx, {
+    .type = ntf::r_texture_type::texture2d,
+    .format = ntf::r_texture_format::rgba8nu,
+    .extent = {extent.x, extent.y, 1u},
+    .layers = 1u,
+    .levels = 1u,
+    .images = {},
+    .gen_mipmaps = false,
+    .sampler = ntf::r_texture_sampler::nearest,
+    .addressing = ntf::r_texture_address::repeat,
+  }).value();
+  const ntf::r_framebuffer_attachment attachment {
+    .texture = tex.handle(),
+    .layer = 0u,
+    .level = 0u,
+  };
+  auto fbo = ntf::renderer_framebuffer::create(_ctx, {
+    .extent = extent,
+    .viewport = {0u, 0u, extent.x, extent.y},
+    .clear_color = CLEAR_COLOR,
+    .clear_flags = ntf::r_clear_flag::none,
+    .test_buffer = ntf::r_test_buffer::no_buffer,
+    .attachments = {attachment},
+  }).value();
+  logger::debug("[render_ctx] Render target of {}x{}", extent.x, extent.y);
+  return {
+    .texture = _texs.acquire(std::move(tex), texture_bytes({extent.x, extent.y, 1u}, 1u, 1u)),
+    .framebuffer = _fbos.acquire(std::move(fbo), 0u),
   };
-  _ctx.submit_command({
-    .target = fbo.handle(),
-    .pipeline = _pips[pip].handle(),
-    .buffers = _quad.bindings({unif_buff}),
-    .textures = {},
-    .uniforms = {},
-    .draw_opts = {
-      .count = 6,
-      .offset = 0,
-      .instances = 0,
-    },
-    .sort_group = sort,
-    .on_render = {},
-  });
 }
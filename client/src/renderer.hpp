@@ -8,6 +8,12 @@
 #include <shogle/stl.hpp>
 #include <shogle/boilerplate.hpp>
 
+#include "./resource_pool.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <unordered_map>
+
 using logger = ntf::logger;
 using ntf::uint32;
 using ntf::int32;
@@ -16,32 +22,94 @@ using ntf::dvec2;
 using ntf::vec2;
 using ntf::color4;
 
-using pipeline_t = size_t;
-using buffer_t = size_t;
+using pipeline_t = resource_pool<ntf::renderer_pipeline>::handle;
+using buffer_t = resource_pool<ntf::renderer_buffer>::handle;
+using texture_t = resource_pool<ntf::renderer_texture>::handle;
+using framebuffer_t = resource_pool<ntf::renderer_framebuffer>::handle;
 
-extern std::string_view vert_frag_only_src;
+class render_ctx : public ntf::singleton<render_ctx> {
+public:
+  struct resource_stats_t {
+    resource_pool<ntf::renderer_pipeline>::stats_t pipelines;
+    resource_pool<ntf::renderer_buffer>::stats_t buffers;
+    resource_pool<ntf::renderer_texture>::stats_t textures;
+  };
 
-struct rendering_rule {
-  virtual ~rendering_rule() = default;
-  virtual std::pair<pipeline_t, buffer_t> write_uniforms() = 0;
-};
+  // Offscreen color target, sampled with repeat addressing
+  struct render_target_t {
+    texture_t texture;
+    framebuffer_t framebuffer;
+  };
+
+  static constexpr color4 CLEAR_COLOR{.3f, .3f, .3f, 1.f};
+
+  // Uniform block binding every pipeline reads its camera from
+  static constexpr uint32 FRAME_BINDING = 0u;
+
+private:
+  // std140, has to match FRAME_PRELUDE in renderer.cpp
+  struct frame_data {
+    ntf::mat4 proj;
+    ntf::mat4 view;
+    vec2 viewport;
+    float zoom; // screen pixels per world unit
+    float time; // seconds since the context was created
+  };
+  static_assert(sizeof(frame_data) == 144u);
+  static_assert(offsetof(frame_data, view) == 64u);
+  static_assert(offsetof(frame_data, viewport) == 128u);
+  static_assert(offsetof(frame_data, zoom) == 136u);
+  static_assert(offsetof(frame_data, time) == 140u);
+
+  struct pipeline_entry {
+    pipeline_t pipeline;
+    uint32 refs;
+  };
 
-class render_ctx : public ntf::singleton<render_ctx> {
 private:
   render_ctx(ntf::renderer_window&& win, ntf::renderer_context&& render,
-             ntf::quad_mesh&& quad, ntf::renderer_pipeline&& tile_pipeline,
-             ntf::font_renderer&& frenderer, ntf::sdf_text_rule&& frule,
+             ntf::quad_mesh&& quad, ntf::font_renderer&& frenderer, ntf::sdf_text_rule&& frule,
              const ntf::mat4& proj, ntf::extent2d viewport);
 
 public:
-  static render_ctx& construct(std::string_view tile_vert_src, std::string_view tile_frag_src,
-                               ntf::font_atlas_data&& font_atlas, ntf::extent2d win_sz);
+  static render_ctx& construct(ntf::font_atlas_data&& font_atlas, ntf::extent2d win_sz);
 
 public:
-  size_t make_texture(const ntf::image_data& image);
+  texture_t make_texture_array(ntf::extent2d extent, uint32 layers, uint32 levels);
+  void upload_texture(texture_t tex, uint32 layer, uint32 level,
+                      ntf::cspan<ntf::uint8> rgba_texels, ntf::extent2d extent);
+  // Cached by source, the same pair of shaders always gives back the same pipeline. Both
+  // stages get the frame_data uniform block (u_proj, u_view, u_viewport, u_zoom, u_time)
+  // inserted after their #version line
   pipeline_t make_pipeline(std::string_view vert, std::string_view frag);
-  buffer_t make_buffer(size_t size);
-  void render_texture(size_t tex, const ntf::mat4& transf, uint32 sort = 0u);
+  buffer_t make_buffer(size_t size, ntf::r_buffer_type type = ntf::r_buffer_type::uniform);
+  // Never cleared, whatever gets drawn into it stays until it's drawn over
+  render_target_t make_render_target(ntf::extent2d extent);
+
+  // Stale handles only get a warning. A cached pipeline goes away once every
+  // make_pipeline() call that returned it has been matched by a destroy
+  void destroy_texture(texture_t tex);
+  void destroy_pipeline(pipeline_t pip);
+  void destroy_buffer(buffer_t buff);
+  void destroy_render_target(const render_target_t& target);
+  resource_stats_t resource_stats() const {
+    return {_pips.stats(), _buffs.stats(), _texs.stats()};
+  }
+
+  void render_instanced(pipeline_t pip, texture_t tex, buffer_t instance_buffer, uint32 binding,
+                        uint32 instances, uint32 sort = 0u);
+  // Same without a texture, for shaders that draw everything procedurally
+  void render_instanced(pipeline_t pip, buffer_t instance_buffer, uint32 binding,
+                        uint32 instances, uint32 sort = 0u);
+  // Binds only `size` bytes of the buffer starting at `offset`, which has to be a multiple of
+  // GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT
+  void render_instanced_range(pipeline_t pip, buffer_t instance_buffer, uint32 binding,
+                              size_t offset, size_t size, uint32 instances, uint32 sort = 0u);
+  // Same into a render target. Only between start_render() and the first draw on screen, so
+  // every offscreen pass of a frame is submitted before whatever samples it on screen
+  void render_offscreen(framebuffer_t target, pipeline_t pip, texture_t tex,
+                        buffer_t instance_buffer, uint32 binding, size_t offset, size_t size,
+                        uint32 instances);
   void update_viewport(ntf::uint32 w, ntf::uint32 h);
   vec2 viewport() const { return _vp; }
 
@@ -52,11 +120,17 @@ public:
   }
   vec2 cam_pos() const { return _cam_pos; }
 
+  // Screen pixels per world unit
+  void cam_zoom(float zoom) {
+    _cam_zoom = zoom;
+    _gen_view();
+  }
+  float cam_zoom() const { return _cam_zoom; }
+
   vec2 raycast(float x, float y) const;
 
 public:
-  void render_thing(rendering_rule& rule, uint32 sort = 0u);
-
+  // Uploads the frame constants, once per frame before any draw
   void start_render();
   void end_render();
 
@@ -66,6 +140,7 @@ public:
 
 private:
   void _gen_view();
+  ntf::r_shader_buffer _frame_binding() const;
 
 public:
   template<typename... Args>
@@ -86,26 +161,38 @@ public:
 public:
   const ntf::mat4& get_proj() const { return _proj; }
   const ntf::mat4& get_view() const { return _view; }
-  ntf::r_pipeline_view get_pipeline(pipeline_t idx) const { return _pips[idx].handle(); } 
-  ntf::r_buffer_view get_buffer(buffer_t idx) const { return _buffs[idx].handle(); }
+  ntf::r_pipeline_view get_pipeline(pipeline_t pip) const { return _pips[pip].handle(); }
+  ntf::r_buffer_view get_buffer(buffer_t buff) const { return _buffs[buff].handle(); }
+
+private:
+  // Every draw on screen goes through here, see render_offscreen()
+  auto _screen_fbo() {
+    _screen_drawn = true;
+    return ntf::renderer_framebuffer::default_fbo(_ctx);
+  }
 
 private:
   ntf::renderer_window _win;
   ntf::renderer_context _ctx;
   ntf::quad_mesh _quad;
-  ntf::renderer_pipeline _tile_pipeline;
   ntf::font_renderer _frenderer;
   ntf::sdf_text_rule _frule;
 
   ntf::extent2d _vp;
   ntf::mat4 _proj, _inv_proj, _view;
   vec2 _cam_pos;
+  float _cam_zoom;
   vec2 _cam_origin;
 
   ntf::text_buffer _text_buff;
-  std::vector<ntf::renderer_texture> _texs;
-  std::vector<ntf::renderer_pipeline> _pips;
-  std::vector<ntf::renderer_buffer> _buffs;
+  resource_pool<ntf::renderer_texture> _texs;
+  resource_pool<ntf::renderer_pipeline> _pips;
+  std::unordered_map<std::string, pipeline_entry> _pip_cache; // vertex + '\0' + fragment
+  resource_pool<ntf::renderer_buffer> _buffs;
+  resource_pool<ntf::renderer_framebuffer> _fbos;
+  buffer_t _frame_buffer;
+  std::chrono::steady_clock::time_point _start_time;
+  bool _screen_drawn; // this frame
 
 private:
   friend ntf::singleton<render_ctx>;
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <shogle/stl.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Slot map for GPU resources. A handle carries the generation of its slot, released slots
+// get reused but bump their generation, so a handle kept past release() stops resolving
+// instead of pointing at whatever took its place.
+template<typename T>
+class resource_pool {
+public:
+  struct handle {
+    uint32_t index;
+    uint32_t gen; // 0 is never handed out
+
+    bool operator==(const handle&) const = default;
+  };
+
+  struct stats_t {
+    size_t live, peak;
+    size_t bytes, peak_bytes;
+  };
+
+private:
+  struct slot_t {
+    std::optional<T> res;
+    size_t bytes;
+    uint32_t gen;
+  };
+
+public:
+  resource_pool() noexcept :
+    _stats{0u, 0u, 0u, 0u} {}
+
+public:
+  // `bytes` only feeds the stats
+  handle acquire(T&& res, size_t bytes) {
+    uint32_t index;
+    if (_free.empty()) {
+      index = static_cast<uint32_t>(_slots.size());
+      _slots.emplace_back(std::nullopt, 0u, 0u);
+    } else {
+      index = _free.back();
+      _free.pop_back();
+    }
+    auto& slot = _slots[index];
+    slot.res.emplace(std::move(res));
+    slot.bytes = bytes;
+    ++slot.gen;
+    ++_stats.live;
+    _stats.bytes += bytes;
+    _stats.peak = std::max(_stats.peak, _stats.live);
+    _stats.peak_bytes = std::max(_stats.peak_bytes, _stats.bytes);
+    return {index, slot.gen};
+  }
+
+  // False for a stale handle, nothing gets released twice
+  bool release(handle h) {
+    if (!alive(h)) {
+      return false;
+    }
+    auto& slot = _slots[h.index];
+    slot.res.reset();
+    --_stats.live;
+    _stats.bytes -= slot.bytes;
+    _free.emplace_back(h.index);
+    return true;
+  }
+
+public:
+  bool alive(handle h) const {
+    return h.index < _slots.size() && _slots[h.index].gen == h.gen && _slots[h.index].res;
+  }
+
+  T* get(handle h) { return alive(h) ? &*_slots[h.index].res : nullptr; }
+  const T* get(handle h) const { return alive(h) ? &*_slots[h.index].res : nullptr; }
+
+  T& operator[](handle h) {
+    NTF_ASSERT(alive(h));
+    return *_slots[h.index].res;
+  }
+  const T& operator[](handle h) const {
+    NTF_ASSERT(alive(h));
+    return *_slots[h.index].res;
+  }
+
+  const stats_t& stats() const { return _stats; }
+
+private:
+  std::vector<slot_t> _slots;
+  std::vector<uint32_t> _free;
+  stats_t _stats;
+};
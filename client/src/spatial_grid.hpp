@@ -0,0 +1,193 @@
+#pragma once
+
+#include "./renderer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <unordered_map>
+
+// Loose uniform grid over world positions. Every object sits in the cell of its center
+// only, queries get widened by the largest radius inserted so big objects still show up.
+// Pick the cell size around the typical query radius, each query visits a handful of
+// cells whatever the number of objects.
+template<typename T>
+class spatial_grid {
+public:
+  using handle = uint32;
+
+private:
+  struct object_t {
+    vec2 pos;
+    float radius;
+    uint64_t cell;
+    T value;
+    bool alive;
+  };
+
+public:
+  explicit spatial_grid(float cell_size) noexcept :
+    _cell_size{cell_size}, _max_radius{0.f}, _count{0u} {}
+
+public:
+  handle insert(vec2 pos, float radius, T value) {
+    handle h;
+    if (_free.empty()) {
+      h = static_cast<handle>(_objects.size());
+      _objects.emplace_back();
+    } else {
+      h = _free.back();
+      _free.pop_back();
+    }
+    auto& obj = _objects[h];
+    obj.pos = pos;
+    obj.radius = radius;
+    obj.cell = _cell_key(pos);
+    obj.value = std::move(value);
+    obj.alive = true;
+    _cells[obj.cell].emplace_back(h);
+    _max_radius = std::max(_max_radius, radius);
+    ++_count;
+    return h;
+  }
+
+  void move(handle h, vec2 pos) {
+    NTF_ASSERT(h < _objects.size() && _objects[h].alive);
+    auto& obj = _objects[h];
+    obj.pos = pos;
+    const auto cell = _cell_key(pos);
+    if (cell == obj.cell) {
+      return;
+    }
+    _unlink(h);
+    obj.cell = cell;
+    _cells[cell].emplace_back(h);
+  }
+
+  void remove(handle h) {
+    NTF_ASSERT(h < _objects.size() && _objects[h].alive);
+    _unlink(h);
+    _objects[h].alive = false;
+    _free.emplace_back(h);
+    --_count;
+  }
+
+  void clear() {
+    _objects.clear();
+    _free.clear();
+    _cells.clear();
+    _max_radius = 0.f;
+    _count = 0u;
+  }
+
+public:
+  // Calls fun(handle, value, pos) for every object overlapping the box
+  template<typename F>
+  void query_box(vec2 min, vec2 max, F&& fun) const {
+    _visit(min - _max_radius, max + _max_radius, [&](handle h, const object_t& obj) {
+      if (obj.pos.x + obj.radius >= min.x && obj.pos.x - obj.radius <= max.x &&
+          obj.pos.y + obj.radius >= min.y && obj.pos.y - obj.radius <= max.y) {
+        fun(h, obj.value, obj.pos);
+      }
+    });
+  }
+
+  // Calls fun(handle, value, pos) for every object overlapping the circle
+  template<typename F>
+  void query_radius(vec2 center, float radius, F&& fun) const {
+    const vec2 reach{radius + _max_radius};
+    _visit(center - reach, center + reach, [&](handle h, const object_t& obj) {
+      const vec2 diff = obj.pos - center;
+      const float dist = radius + obj.radius;
+      if (glm::dot(diff, diff) <= dist*dist) {
+        fun(h, obj.value, obj.pos);
+      }
+    });
+  }
+
+  // Closest object overlapping the circle, by distance between centers
+  std::optional<handle> nearest(vec2 center, float radius) const {
+    std::optional<handle> best;
+    float best_dist2 = 0.f;
+    query_radius(center, radius, [&](handle h, const T&, vec2 pos) {
+      const vec2 diff = pos - center;
+      const float dist2 = glm::dot(diff, diff);
+      if (!best || dist2 < best_dist2) {
+        best = h;
+        best_dist2 = dist2;
+      }
+    });
+    return best;
+  }
+
+public:
+  const T& operator[](handle h) const { return _objects[h].value; }
+  T& operator[](handle h) { return _objects[h].value; }
+  vec2 pos(handle h) const { return _objects[h].pos; }
+  size_t size() const { return _count; }
+  float cell_size() const { return _cell_size; }
+
+private:
+  ivec2 _cell_coord(vec2 pos) const {
+    return {static_cast<int32>(std::floor(pos.x/_cell_size)),
+            static_cast<int32>(std::floor(pos.y/_cell_size))};
+  }
+
+  static uint64_t _pack(int32 x, int32 y) {
+    return (static_cast<uint64_t>(static_cast<uint32>(x)) << 32u) |
+           static_cast<uint64_t>(static_cast<uint32>(y));
+  }
+
+  uint64_t _cell_key(vec2 pos) const {
+    const auto cell = _cell_coord(pos);
+    return _pack(cell.x, cell.y);
+  }
+
+  void _unlink(handle h) {
+    const auto it = _cells.find(_objects[h].cell);
+    NTF_ASSERT(it != _cells.end());
+    auto& cell = it->second;
+    const auto pos = std::find(cell.begin(), cell.end(), h);
+    *pos = cell.back();
+    cell.pop_back();
+    if (cell.empty()) {
+      _cells.erase(it);
+    }
+  }
+
+  template<typename F>
+  void _visit(vec2 min, vec2 max, F&& fun) const {
+    const auto min_cell = _cell_coord(min);
+    const auto max_cell = _cell_coord(max);
+    const auto cells = static_cast<uint64_t>(max_cell.x - min_cell.x + 1) *
+                       static_cast<uint64_t>(max_cell.y - min_cell.y + 1);
+    if (cells > _cells.size()) {
+      // Huge box, cheaper to go through the cells that have something in them
+      for (const auto& [key, cell] : _cells) {
+        for (const auto h : cell) {
+          fun(h, _objects[h]);
+        }
+      }
+      return;
+    }
+    for (int32 x = min_cell.x; x <= max_cell.x; ++x) {
+      for (int32 y = min_cell.y; y <= max_cell.y; ++y) {
+        const auto it = _cells.find(_pack(x, y));
+        if (it == _cells.end()) {
+          continue;
+        }
+        for (const auto h : it->second) {
+          fun(h, _objects[h]);
+        }
+      }
+    }
+  }
+
+private:
+  float _cell_size;
+  float _max_radius; // never shrinks, removing the largest object keeps the queries wide
+  size_t _count;
+  std::vector<object_t> _objects;
+  std::vector<handle> _free;
+  std::unordered_map<uint64_t, std::vector<handle>> _cells;
+};
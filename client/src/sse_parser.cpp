@@ -0,0 +1,79 @@
+#include "./sse_parser.hpp"
+
+void sse_parser::feed(std::string_view chunk) {
+  while (!chunk.empty()) {
+    const auto end = chunk.find('\n');
+    const auto part = chunk.substr(0u, end);
+    if (!_skip_line) {
+      if (_line_buf.size() + part.size() > MAX_LINE) {
+        _line_buf.clear();
+        _skip_line = true;
+      } else {
+        _line_buf.append(part);
+      }
+    }
+    if (end == std::string_view::npos) {
+      break;
+    }
+    chunk.remove_prefix(end+1u);
+
+    if (!_skip_line) {
+      std::string_view line{_line_buf};
+      if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1u);
+      }
+      _line(line);
+    }
+    _line_buf.clear();
+    _skip_line = false;
+  }
+}
+
+void sse_parser::_line(std::string_view line) {
+  if (line.empty()) {
+    if (!_current.data.empty()) {
+      _current.data.pop_back(); // trailing '\n'
+      if (_current.type.empty()) {
+        _current.type = "message";
+      }
+      _events.emplace_back(std::move(_current));
+    }
+    _current = {};
+    return;
+  }
+  if (line.front() == ':') {
+    return; // comment, keep-alive
+  }
+
+  const auto colon = line.find(':');
+  const auto field = line.substr(0u, colon);
+  std::string_view value;
+  if (colon != std::string_view::npos) {
+    value = line.substr(colon+1u);
+    if (!value.empty() && value.front() == ' ') {
+      value.remove_prefix(1u);
+    }
+  }
+  if (field == "event") {
+    _current.type = value;
+  } else if (field == "data") {
+    _current.data.append(value);
+    _current.data.push_back('\n');
+  }
+}
+
+bool sse_parser::next(event_t& out) {
+  if (_events.empty()) {
+    return false;
+  }
+  out = std::move(_events.front());
+  _events.pop_front();
+  return true;
+}
+
+void sse_parser::reset() {
+  _line_buf.clear();
+  _skip_line = false;
+  _current = {};
+  _events.clear();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+
+// Incremental text/event-stream parser, feed it chunks as they arrive off the socket.
+// https://html.spec.whatwg.org/multipage/server-sent-events.html#event-stream-interpretation
+class sse_parser {
+public:
+  static constexpr size_t MAX_LINE = 1u << 16u; // longer lines get dropped
+
+  struct event_t {
+    std::string type; // "message" unless the event set one
+    std::string data;
+  };
+
+public:
+  sse_parser() = default;
+
+public:
+  void feed(std::string_view chunk);
+
+  // Pops the oldest complete event
+  bool next(event_t& out);
+
+  void reset();
+
+private:
+  void _line(std::string_view line);
+
+private:
+  std::string _line_buf;
+  bool _skip_line{false};
+  event_t _current;
+  std::deque<event_t> _events;
+};
@@ -0,0 +1,237 @@
+#include "./tile_archive.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static bool entry_less(const tile_archive::entry_t& a, const tile_archive::entry_t& b) {
+  if (a.zoom != b.zoom) {
+    return a.zoom < b.zoom;
+  }
+  if (a.x != b.x) {
+    return a.x < b.x;
+  }
+  return a.y < b.y;
+}
+
+tile_archive::tile_archive(fs::path path, const uint8_t* data, size_t size) noexcept :
+  _path{std::move(path)}, _data{data}, _size{size} {}
+
+tile_archive::~tile_archive() noexcept { _unmap(); }
+
+tile_archive::tile_archive(tile_archive&& other) noexcept :
+  _path{std::move(other._path)}, _data{other._data}, _size{other._size}
+{
+  other._data = nullptr;
+  other._size = 0u;
+}
+
+tile_archive& tile_archive::operator=(tile_archive&& other) noexcept {
+  _unmap();
+  _path = std::move(other._path);
+  _data = other._data;
+  _size = other._size;
+  other._data = nullptr;
+  other._size = 0u;
+  return *this;
+}
+
+void tile_archive::_unmap() noexcept {
+  if (_data) {
+    munmap(const_cast<uint8_t*>(_data), _size);
+    _data = nullptr;
+  }
+}
+
+std::optional<tile_archive> tile_archive::open(const fs::path& path) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(header_t)) {
+    logger::error("[tile_archive] Invalid archive \"{}\"", path.c_str());
+    close(fd);
+    return std::nullopt;
+  }
+  const size_t size = static_cast<size_t>(st.st_size);
+  void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // The mapping keeps the file alive
+  if (ptr == MAP_FAILED) {
+    logger::error("[tile_archive] Failed to map \"{}\"", path.c_str());
+    return std::nullopt;
+  }
+  // Tiles get requested all over the place
+  madvise(ptr, size, MADV_RANDOM);
+
+  tile_archive archive{path, static_cast<const uint8_t*>(ptr), size};
+  header_t header;
+  std::memcpy(&header, ptr, sizeof(header));
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+    logger::error("[tile_archive] Bad header in \"{}\"", path.c_str());
+    return std::nullopt;
+  }
+  if (sizeof(header_t) + header.count*sizeof(entry_t) > size) {
+    logger::error("[tile_archive] Truncated index in \"{}\"", path.c_str());
+    return std::nullopt;
+  }
+  for (const auto& entry : archive.entries()) {
+    if (entry.offset + entry.size > size) {
+      logger::error("[tile_archive] Truncated blob in \"{}\"", path.c_str());
+      return std::nullopt;
+    }
+  }
+  logger::info("[tile_archive] Loaded {} tiles from \"{}\"", header.count, path.c_str());
+  return archive;
+}
+
+auto tile_archive::entries() const -> ntf::cspan<entry_t> {
+  header_t header;
+  std::memcpy(&header, _data, sizeof(header));
+  return {reinterpret_cast<const entry_t*>(_data + sizeof(header_t)), header.count};
+}
+
+ntf::cspan<uint8_t> tile_archive::find(uint32 zoom, int32 x, int32 y) const {
+  const auto index = entries();
+  const entry_t key{zoom, x, y, 0u, 0u};
+  const auto it = std::lower_bound(index.begin(), index.end(), key, entry_less);
+  if (it == index.end() || it->zoom != zoom || it->x != x || it->y != y) {
+    return {};
+  }
+  return {_data + it->offset, it->size};
+}
+
+std::optional<size_t> tile_archive::import_dir(const fs::path& dir, const fs::path& out,
+                                               bool remove_loose) {
+  struct source_t {
+    entry_t entry;
+    fs::path file; // empty if the blob comes from the old archive
+  };
+
+  auto old_archive = open(out);
+  std::vector<source_t> sources;
+  if (old_archive) {
+    for (const auto& entry : old_archive->entries()) {
+      sources.emplace_back(entry, fs::path{});
+    }
+  }
+  const size_t old_count = sources.size();
+
+  std::error_code err;
+  for (const auto& dir_entry : fs::directory_iterator{dir, err}) {
+    if (!dir_entry.is_regular_file()) {
+      continue;
+    }
+    const auto filename = dir_entry.path().filename().string();
+    uint32 zoom;
+    int32 x, y;
+    char ext[8] = {};
+    if (std::sscanf(filename.c_str(), "osm-%u_%d_%d.%7s", &zoom, &x, &y, ext) != 4 ||
+        std::strcmp(ext, "png") != 0) {
+      continue;
+    }
+    const auto size = dir_entry.file_size();
+    if (size == 0u) {
+      logger::warning("[tile_archive] Skipping empty tile \"{}\"", filename);
+      continue;
+    }
+    sources.emplace_back(entry_t{zoom, x, y, static_cast<uint32>(size), 0u}, dir_entry.path());
+  }
+  if (err) {
+    logger::error("[tile_archive] Failed to read \"{}\": {}", dir.c_str(), err.message());
+    return std::nullopt;
+  }
+
+  // Loose files were appended last, keep them over the archived copy
+  std::stable_sort(sources.begin(), sources.end(), [](const source_t& a, const source_t& b) {
+    return entry_less(a.entry, b.entry);
+  });
+  std::vector<source_t> unique;
+  unique.reserve(sources.size());
+  for (auto& source : sources) {
+    if (!unique.empty() && !entry_less(unique.back().entry, source.entry)) {
+      unique.back() = std::move(source);
+    } else {
+      unique.emplace_back(std::move(source));
+    }
+  }
+
+  uint64_t offset = sizeof(header_t) + unique.size()*sizeof(entry_t);
+  std::vector<entry_t> index;
+  index.reserve(unique.size());
+  for (const auto& source : unique) {
+    auto entry = source.entry;
+    entry.offset = offset;
+    offset += entry.size;
+    index.emplace_back(entry);
+  }
+
+  auto tmp_path = out;
+  tmp_path += ".tmp";
+  {
+    std::ofstream stream{tmp_path, std::ios::out | std::ios::binary | std::ios::trunc};
+    if (!stream) {
+      logger::error("[tile_archive] Failed to create \"{}\"", tmp_path.c_str());
+      return std::nullopt;
+    }
+    header_t header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.count = static_cast<uint32>(index.size());
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(reinterpret_cast<const char*>(index.data()), index.size()*sizeof(entry_t));
+
+    std::vector<char> buffer;
+    for (const auto& source : unique) {
+      if (source.file.empty()) {
+        const auto blob = old_archive->find(source.entry.zoom, source.entry.x, source.entry.y);
+        stream.write(reinterpret_cast<const char*>(blob.data()), blob.size());
+        continue;
+      }
+      buffer.resize(source.entry.size);
+      std::ifstream file{source.file, std::ios::in | std::ios::binary};
+      if (!file.read(buffer.data(), buffer.size())) {
+        logger::error("[tile_archive] Failed to read \"{}\"", source.file.c_str());
+        stream.close();
+        fs::remove(tmp_path, err);
+        return std::nullopt;
+      }
+      stream.write(buffer.data(), buffer.size());
+    }
+    if (!stream.flush()) {
+      logger::error("[tile_archive] Failed to write \"{}\"", tmp_path.c_str());
+      fs::remove(tmp_path, err);
+      return std::nullopt;
+    }
+  }
+  old_archive.reset();
+
+  fs::rename(tmp_path, out, err);
+  if (err) {
+    logger::error("[tile_archive] Failed to replace \"{}\": {}", out.c_str(), err.message());
+    return std::nullopt;
+  }
+  logger::info("[tile_archive] Packed {} tiles ({} loose files) into \"{}\"",
+               index.size(), sources.size()-old_count, out.c_str());
+
+  if (remove_loose) {
+    for (const auto& source : unique) {
+      if (!source.file.empty()) {
+        // Revalidation data is useless once the tile is packed
+        auto meta = source.file;
+        meta += ".meta";
+        fs::remove(source.file, err);
+        fs::remove(meta, err);
+      }
+    }
+  }
+  return index.size();
+}
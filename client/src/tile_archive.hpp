@@ -0,0 +1,67 @@
+#pragma once
+
+#include "./renderer.hpp"
+
+#include <filesystem>
+#include <optional>
+
+// Single file tile store, a sorted (zoom, x, y) index followed by the PNG blobs.
+// The file gets mmaped, so lookups are a binary search and a pointer into the mapping.
+//
+// Layout (host endianness):
+//   header_t
+//   entry_t[header_t::count], sorted by (zoom, x, y)
+//   blobs
+class tile_archive {
+public:
+  static constexpr char MAGIC[4] = {'O', 'S', 'M', 'T'};
+  static constexpr uint32 VERSION = 1u;
+
+  struct header_t {
+    char magic[4];
+    uint32 version;
+    uint32 count;
+    uint32 reserved;
+  };
+
+  struct entry_t {
+    uint32 zoom;
+    int32 x, y;
+    uint32 size;
+    uint64_t offset; // from the start of the file
+  };
+
+private:
+  tile_archive(std::filesystem::path path, const uint8_t* data, size_t size) noexcept;
+
+public:
+  static std::optional<tile_archive> open(const std::filesystem::path& path);
+
+  // Packs every "osm-{z}_{x}_{y}.png" in `dir` together with the tiles already in `out`
+  // (if any) into a new archive at `out`. Loose files win over archived ones.
+  static std::optional<size_t> import_dir(const std::filesystem::path& dir,
+                                          const std::filesystem::path& out,
+                                          bool remove_loose);
+
+public:
+  ntf::cspan<uint8_t> find(uint32 zoom, int32 x, int32 y) const;
+
+  ntf::cspan<entry_t> entries() const;
+  size_t size() const { return _size; }
+  const std::filesystem::path& path() const { return _path; }
+
+public:
+  ~tile_archive() noexcept;
+  tile_archive(tile_archive&& other) noexcept;
+  tile_archive(const tile_archive&) = delete;
+  tile_archive& operator=(tile_archive&& other) noexcept;
+  tile_archive& operator=(const tile_archive&) = delete;
+
+private:
+  void _unmap() noexcept;
+
+private:
+  std::filesystem::path _path;
+  const uint8_t* _data;
+  size_t _size;
+};
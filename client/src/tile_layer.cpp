@@ -0,0 +1,319 @@
+#include "./tile_layer.hpp"
+
+// Rounds towards negative infinity, cache pixels go both ways from the origin
+static int32 floor_div(int32 a, int32 b) {
+  return a/b - static_cast<int32>(a % b != 0 && (a < 0) != (b < 0));
+}
+
+// Maps the cache pixels [shift, shift+size) onto the whole render target
+static ntf::mat4 pixel_to_cache(vec2 shift, vec2 size) {
+  ntf::mat4 transform{1.f};
+  transform[0][0] = 2.f/size.x;
+  transform[1][1] = 2.f/size.y;
+  transform[3][0] = -2.f*shift.x/size.x - 1.f;
+  transform[3][1] = -2.f*shift.y/size.y - 1.f;
+  return transform;
+}
+
+static constexpr std::string_view vert_blit = R"glsl(
+#version 460 core
+
+layout (location = 0) in vec3 att_coords;
+layout (location = 1) in vec3 att_normals;
+layout (location = 2) in vec2 att_texcoords;
+out vec2 pixel;
+
+void main() {
+  // Covers the whole screen, the map under each corner comes from the inverse view
+  gl_Position = vec4(att_coords.xy*2.f, 0.f, 1.f);
+  vec4 world = inverse(u_proj*u_view)*gl_Position;
+  pixel = world.xy/world.w*u_zoom;
+}
+)glsl";
+
+static constexpr std::string_view frag_blit = R"glsl(
+#version 460 core
+
+in vec2 pixel;
+out vec4 frag_color;
+
+layout (binding = 0) uniform sampler2D u_sampler;
+
+void main() {
+  // The cache repeats, the world position times the zoom is all it takes to find the texel
+  frag_color = texture(u_sampler, pixel/vec2(textureSize(u_sampler, 0)));
+}
+)glsl";
+
+tile_layer::tile_layer(pipeline_t pipeline, pipeline_t blit_pipeline, texture_t texture,
+                       buffer_t cache_buffer, uint32 capacity) noexcept :
+  _pipeline{pipeline}, _blit_pipeline{blit_pipeline}, _texture{texture},
+  _cache_buffer{cache_buffer}, _capacity{capacity}, _last_zoom{0.f}, _zooming{true}
+{
+  // Hand out the lower layers first
+  _free.reserve(capacity);
+  for (uint32 i = capacity; i > 0u; --i) {
+    _free.push_back(i-1u);
+  }
+  _instances.reserve(capacity);
+}
+
+tile_layer tile_layer::make_layer(std::string_view vert_src, std::string_view frag_src,
+                                  uint32 capacity) {
+  auto& r = render_ctx::instance();
+  capacity = glm::clamp(capacity, 1u, MAX_LAYERS);
+  logger::debug("[tile_layer] Allocating {} tile layers", capacity);
+  const ntf::extent2d tile_extent{osm_tileset::TILE_SIZE, osm_tileset::TILE_SIZE};
+  auto pip = r.make_pipeline(vert_src, frag_src);
+  auto blit = r.make_pipeline(vert_blit, frag_blit);
+  auto tex = r.make_texture_array(tile_extent, capacity, TILE_LEVELS);
+  // Every dirty rect can wrap around in both directions
+  auto buff = r.make_buffer(CACHE_MAX_DIRTY*4u*_range_size(capacity),
+                            ntf::r_buffer_type::shader_storage);
+  return tile_layer{pip, blit, tex, buff, capacity};
+}
+
+size_t tile_layer::_range_size(uint32 tiles) {
+  const size_t bytes = sizeof(cache_header) + tiles*sizeof(instance_data);
+  return (bytes + CACHE_ALIGN-1u)/CACHE_ALIGN*CACHE_ALIGN;
+}
+
+std::optional<uint32> tile_layer::acquire(const tile_image& image) {
+  if (_free.empty()) {
+    return std::nullopt;
+  }
+  if (image.extent.x != osm_tileset::TILE_SIZE || image.extent.y != osm_tileset::TILE_SIZE ||
+      image.levels != TILE_LEVELS) {
+    logger::error("[tile_layer] Invalid tile {}x{} ({} levels)",
+                  image.extent.x, image.extent.y, image.levels);
+    return std::nullopt;
+  }
+  auto& r = render_ctx::instance();
+  const uint32 layer = _free.back();
+  _free.pop_back();
+  for (uint32 level = 0u; level < image.levels; ++level) {
+    r.upload_texture(_texture, layer, level, image.level_texels(level), image.level_extent(level));
+  }
+  return layer;
+}
+
+void tile_layer::release(uint32 layer) {
+  NTF_ASSERT(layer < _capacity);
+  _free.push_back(layer);
+}
+
+void tile_layer::prepare() {
+  auto& r = render_ctx::instance();
+  const float zoom = r.cam_zoom();
+  _zooming = zoom != _last_zoom;
+  _last_zoom = zoom;
+  if (_zooming) {
+    // Redrawing the whole cache every frame costs more than drawing the tiles on screen
+    if (_cache) {
+      _cache->zoom = 0.f;
+    }
+    return;
+  }
+  _update_cache(_view_rect());
+}
+
+void tile_layer::render(uint32 sort) {
+  if (_zooming || !_cache) {
+    _render_direct(_view_rect(), sort);
+    return;
+  }
+  auto& r = render_ctx::instance();
+  r.render_instanced(_blit_pipeline, _cache->target.texture, _cache_buffer, INSTANCE_BINDING,
+                     1u, sort);
+}
+
+auto tile_layer::_view_rect() const -> rect_t {
+  // Cache pixels under the corners of the screen, whatever the view does
+  auto& r = render_ctx::instance();
+  const ntf::mat4 inv = glm::inverse(r.get_view());
+  const vec2 vp = r.viewport();
+  const vec2 corners[] = {vec2{0.f}, vec2{vp.x, 0.f}, vec2{0.f, vp.y}, vp};
+  vec2 min{std::numeric_limits<float>::max()}, max{std::numeric_limits<float>::lowest()};
+  for (const auto corner : corners) {
+    const ntf::vec4 world = inv*ntf::vec4{corner.x, corner.y, 0.f, 1.f};
+    min = glm::min(min, vec2{world.x, world.y});
+    max = glm::max(max, vec2{world.x, world.y});
+  }
+  const float zoom = r.cam_zoom();
+  return {ivec2{glm::floor(min*zoom)}, ivec2{glm::ceil(max*zoom)}};
+}
+
+void tile_layer::_update_cache(const rect_t& view) {
+  auto& r = render_ctx::instance();
+  const float zoom = r.cam_zoom();
+  const ivec2 view_min = view.min;
+  const ivec2 view_max = view.max;
+
+  const ivec2 needed = view_max - view_min + 2*CACHE_MARGIN;
+  if (!_cache || _cache->size.x < needed.x || _cache->size.y < needed.y) {
+    if (_cache) {
+      r.destroy_render_target(_cache->target);
+    }
+    const auto align = static_cast<int32>(CACHE_ALIGN);
+    const ivec2 size = (needed + align-1)/align*align;
+    const ntf::extent2d extent{static_cast<uint32>(size.x), static_cast<uint32>(size.y)};
+    _cache.emplace(r.make_render_target(extent), size, ivec2{0}, 0.f);
+  }
+
+  auto& cache = *_cache;
+  const rect_t window{cache.origin, cache.origin + cache.size};
+  _dirty.clear();
+  bool full = false;
+  if (cache.zoom != zoom) {
+    cache.zoom = zoom;
+    cache.origin = view_min - CACHE_MARGIN;
+    _dirty.emplace_back(cache.origin, cache.origin + cache.size);
+    full = true;
+  } else if (view_min.x < window.min.x || view_min.y < window.min.y ||
+             view_max.x > window.max.x || view_max.y > window.max.y) {
+    cache.origin = view_min - CACHE_MARGIN;
+    _expose(window, {cache.origin, cache.origin + cache.size});
+  }
+
+  // Tiles that loaded or went away since the last frame
+  const auto tile_less = [](const instance_data& a, const instance_data& b) {
+    return std::tie(a.pos.x, a.pos.y, a.scale, a.layer) <
+           std::tie(b.pos.x, b.pos.y, b.scale, b.layer);
+  };
+  _sorted.assign(_instances.begin(), _instances.end());
+  std::sort(_sorted.begin(), _sorted.end(), tile_less);
+  if (!full) {
+    _changed.clear();
+    std::set_symmetric_difference(cache.drawn.begin(), cache.drawn.end(),
+                                  _sorted.begin(), _sorted.end(),
+                                  std::back_inserter(_changed), tile_less);
+    for (const auto& tile : _changed) {
+      const vec2 half{std::abs(tile.scale)*.5f};
+      _dirty.emplace_back(ivec2{glm::floor((tile.pos - half)*zoom)},
+                          ivec2{glm::ceil((tile.pos + half)*zoom)});
+    }
+  }
+  cache.drawn.swap(_sorted);
+
+  const rect_t new_window{cache.origin, cache.origin + cache.size};
+  for (auto& rect : _dirty) {
+    rect.min = glm::max(rect.min, new_window.min);
+    rect.max = glm::min(rect.max, new_window.max);
+  }
+  std::erase_if(_dirty, [](const rect_t& rect) {
+    return rect.min.x >= rect.max.x || rect.min.y >= rect.max.y;
+  });
+  if (_dirty.size() > CACHE_MAX_DIRTY) {
+    rect_t bounds = _dirty.front();
+    for (const auto& rect : _dirty) {
+      bounds.min = glm::min(bounds.min, rect.min);
+      bounds.max = glm::max(bounds.max, rect.max);
+    }
+    _dirty.assign(1u, bounds);
+  }
+  if (!_dirty.empty()) {
+    _redraw_cache();
+  }
+}
+
+void tile_layer::_expose(const rect_t& old_win, const rect_t& new_win) {
+  const ivec2 lo = glm::max(old_win.min, new_win.min);
+  const ivec2 hi = glm::min(old_win.max, new_win.max);
+  if (lo.x >= hi.x || lo.y >= hi.y) {
+    _dirty.emplace_back(new_win);
+    return;
+  }
+  // Full height columns on the sides, then rows above and below the part still cached
+  if (new_win.min.x < lo.x) {
+    _dirty.emplace_back(new_win.min, ivec2{lo.x, new_win.max.y});
+  }
+  if (new_win.max.x > hi.x) {
+    _dirty.emplace_back(ivec2{hi.x, new_win.min.y}, new_win.max);
+  }
+  if (new_win.min.y < lo.y) {
+    _dirty.emplace_back(ivec2{lo.x, new_win.min.y}, ivec2{hi.x, lo.y});
+  }
+  if (new_win.max.y > hi.y) {
+    _dirty.emplace_back(ivec2{lo.x, hi.y}, ivec2{hi.x, new_win.max.y});
+  }
+}
+
+void tile_layer::_redraw_cache() {
+  NTF_ASSERT(_instances.size() <= _capacity);
+  auto& r = render_ctx::instance();
+  auto& cache = *_cache;
+  struct draw_t {
+    size_t offset, size;
+    uint32 tiles;
+  };
+  std::array<draw_t, CACHE_MAX_DIRTY*4u> draws;
+  uint32 draw_count = 0u;
+
+  _staging.clear();
+  const auto append = [this](const auto& data) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&data);
+    _staging.insert(_staging.end(), bytes, bytes + sizeof(data));
+  };
+  for (const auto& rect : _dirty) {
+    // Split where the texture wraps around, every piece is contiguous in the texture
+    const ivec2 first{floor_div(rect.min.x, cache.size.x), floor_div(rect.min.y, cache.size.y)};
+    const ivec2 last{floor_div(rect.max.x-1, cache.size.x),
+                     floor_div(rect.max.y-1, cache.size.y)};
+    for (int32 x = first.x; x <= last.x; ++x) {
+      for (int32 y = first.y; y <= last.y; ++y) {
+        const ivec2 shift = ivec2{x, y}*cache.size;
+        const rect_t piece{glm::max(rect.min, shift), glm::min(rect.max, shift + cache.size)};
+        const size_t offset = _staging.size();
+        append(cache_header{
+          .background = render_ctx::CLEAR_COLOR,
+          .clip_min = vec2{piece.min},
+          .clip_max = vec2{piece.max},
+          .transform = pixel_to_cache(vec2{shift}, vec2{cache.size}),
+        });
+        uint32 tiles = 0u;
+        for (const auto& tile : _instances) {
+          const vec2 half{std::abs(tile.scale)*.5f};
+          const vec2 min = (tile.pos - half)*cache.zoom;
+          const vec2 max = (tile.pos + half)*cache.zoom;
+          if (max.x > piece.min.x && min.x < piece.max.x &&
+              max.y > piece.min.y && min.y < piece.max.y) {
+            append(tile);
+            ++tiles;
+          }
+        }
+        draws[draw_count++] = {offset, _staging.size() - offset, tiles};
+        _staging.resize(offset + _range_size(tiles));
+      }
+    }
+  }
+
+  r.get_buffer(_cache_buffer).upload(0u, _staging.size(), _staging.data());
+  for (uint32 i = 0u; i < draw_count; ++i) {
+    // One more instance for the background
+    r.render_offscreen(cache.target.framebuffer, _pipeline, _texture, _cache_buffer,
+                       INSTANCE_BINDING, draws[i].offset, draws[i].size, draws[i].tiles+1u);
+  }
+}
+
+void tile_layer::_render_direct(const rect_t& view, uint32 sort) {
+  auto& r = render_ctx::instance();
+  const float zoom = r.cam_zoom();
+  ntf::mat4 transform = r.get_proj()*r.get_view();
+  transform[0] /= zoom;
+  transform[1] /= zoom;
+
+  _staging.clear();
+  const cache_header header{
+    .background = render_ctx::CLEAR_COLOR,
+    .clip_min = vec2{view.min},
+    .clip_max = vec2{view.max},
+    .transform = transform,
+  };
+  const auto* bytes = reinterpret_cast<const uint8_t*>(&header);
+  _staging.insert(_staging.end(), bytes, bytes + sizeof(header));
+  bytes = reinterpret_cast<const uint8_t*>(_instances.data());
+  _staging.insert(_staging.end(), bytes, bytes + _instances.size()*sizeof(instance_data));
+  r.get_buffer(_cache_buffer).upload(0u, _staging.size(), _staging.data());
+  r.render_instanced(_pipeline, _texture, _cache_buffer, INSTANCE_BINDING,
+                     static_cast<uint32>(_instances.size())+1u, sort);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "./osm.hpp"
+
+#include <algorithm>
+#include <array>
+#include <iterator>
+#include <limits>
+#include <tuple>
+
+// Every resident tile lives in a layer of one texture array. The map gets composed into an
+// offscreen cache a bit larger than the viewport, which is what gets drawn on screen.
+// The cache wraps around in both directions: panning only draws the strips that scroll
+// into view, and a tile that loads or goes away only redraws its own rect. While the zoom
+// changes the tiles get drawn straight on screen, the cache gets redrawn once it settles.
+class tile_layer {
+public:
+  static constexpr uint32 MAX_LAYERS = 2048u; // GL_MAX_ARRAY_TEXTURE_LAYERS minimum on 4.6
+  static constexpr uint32 INSTANCE_BINDING = 2u;
+  static constexpr int32 CACHE_MARGIN = 256;    // pixels cached around the viewport
+  static constexpr uint32 CACHE_MAX_DIRTY = 4u; // rects redrawn on their own, more get merged
+  static constexpr size_t CACHE_ALIGN = 256u;   // largest SSBO offset alignment out there
+  static constexpr uint32 TILE_LEVELS = 9u; // 256x256 down to 1x1
+  static constexpr size_t TILE_BYTES = [](){ // RGBA8 with the full mip chain
+    size_t bytes = 0u;
+    for (uint32 size = osm_tileset::TILE_SIZE; size > 0u; size >>= 1u) {
+      bytes += size*size*4u;
+    }
+    return bytes;
+  }();
+
+private:
+  // std430, has to match tile_array.vs.glsl
+  struct instance_data {
+    vec2 pos;
+    float scale;
+    float layer;
+  };
+
+  // std430, goes before the tiles of each draw
+  struct cache_header {
+    color4 background;
+    vec2 clip_min, clip_max; // cache pixels, world units times the zoom
+    ntf::mat4 transform;     // cache pixels to clip space of the target
+  };
+  static_assert(sizeof(cache_header) == 96u);
+
+  struct rect_t {
+    ivec2 min, max; // max excluded
+  };
+
+  struct cache_t {
+    render_ctx::render_target_t target;
+    ivec2 size;
+    ivec2 origin; // first cached pixel, the window ends at origin+size
+    float zoom;
+    std::vector<instance_data> drawn; // sorted
+  };
+
+private:
+  tile_layer(pipeline_t pipeline, pipeline_t blit_pipeline, texture_t texture,
+             buffer_t cache_buffer, uint32 capacity) noexcept;
+
+public:
+  static tile_layer make_layer(std::string_view vert_src, std::string_view frag_src,
+                               uint32 capacity);
+
+public:
+  // Returns the layer index, or nullopt if every layer is taken
+  std::optional<uint32> acquire(const tile_image& image);
+  void release(uint32 layer);
+
+  void clear() { _instances.clear(); }
+  void push(vec2 pos, float scale, uint32 layer) {
+    _instances.emplace_back(pos, scale, static_cast<float>(layer));
+  }
+  // Offscreen pass, after render_ctx::start_render() and before anything gets drawn on screen
+  void prepare();
+  void render(uint32 sort = 0u);
+
+public:
+  uint32 capacity() const { return _capacity; }
+  uint32 free_layers() const { return static_cast<uint32>(_free.size()); }
+
+private:
+  static size_t _range_size(uint32 tiles);
+  rect_t _view_rect() const;
+  void _update_cache(const rect_t& view);
+  void _expose(const rect_t& old_win, const rect_t& new_win);
+  void _redraw_cache();
+  void _render_direct(const rect_t& view, uint32 sort);
+
+private:
+  pipeline_t _pipeline, _blit_pipeline;
+  texture_t _texture;
+  buffer_t _cache_buffer;
+  uint32 _capacity;
+  std::vector<uint32> _free;
+  std::vector<instance_data> _instances;
+
+  std::optional<cache_t> _cache;
+  float _last_zoom;
+  bool _zooming; // this frame, the cache gets bypassed
+  std::vector<instance_data> _sorted, _changed;
+  std::vector<rect_t> _dirty;
+  std::vector<uint8_t> _staging;
+};
@@ -0,0 +1,257 @@
+#include "./tile_manager.hpp"
+
+tile_manager::tile_manager(osm_map& map, const osm_tileset& tileset, tile_layer&& layer,
+                           const config_t& config) :
+  _map{map}, _tileset{tileset}, _layer{std::move(layer)}, _config{config},
+  _tick{0u}, _zoom{tileset.zoom()}, _range_min{0, 0}, _range_max{-1, -1}
+{
+  _config.min_zoom = std::min(_config.min_zoom, tileset.zoom());
+}
+
+uint32 tile_manager::zoom_for_scale(float cam_zoom) const {
+  // One level down each time the camera scale halves
+  const int32 offset = static_cast<int32>(std::round(std::log2(cam_zoom)));
+  return static_cast<uint32>(glm::clamp(static_cast<int32>(_tileset.zoom()) + offset,
+                                        static_cast<int32>(_config.min_zoom),
+                                        static_cast<int32>(_tileset.zoom())));
+}
+
+void tile_manager::update(vec2 cam_pos, vec2 viewport, float cam_zoom) {
+  ++_tick;
+  _zoom = zoom_for_scale(cam_zoom);
+  const int32 last_tile = (1 << _zoom) - 1;
+  const int32 margin = static_cast<int32>(_config.margin);
+  const auto clamp_tile = [last_tile](tile_coord tile) -> tile_coord {
+    return {glm::clamp(tile.x, 0, last_tile), glm::clamp(tile.y, 0, last_tile)};
+  };
+
+  // World y grows upwards, tile y grows downwards
+  const vec2 half_vp = viewport*(.5f/cam_zoom);
+  const auto view_min = clamp_tile(_tileset.tile_from_pos({cam_pos.x-half_vp.x,
+                                                           cam_pos.y+half_vp.y}, _zoom));
+  const auto view_max = clamp_tile(_tileset.tile_from_pos({cam_pos.x+half_vp.x,
+                                                           cam_pos.y-half_vp.y}, _zoom));
+  _range_min = clamp_tile(view_min - margin);
+  _range_max = clamp_tile(view_max + margin);
+
+  // Drop queued requests that scrolled out of range before they hit the network
+  _map.cancel_tiles([this](const osm_tile_loader::request_t& req) {
+    const tile_key key{req.tile, req.zoom};
+    if (_in_range(key) || _parents.contains(key)) {
+      return false;
+    }
+    _requested.erase(key);
+    return true;
+  });
+
+  _visible.clear();
+  std::vector<osm_tile_loader::request_t> reqs;
+  uint32 uploads = 0u;
+  for (int32 tile_x = _range_min.x; tile_x <= _range_max.x; ++tile_x) {
+    for (int32 tile_y = _range_min.y; tile_y <= _range_max.y; ++tile_y) {
+      const tile_key key{{tile_x, tile_y}, _zoom};
+      if (tile_x >= view_min.x && tile_x <= view_max.x &&
+          tile_y >= view_min.y && tile_y <= view_max.y) {
+        _visible.emplace_back(key);
+      }
+
+      const auto cpu_it = _cpu.find(key);
+      if (cpu_it != _cpu.end()) {
+        cpu_it->second.last_used = _tick;
+        _cpu_lru.splice(_cpu_lru.begin(), _cpu_lru, cpu_it->second.lru);
+      }
+
+      const auto gpu_it = _gpu.find(key);
+      if (gpu_it != _gpu.end()) {
+        gpu_it->second.last_used = _tick;
+        _gpu_lru.splice(_gpu_lru.begin(), _gpu_lru, gpu_it->second.lru);
+        continue;
+      }
+
+      if (cpu_it != _cpu.end()) {
+        if (uploads < _config.uploads_per_tick &&
+            _upload(key, cpu_it->second.image, cpu_it->second.pos)) {
+          ++uploads;
+        }
+        continue;
+      }
+
+      if (_can_request(key)) {
+        _requested.emplace(key);
+        reqs.emplace_back(key.tile, _zoom, _tileset.tile_pos(key.tile, _zoom));
+      }
+    }
+  }
+  if (!reqs.empty()) {
+    _map.request_tiles(std::move(reqs), _tileset.tile_from_pos(cam_pos, _zoom));
+  }
+
+  if (uploads < _config.uploads_per_tick) {
+    _map.poll_tiles(_config.uploads_per_tick - uploads,
+                    [this](osm_tile_loader::result_t&& result) {
+      if (result.tile) {
+        _store(std::move(*result.tile));
+      } else {
+        _fail({result.req.tile, result.req.zoom});
+      }
+    });
+  }
+
+  _find_fallbacks(cam_pos);
+  _evict();
+
+  _layer.clear();
+  for (const auto& key : _fallback) {
+    const auto& entry = _gpu.at(key);
+    _layer.push(entry.pos, entry.scale, entry.layer);
+  }
+  for (const auto& key : _visible) {
+    const auto it = _gpu.find(key);
+    if (it != _gpu.end()) {
+      _layer.push(it->second.pos, it->second.scale, it->second.layer);
+    }
+  }
+}
+
+auto tile_manager::stats() const -> stats_t {
+  return {
+    .cpu_bytes = _cpu.size()*tile_layer::TILE_BYTES,
+    .gpu_bytes = _gpu.size()*tile_layer::TILE_BYTES,
+    .cpu_tiles = static_cast<uint32>(_cpu.size()),
+    .gpu_tiles = static_cast<uint32>(_gpu.size()),
+    .visible = static_cast<uint32>(_visible.size()),
+    .pending = _map.pending_tiles(),
+    .zoom = _zoom,
+  };
+}
+
+bool tile_manager::_in_range(const tile_key& key) const {
+  return key.zoom == _zoom &&
+    key.tile.x >= _range_min.x && key.tile.x <= _range_max.x &&
+    key.tile.y >= _range_min.y && key.tile.y <= _range_max.y;
+}
+
+bool tile_manager::_upload(const tile_key& key, const tile_image& image, vec2 pos) {
+  if (!_layer.free_layers()) {
+    _evict_gpu(_layer.capacity()-1u);
+  }
+  const auto layer = _layer.acquire(image);
+  if (!layer) {
+    return false;
+  }
+  _gpu_lru.emplace_front(key);
+  _gpu.emplace(key, gpu_entry{
+    .layer = *layer,
+    .pos = pos,
+    .scale = _tileset.tile_scale(key.zoom),
+    .last_used = _tick,
+    .lru = _gpu_lru.begin(),
+  });
+  return true;
+}
+
+bool tile_manager::_can_request(const tile_key& key) const {
+  if (_requested.contains(key)) {
+    return false;
+  }
+  const auto it = _failed.find(key);
+  return it == _failed.end() || it->second.tick <= _tick;
+}
+
+void tile_manager::_store(osm_tileset::tile_t&& tile) {
+  const tile_key key{tile.tile, tile.zoom};
+  _requested.erase(key);
+  _failed.erase(key);
+  if ((_in_range(key) || _parents.contains(key)) && !_gpu.contains(key)) {
+    _upload(key, tile.image, tile.pos);
+  }
+  if (!_cpu.contains(key)) {
+    _cpu_lru.emplace_front(key);
+    _cpu.emplace(key, cpu_entry{std::move(tile.image), tile.pos, _tick, _cpu_lru.begin()});
+  }
+}
+
+// Failed tiles get requested again once they are due, backing off while they keep failing
+void tile_manager::_fail(const tile_key& key) {
+  _requested.erase(key);
+  const uint32 base = std::max(_config.retry_ticks, 1u);
+  auto [it, first] = _failed.try_emplace(key, retry_entry{0u, base});
+  if (!first) {
+    it->second.delay = std::min(it->second.delay*2u, base << MAX_RETRY_SHIFT);
+  }
+  it->second.tick = _tick + it->second.delay;
+  logger::debug("[tile_manager] Tile ({}, {}) zoom {} failed, retrying in {} ticks",
+                key.tile.x, key.tile.y, key.zoom, it->second.delay);
+}
+
+void tile_manager::_find_fallbacks(vec2 cam_pos) {
+  _fallback.clear();
+  _parents.clear();
+  std::vector<osm_tile_loader::request_t> reqs;
+  for (const auto& key : _visible) {
+    if (_gpu.contains(key)) {
+      continue;
+    }
+    bool found = false;
+    for (uint32 zoom = key.zoom; zoom-- > _config.min_zoom;) {
+      const uint32 shift = key.zoom - zoom;
+      const tile_key parent{{key.tile.x >> shift, key.tile.y >> shift}, zoom};
+      auto it = _gpu.find(parent);
+      if (it == _gpu.end()) {
+        const auto cpu_it = _cpu.find(parent);
+        if (cpu_it == _cpu.end() || !_upload(parent, cpu_it->second.image, cpu_it->second.pos)) {
+          continue;
+        }
+        it = _gpu.find(parent);
+      }
+      it->second.last_used = _tick;
+      _gpu_lru.splice(_gpu_lru.begin(), _gpu_lru, it->second.lru);
+      _fallback.emplace_back(parent);
+      found = true;
+      break;
+    }
+    if (found || key.zoom == _config.min_zoom) {
+      continue;
+    }
+
+    // Nothing to draw under it, a parent covers 4 tiles and usually loads first
+    const tile_key parent{{key.tile.x >> 1, key.tile.y >> 1}, key.zoom-1u};
+    _parents.emplace(parent);
+    if (_can_request(parent)) {
+      _requested.emplace(parent);
+      reqs.emplace_back(parent.tile, parent.zoom, _tileset.tile_pos(parent.tile, parent.zoom));
+    }
+  }
+  if (!reqs.empty()) {
+    const uint32 zoom = reqs.front().zoom;
+    _map.request_tiles(std::move(reqs), _tileset.tile_from_pos(cam_pos, zoom), true);
+  }
+
+  std::sort(_fallback.begin(), _fallback.end(), [](const tile_key& a, const tile_key& b) {
+    if (a.zoom != b.zoom) {
+      return a.zoom < b.zoom;
+    }
+    return a.tile.x != b.tile.x ? a.tile.x < b.tile.x : a.tile.y < b.tile.y;
+  });
+  _fallback.erase(std::unique(_fallback.begin(), _fallback.end()), _fallback.end());
+}
+
+// Tiles in use get touched on every update, so once the LRU tail was used this tick
+// everything else was too and the budget is just too small for the viewport
+void tile_manager::_evict_gpu(size_t max_tiles) {
+  while (_gpu.size() > max_tiles && _gpu.at(_gpu_lru.back()).last_used != _tick) {
+    const auto it = _gpu.find(_gpu_lru.back());
+    _layer.release(it->second.layer);
+    _gpu.erase(it);
+    _gpu_lru.pop_back();
+  }
+}
+
+void tile_manager::_evict() {
+  _evict_gpu(_config.gpu_budget/tile_layer::TILE_BYTES);
+  while (_cpu.size()*tile_layer::TILE_BYTES > _config.cpu_budget &&
+         _cpu.at(_cpu_lru.back()).last_used != _tick) {
+    _cpu.erase(_cpu_lru.back());
+    _cpu_lru.pop_back();
+  }
+}
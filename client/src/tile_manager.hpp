@@ -0,0 +1,106 @@
+#pragma once
+
+#include "./osm.hpp"
+#include "./tile_layer.hpp"
+
+#include <list>
+#include <unordered_map>
+
+// Keeps resident only the tiles around the camera, everything else gets streamed in and
+// evicted in LRU order once the memory budgets are exceeded.
+// The zoom level follows the camera scale, missing tiles are covered by their nearest
+// resident parent until they load.
+class tile_manager {
+public:
+  struct config_t {
+    size_t cpu_budget;       // bytes of decoded images kept around
+    size_t gpu_budget;       // bytes of texture memory, also bounded by the layer capacity
+    uint32 margin;           // tiles loaded around the viewport
+    uint32 uploads_per_tick; // texture uploads per update() call
+    uint32 min_zoom;         // lowest zoom level loaded, the tileset zoom is the highest
+    uint32 retry_ticks;      // wait before requesting a failed tile again, doubles each time
+  };
+
+  struct stats_t {
+    size_t cpu_bytes, gpu_bytes;
+    uint32 cpu_tiles, gpu_tiles;
+    uint32 visible, pending;
+    uint32 zoom;
+  };
+
+private:
+  struct gpu_entry {
+    uint32 layer;
+    vec2 pos;
+    float scale;
+    uint64_t last_used; // update() tick
+    std::list<tile_key>::iterator lru;
+  };
+
+  struct cpu_entry {
+    tile_image image;
+    vec2 pos;
+    uint64_t last_used;
+    std::list<tile_key>::iterator lru;
+  };
+
+  struct retry_entry {
+    uint64_t tick; // not requested again before this update() tick
+    uint32 delay;
+  };
+
+public:
+  static constexpr uint32 MAX_RETRY_SHIFT = 6u; // backoff stops growing at 64x retry_ticks
+
+public:
+  tile_manager(osm_map& map, const osm_tileset& tileset, tile_layer&& layer,
+               const config_t& config);
+
+  tile_manager(const tile_manager&) = delete;
+  tile_manager& operator=(const tile_manager&) = delete;
+
+public:
+  // Call once per tick from the render thread
+  void update(vec2 cam_pos, vec2 viewport, float cam_zoom);
+
+  // Zoom level for a camera scale, the tileset zoom maps to 1
+  uint32 zoom_for_scale(float cam_zoom) const;
+
+  // Offscreen pass of the tile layer, see tile_layer::prepare()
+  void prepare() { _layer.prepare(); }
+  // Draws every visible tile in one call
+  void render(uint32 sort = 0u) { _layer.render(sort); }
+
+  stats_t stats() const;
+
+private:
+  bool _in_range(const tile_key& key) const;
+  bool _upload(const tile_key& key, const tile_image& image, vec2 pos);
+  bool _can_request(const tile_key& key) const;
+  void _store(osm_tileset::tile_t&& tile);
+  void _fail(const tile_key& key);
+  void _evict_gpu(size_t max_tiles);
+  void _evict();
+  void _find_fallbacks(vec2 cam_pos);
+
+private:
+  osm_map& _map;
+  const osm_tileset& _tileset;
+  tile_layer _layer;
+  config_t _config;
+
+  uint64_t _tick;
+  uint32 _zoom;
+  tile_coord _range_min, _range_max; // visible tiles plus margin
+  std::vector<tile_key> _visible;
+  std::vector<tile_key> _fallback; // parents drawn under missing tiles, lowest zoom first
+  std::unordered_set<tile_key, tile_key_hash> _parents; // still loading, for missing tiles
+  std::unordered_set<tile_key, tile_key_hash> _requested;
+  std::unordered_map<tile_key, retry_entry, tile_key_hash> _failed;
+
+  // Front is the most recently used
+  std::unordered_map<tile_key, gpu_entry, tile_key_hash> _gpu;
+  std::list<tile_key> _gpu_lru;
+  std::unordered_map<tile_key, cpu_entry, tile_key_hash> _cpu;
+  std::list<tile_key> _cpu_lru;
+};
@@ -0,0 +1,116 @@
+#include "./tile_prefetch.hpp"
+
+static constexpr double METERS_PER_DEGREE = 111320.; // along a meridian
+static constexpr size_t MAX_QUEUED = 4096u;
+
+tile_prefetcher::tile_prefetcher(const config_t& config) noexcept :
+  _config{config}, _dirty{false}
+{
+  _config.history = std::max(_config.history, 2u);
+  _config.step = std::max(_config.step, .1f);
+}
+
+void tile_prefetcher::push_fix(gps_coord coord, chrono_clock::time_point time) {
+  if (!_fixes.empty() && _fixes.back().time >= time) {
+    return;
+  }
+  _fixes.emplace_back(coord, time);
+  while (_fixes.size() > _config.history) {
+    _fixes.pop_front();
+  }
+  _dirty = true;
+}
+
+void tile_prefetcher::clear() {
+  _fixes.clear();
+  _queued.clear();
+  _dirty = false;
+}
+
+auto tile_prefetcher::motion() const -> std::optional<motion_t> {
+  if (_fixes.size() < 2u) {
+    return std::nullopt;
+  }
+
+  // Fit coord = a + v*t, a single noisy fix shouldn't swing the heading around
+  const auto t0 = _fixes.front().time;
+  const auto seconds = [t0](chrono_clock::time_point t) {
+    return std::chrono::duration<double>(t - t0).count();
+  };
+  double mean_t = 0.;
+  gps_coord mean_c{0., 0.};
+  for (const auto& fix : _fixes) {
+    mean_t += seconds(fix.time);
+    mean_c += fix.coord;
+  }
+  mean_t /= _fixes.size();
+  mean_c /= static_cast<double>(_fixes.size());
+
+  double var_t = 0.;
+  gps_coord cov{0., 0.};
+  for (const auto& fix : _fixes) {
+    const double dt = seconds(fix.time) - mean_t;
+    var_t += dt*dt;
+    cov += (fix.coord - mean_c)*dt;
+  }
+  if (var_t <= 0.) {
+    return std::nullopt;
+  }
+  const gps_coord velocity = cov/var_t;
+
+  // lat maps to x and lng to y, same as everywhere else
+  const auto& last = _fixes.back().coord;
+  const double north = velocity.x*METERS_PER_DEGREE;
+  const double east = velocity.y*METERS_PER_DEGREE*std::cos(glm::radians(last.x));
+  double heading = glm::degrees(std::atan2(east, north));
+  if (heading < 0.) {
+    heading += 360.;
+  }
+  return motion_t{
+    .pos = last,
+    .velocity = velocity,
+    .speed = std::sqrt(north*north + east*east),
+    .heading = heading,
+  };
+}
+
+void tile_prefetcher::update(osm_map& map, uint32 zoom) {
+  if (!_dirty) {
+    return;
+  }
+  _dirty = false;
+
+  const auto motion = this->motion();
+  if (!motion || motion->speed < _config.min_speed) {
+    return;
+  }
+
+  if (_queued.size() > MAX_QUEUED) {
+    _queued.clear();
+  }
+
+  const int32 radius = static_cast<int32>(_config.radius);
+  const int32 last_tile = (1 << zoom) - 1;
+  std::vector<osm_tile_loader::request_t> reqs;
+  for (float t = _config.step; t <= _config.lookahead; t += _config.step) {
+    const auto center = coord2tile(motion->pos + motion->velocity*static_cast<double>(t), zoom);
+    for (int32 dx = -radius; dx <= radius; ++dx) {
+      for (int32 dy = -radius; dy <= radius; ++dy) {
+        const tile_key key{{center.x+dx, center.y+dy}, zoom};
+        if (key.tile.x < 0 || key.tile.y < 0 || key.tile.x > last_tile ||
+            key.tile.y > last_tile || _queued.contains(key)) {
+          continue;
+        }
+        _queued.emplace(key);
+        // Nothing gets rendered from these, the position is not needed
+        reqs.emplace_back(key.tile, zoom, vec2{0.f, 0.f});
+      }
+    }
+  }
+  if (reqs.empty()) {
+    return;
+  }
+  logger::debug("[tile_prefetcher] Queued {} tiles, {:.1f} m/s heading {:.0f} deg",
+                reqs.size(), motion->speed, motion->heading);
+  map.prefetch_tiles(std::move(reqs));
+}
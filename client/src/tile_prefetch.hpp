@@ -0,0 +1,50 @@
+#pragma once
+
+#include "./osm.hpp"
+
+// Guesses where the tracker is heading from its last fixes and queues low priority
+// downloads for the tiles along that path, so they are already cached once the camera
+// follows it there.
+class tile_prefetcher {
+public:
+  struct config_t {
+    float lookahead; // seconds of travel to prefetch
+    float step;      // seconds between samples along the projected path
+    uint32 radius;   // extra tiles around each sample
+    uint32 history;  // fixes used to estimate the motion
+    float min_speed; // m/s, below this the tracker is considered stopped
+  };
+
+  struct motion_t {
+    gps_coord pos;      // last fix
+    gps_coord velocity; // degrees per second
+    double speed;       // m/s
+    double heading;     // degrees clockwise from north
+  };
+
+private:
+  struct fix_t {
+    gps_coord coord;
+    chrono_clock::time_point time;
+  };
+
+public:
+  tile_prefetcher(const config_t& config) noexcept;
+
+public:
+  void push_fix(gps_coord coord, chrono_clock::time_point time);
+
+  // Least squares fit over the fix history, needs at least two fixes at different times
+  std::optional<motion_t> motion() const;
+
+  // Does nothing until a new fix arrives
+  void update(osm_map& map, uint32 zoom);
+
+  void clear();
+
+private:
+  config_t _config;
+  std::deque<fix_t> _fixes;
+  std::unordered_set<tile_key, tile_key_hash> _queued;
+  bool _dirty;
+};
@@ -0,0 +1,321 @@
+#include "./track_layer.hpp"
+
+// One color per track, in the order the devices show up
+static constexpr color4 track_colors[] = {
+  {.898f, .224f, .208f, 1.f},
+  {.263f, .627f, .278f, 1.f},
+  {.557f, .141f, .667f, 1.f},
+  {.984f, .549f, 0.f, 1.f},
+  {0.f, .592f, .655f, 1.f},
+  {.847f, .106f, .376f, 1.f},
+  {.486f, .702f, .259f, 1.f},
+  {.247f, .318f, .71f, 1.f},
+};
+
+// Douglas-Peucker, both ends are always kept so consecutive chunks still join
+static void simplify(const std::vector<vec2>& in, float tolerance, std::vector<vec2>& out) {
+  out.clear();
+  if (in.size() <= 2u) {
+    out = in;
+    return;
+  }
+  std::vector<uint8_t> keep(in.size(), 0u);
+  keep.front() = keep.back() = 1u;
+  std::vector<std::pair<size_t, size_t>> stack{{0u, in.size()-1u}};
+  const float max_dist2 = tolerance*tolerance;
+  while (!stack.empty()) {
+    const auto [a, b] = stack.back();
+    stack.pop_back();
+    const vec2 seg = in[b] - in[a];
+    const float seg_len2 = glm::dot(seg, seg);
+    float far_dist2 = 0.f;
+    size_t far = a;
+    for (size_t i = a+1u; i < b; ++i) {
+      const vec2 rel = in[i] - in[a];
+      const float t = seg_len2 > 0.f ? glm::clamp(glm::dot(rel, seg)/seg_len2, 0.f, 1.f) : 0.f;
+      const vec2 diff = rel - seg*t;
+      const float dist2 = glm::dot(diff, diff);
+      if (dist2 > far_dist2) {
+        far_dist2 = dist2;
+        far = i;
+      }
+    }
+    if (far_dist2 > max_dist2) {
+      keep[far] = 1u;
+      stack.emplace_back(a, far);
+      stack.emplace_back(far, b);
+    }
+  }
+  for (size_t i = 0u; i < in.size(); ++i) {
+    if (keep[i]) {
+      out.emplace_back(in[i]);
+    }
+  }
+}
+
+static constexpr std::string_view vert_track = R"glsl(
+#version 460 core
+
+layout (location = 0) in vec3 att_coords;
+layout (location = 1) in vec3 att_normals;
+layout (location = 2) in vec2 att_texcoords;
+
+layout (std430, binding = 4) readonly buffer track_data {
+  vec4 color;
+  float half_width;
+  uint first;
+  uint capacity;
+  uint count;
+  vec2 points[];
+};
+
+out vec2 frag_pos; // screen pixels
+flat out vec2 seg_a;
+flat out vec2 seg_b;
+flat out vec4 seg_color;
+flat out float seg_half_width;
+
+void main() {
+  // Instance i joins point i and i+1, both taken to screen pixels so the width stays the
+  // same at every zoom
+  uint i = first + uint(gl_InstanceID);
+  vec2 a = (u_view*vec4(points[i % capacity], 0.f, 1.f)).xy;
+  vec2 b = (u_view*vec4(points[(i+1u) % capacity], 0.f, 1.f)).xy;
+  vec2 dir = b - a;
+  float len = length(dir);
+  dir = len > 1e-4f ? dir/len : vec2(1.f, 0.f);
+  vec2 normal = vec2(-dir.y, dir.x);
+
+  // The quad covers the segment and both round caps, plus a pixel for the antialiasing
+  float extent = half_width + 1.f;
+  vec2 corner = att_coords.xy*2.f;
+  frag_pos = mix(a, b, corner.x*.5f + .5f) + (dir*corner.x + normal*corner.y)*extent;
+  gl_Position = u_proj*vec4(frag_pos, 0.f, 1.f);
+
+  seg_a = a;
+  seg_b = b;
+  seg_color = color;
+  seg_half_width = half_width;
+}
+)glsl";
+
+static constexpr std::string_view frag_track = R"glsl(
+#version 460 core
+
+in vec2 frag_pos;
+flat in vec2 seg_a;
+flat in vec2 seg_b;
+flat in vec4 seg_color;
+flat in float seg_half_width;
+out vec4 frag_color;
+
+float segment_dist(vec2 p, vec2 a, vec2 b) {
+  vec2 pa = p - a;
+  vec2 ba = b - a;
+  float h = clamp(dot(pa, ba)/max(dot(ba, ba), 1e-8f), 0.f, 1.f);
+  return length(pa - ba*h);
+}
+
+void main() {
+  float dist = segment_dist(frag_pos, seg_a, seg_b) - seg_half_width;
+  float alpha = clamp(.5f - dist, 0.f, 1.f);
+  if (alpha <= 0.f) {
+    discard;
+  }
+  frag_color = vec4(seg_color.rgb, seg_color.a*alpha);
+}
+)glsl";
+
+track_layer::track_layer(pipeline_t pipeline, buffer_t buffer, uint32 max_tracks,
+                         size_t region_size, float width) noexcept :
+  _pipeline{pipeline}, _buffer{buffer}, _max_tracks{max_tracks},
+  _capacity{static_cast<uint32>((region_size - sizeof(track_header))/sizeof(vec2))},
+  _region_size{region_size}, _width{width}, _level{0u}
+{
+  _tracks.reserve(max_tracks);
+}
+
+track_layer track_layer::make_layer(uint32 max_tracks, uint32 points_per_track, float width) {
+  auto& r = render_ctx::instance();
+  max_tracks = std::max(max_tracks, 1u);
+  // Room for the newest chunk while the oldest one is still around
+  points_per_track = std::max(points_per_track, 2u*CHUNK_POINTS);
+  // Every region has to start at an offset the SSBO binding accepts
+  const size_t bytes = sizeof(track_header) + points_per_track*sizeof(vec2);
+  const size_t region_size = (bytes + REGION_ALIGN-1u)/REGION_ALIGN*REGION_ALIGN;
+  logger::debug("[track_layer] Allocating {} tracks of {} KiB", max_tracks, region_size >> 10u);
+  auto pip = r.make_pipeline(vert_track, frag_track);
+  auto buff = r.make_buffer(max_tracks*region_size, ntf::r_buffer_type::shader_storage);
+  return track_layer{pip, buff, max_tracks, region_size, width};
+}
+
+float track_layer::level_tolerance(uint32 level) {
+  return level ? LOD_TOLERANCE*static_cast<float>(1u << (2u*(level-1u))) : 0.f;
+}
+
+uint32 track_layer::pick_level(float cam_zoom) {
+  uint32 level = 0u;
+  while (level+1u < LOD_LEVELS && level_tolerance(level+1u)*cam_zoom <= LOD_MAX_ERROR) {
+    ++level;
+  }
+  return level;
+}
+
+bool track_layer::push(uint16_t device, vec2 pos) {
+  auto it = _track_index.find(device);
+  if (it == _track_index.end()) {
+    if (_tracks.size() == _max_tracks) {
+      return false;
+    }
+    const auto index = static_cast<uint32>(_tracks.size());
+    it = _track_index.emplace(device, index).first;
+    auto& track = _tracks.emplace_back();
+    track.device = device;
+    track.color = track_colors[index % std::size(track_colors)];
+    track.raw_count = 0u;
+    track.ring.resize(_capacity);
+    track.first = track.count = track.synced = 0u;
+    track.dirty = true;
+  }
+
+  auto& track = _tracks[it->second];
+  if (track.raw_count && track.chunks.back().levels[0].back() == pos) {
+    return true; // parked, nothing to draw
+  }
+  if (track.raw_count == _capacity) {
+    _trim(track);
+  }
+  if (track.chunks.empty() || track.chunks.back().levels[0].size() == CHUNK_POINTS) {
+    track.chunks.emplace_back().levels[0].reserve(CHUNK_POINTS);
+  }
+  track.chunks.back().levels[0].emplace_back(pos);
+  ++track.raw_count;
+  _ring_push(track, {&pos, 1u});
+  if (track.chunks.back().levels[0].size() == CHUNK_POINTS) {
+    _seal(track);
+  }
+  return true;
+}
+
+void track_layer::clear() {
+  for (auto& track : _tracks) {
+    track.chunks.clear();
+    track.raw_count = 0u;
+    track.first = track.count = track.synced = 0u;
+    track.dirty = true;
+  }
+}
+
+void track_layer::update(float cam_zoom) {
+  const auto level = pick_level(cam_zoom);
+  if (level == _level) {
+    return;
+  }
+  logger::debug("[track_layer] LOD level {} -> {}", _level, level);
+  _level = level;
+  for (auto& track : _tracks) {
+    _rebuild(track);
+  }
+}
+
+size_t track_layer::point_count() const {
+  size_t count = 0u;
+  for (const auto& track : _tracks) {
+    count += track.count;
+  }
+  return count;
+}
+
+size_t track_layer::raw_point_count() const {
+  size_t count = 0u;
+  for (const auto& track : _tracks) {
+    count += track.raw_count;
+  }
+  return count;
+}
+
+void track_layer::_seal(track_t& track) {
+  auto& chunk = track.chunks.back();
+  for (uint32 level = 1u; level < LOD_LEVELS; ++level) {
+    simplify(chunk.levels[0], level_tolerance(level), chunk.levels[level]);
+  }
+  if (_level) {
+    // Swap the raw points of the chunk for its simplified ones
+    _ring_pop(track, CHUNK_POINTS);
+    _ring_push(track, chunk.levels[_level]);
+  }
+}
+
+void track_layer::_trim(track_t& track) {
+  NTF_ASSERT(track.chunks.size() > 1u);
+  const auto& chunk = track.chunks.front();
+  const auto drawn = static_cast<uint32>(chunk.levels[_level].size());
+  track.first = (track.first + drawn) % _capacity;
+  track.count -= drawn;
+  track.synced -= std::min(track.synced, drawn);
+  track.raw_count -= chunk.levels[0].size();
+  track.chunks.pop_front();
+  track.dirty = true;
+}
+
+void track_layer::_rebuild(track_t& track) {
+  track.first = track.count = track.synced = 0u;
+  for (size_t i = 0u; i < track.chunks.size(); ++i) {
+    const bool open = i+1u == track.chunks.size() &&
+                      track.chunks[i].levels[0].size() < CHUNK_POINTS;
+    _ring_push(track, track.chunks[i].levels[open ? 0u : _level]);
+  }
+  track.dirty = true;
+}
+
+void track_layer::_ring_push(track_t& track, ntf::cspan<vec2> points) {
+  NTF_ASSERT(track.count + points.size() <= _capacity);
+  for (const auto& pos : points) {
+    track.ring[(track.first + track.count++) % _capacity] = pos;
+  }
+  track.dirty = true;
+}
+
+void track_layer::_ring_pop(track_t& track, uint32 count) {
+  track.count -= count;
+  track.synced = std::min(track.synced, track.count);
+  track.dirty = true;
+}
+
+void track_layer::_upload(uint32 index, track_t& track) {
+  auto buffer = render_ctx::instance().get_buffer(_buffer);
+  const size_t region = index*_region_size;
+  const size_t points = region + sizeof(track_header);
+
+  // Only the points that changed, at most two ranges when they wrap around the ring
+  while (track.synced < track.count) {
+    const uint32 start = (track.first + track.synced) % _capacity;
+    const uint32 len = std::min(track.count - track.synced, _capacity - start);
+    buffer.upload(points + start*sizeof(vec2), len*sizeof(vec2), track.ring.data()+start);
+    track.synced += len;
+  }
+  if (track.dirty) {
+    const track_header header{
+      .color = track.color,
+      .half_width = _width*.5f,
+      .first = track.first,
+      .capacity = _capacity,
+      .count = track.count,
+    };
+    buffer.upload(region, sizeof(header), &header);
+    track.dirty = false;
+  }
+}
+
+void track_layer::render(uint32 sort) {
+  auto& r = render_ctx::instance();
+  for (uint32 i = 0u; i < _tracks.size(); ++i) {
+    auto& track = _tracks[i];
+    _upload(i, track);
+    if (track.count < 2u) {
+      continue;
+    }
+    r.render_instanced_range(_pipeline, _buffer, INSTANCE_BINDING, i*_region_size,
+                             _region_size, track.count-1u, sort);
+  }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "./renderer.hpp"
+
+#include <array>
+#include <deque>
+#include <unordered_map>
+
+// Where every tracker has been, as antialiased lines of a few pixels. Each track owns a
+// fixed region of one storage buffer, a ring of points behind a small header. New points
+// get uploaded on their own, the rest of the path stays on the GPU, and each track is drawn
+// with one instanced call, a quad per segment shaded with a capsule SDF.
+//
+// Tracks are split in chunks of CHUNK_POINTS fixes. Once a chunk fills up it gets
+// simplified (Douglas-Peucker) once per LOD level, the coarsest level whose error doesn't
+// show at the current camera zoom gets drawn. The newest chunk is always raw, switching
+// levels rebuilds the rings. Once a track goes over its capacity its oldest chunk is dropped.
+class track_layer {
+public:
+  static constexpr uint32 INSTANCE_BINDING = 4u;
+  static constexpr size_t REGION_ALIGN = 256u; // largest SSBO offset alignment out there
+  static constexpr uint32 CHUNK_POINTS = 256u;
+  static constexpr uint32 LOD_LEVELS = 5u;       // level 0 are the raw fixes
+  static constexpr float LOD_TOLERANCE = .5f;    // world units of level 1, x4 every level
+  static constexpr float LOD_MAX_ERROR = .5f;    // screen pixels
+
+private:
+  // std430, has to match the shaders in track_layer.cpp. The points follow it
+  struct track_header {
+    color4 color;
+    float half_width; // screen pixels
+    uint32 first;     // ring index of the oldest point
+    uint32 capacity;
+    uint32 count;
+  };
+  static_assert(sizeof(track_header) == 32u);
+
+  struct chunk_t {
+    std::array<std::vector<vec2>, LOD_LEVELS> levels; // only the raw one until it's full
+  };
+
+  struct track_t {
+    uint16_t device;
+    color4 color;
+    std::deque<chunk_t> chunks; // oldest first, the last one is still filling up
+    size_t raw_count;
+
+    // Points of the drawn level, same ring as on the GPU
+    std::vector<vec2> ring;
+    uint32 first, count;
+    uint32 synced; // oldest points already on the GPU
+    bool dirty;    // header changed
+  };
+
+private:
+  track_layer(pipeline_t pipeline, buffer_t buffer, uint32 max_tracks, size_t region_size,
+              float width) noexcept;
+
+public:
+  // Room for `max_tracks` tracks of at least `points_per_track` raw points each. Positions
+  // are world units, see osm_tileset::pos_from_coord()
+  static track_layer make_layer(uint32 max_tracks, uint32 points_per_track, float width);
+
+  // Coarsest level whose simplification error stays under LOD_MAX_ERROR at `cam_zoom`
+  static uint32 pick_level(float cam_zoom);
+  static float level_tolerance(uint32 level);
+
+public:
+  // False if the device has no track and every track is taken
+  bool push(uint16_t device, vec2 pos);
+  void clear();
+
+  // Picks the level of detail for the camera zoom (screen pixels per world unit)
+  void update(float cam_zoom);
+  void render(uint32 sort = 0u);
+
+public:
+  uint32 max_tracks() const { return _max_tracks; }
+  uint32 capacity() const { return _capacity; } // raw points per track
+  uint32 size() const { return static_cast<uint32>(_tracks.size()); }
+  uint32 level() const { return _level; }
+  size_t point_count() const; // drawn, at the current level
+  size_t raw_point_count() const;
+
+private:
+  void _seal(track_t& track);
+  void _trim(track_t& track);
+  void _rebuild(track_t& track);
+  void _ring_push(track_t& track, ntf::cspan<vec2> points);
+  void _ring_pop(track_t& track, uint32 count);
+  void _upload(uint32 index, track_t& track);
+
+private:
+  pipeline_t _pipeline;
+  buffer_t _buffer;
+  uint32 _max_tracks, _capacity;
+  size_t _region_size;
+  float _width;
+  uint32 _level;
+  std::vector<track_t> _tracks;
+  std::unordered_map<uint16_t, uint32> _track_index;
+};
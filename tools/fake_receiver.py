@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+# Stand-in for the NodeMCU receiver, for testing the client without any hardware.
+# Serves the same endpoints as lora_gps_recv.ino with a few trackers driving in circles
+# around the default map position:
+#
+#   GET /                     JSON snapshot of the last device heard from
+#   GET /frame                same, as a binary frame
+#   GET /devices?since=N      JSON of every device changed after sequence number N
+#   GET /devices.bin?since=N  same, as back to back binary frames
+#   GET /stream               Server-Sent Events, on the stream port
+#   GET /frames               back to back binary frames, on the stream port
+#
+#   ./tools/fake_receiver.py [--port 8080] [--stream-port 8081] [--devices 3]
+#   ./build/osm_client tile_cache/ http://127.0.0.1:8080/devices.bin http://127.0.0.1:8081/frames
+#
+# Pass an empty stream url ("") to make the client poll instead.
+
+import argparse
+import json
+import math
+import random
+import struct
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+CENTER = (-24.741087, -65.389729)
+RADIUS = 0.004          # degrees
+LAP_TIME = 240.0        # seconds per lap
+HEARTBEAT = 15.0        # seconds, same as STREAM_HEARTBEAT
+
+# See arduino/lib/gps_frame/gps_frame.h
+FRAME = struct.Struct("<2sBBHxxIIIiihBx")
+FRAME_VERSION = 2
+FRAME_AVAILABLE = 0x01
+FRAME_KEEPALIVE = 0x02
+
+start = time.monotonic()
+state_lock = threading.Condition()
+devices = {}        # id -> state, same fields as the receiver JSON
+table_seq = 0
+latest = None
+
+
+def millis():
+    return int((time.monotonic() - start)*1000)
+
+
+def make_fix(device):
+    # Every tracker on its own circle, at its own speed
+    radius = RADIUS*(1.0 + 0.35*device)
+    angle = 2*math.pi*(time.monotonic() - start)/(LAP_TIME*(1.0 + 0.2*device)) + device
+    now = time.gmtime()
+    return {
+        "id": device,
+        "seq": 0,
+        "available": 1,
+        "last_update": millis(),
+        "rssi": -60 - int(20*abs(math.sin(angle))),
+        "time": now.tm_hour*10000 + now.tm_min*100 + now.tm_sec,
+        "sat_count": 7,
+        "lat": round(CENTER[0] + radius*math.sin(angle), 6),
+        "lng": round(CENTER[1] + radius*math.cos(angle), 6),
+    }
+
+
+def touch(dev):
+    global table_seq
+    table_seq += 1
+    dev["seq"] = table_seq
+
+
+def sender(device, interval, dropout):
+    # Mimics a tracker and lora_poll(): a new packet every `interval`, every `dropout`
+    # packets the tracker goes silent long enough to be flagged as unavailable
+    global latest
+    time.sleep(random.uniform(0, interval))
+    count = 0
+    while True:
+        count += 1
+        lost = dropout and count % dropout == 0
+        with state_lock:
+            if not lost:
+                devices[device] = make_fix(device)
+                touch(devices[device])
+                latest = device
+            elif device in devices:
+                devices[device]["available"] = 0
+                touch(devices[device])
+            state_lock.notify_all()
+        time.sleep(interval*(5 if lost else 1))
+
+
+def since_query(path):
+    try:
+        since = int(parse_qs(urlparse(path).query).get("since", ["0"])[0])
+    except ValueError:
+        since = 0
+    # Same as the receiver, a sequence number from before a reboot gets everything
+    return 0 if since > table_seq else since
+
+
+def changed_since(since):
+    return [dev for dev in devices.values() if dev["seq"] > since]
+
+
+def encode(dev):
+    return json.dumps(dev, separators=(",", ":"))
+
+
+def encode_frame(dev):
+    flags = FRAME_AVAILABLE if dev["available"] else 0
+    return FRAME.pack(b"GF", FRAME_VERSION, flags, dev["id"], dev["seq"], dev["last_update"],
+                      dev["time"], round(dev["lat"]*1e7), round(dev["lng"]*1e7),
+                      dev["rssi"], dev["sat_count"])
+
+
+def encode_keepalive():
+    return FRAME.pack(b"GF", FRAME_VERSION, FRAME_KEEPALIVE, 0, table_seq, 0, 0, 0, 0, 0, 0)
+
+
+class SnapshotHandler(BaseHTTPRequestHandler):
+    def do_GET(self):
+        path = urlparse(self.path).path
+        with state_lock:
+            if path in ("/", "/frame"):
+                if latest is None:
+                    self._reply(204, "text/json", b"")
+                elif path == "/":
+                    self._reply(200, "text/json", encode(devices[latest]).encode())
+                else:
+                    self._reply(200, "application/octet-stream", encode_frame(devices[latest]))
+            elif path == "/devices":
+                changed = changed_since(since_query(self.path))
+                body = json.dumps({"seq": table_seq, "devices": changed}, separators=(",", ":"))
+                self._reply(200, "text/json", body.encode())
+            elif path == "/devices.bin":
+                changed = changed_since(since_query(self.path))
+                body = b"".join(encode_frame(dev) for dev in changed)
+                self._reply(200, "application/octet-stream", body)
+            else:
+                self.send_error(404)
+
+    def _reply(self, code, content_type, body):
+        self.send_response(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+class StreamHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        if self.path not in ("/stream", "/frames"):
+            self.send_error(404)
+            return
+        binary = self.path == "/frames"
+        self.send_response(200)
+        self.send_header("Content-Type",
+                         "application/octet-stream" if binary else "text/event-stream")
+        self.send_header("Cache-Control", "no-cache")
+        self.send_header("Connection", "close")
+        self.end_headers()
+        try:
+            # Every device on connect, then whatever changes
+            since = 0
+            while True:
+                with state_lock:
+                    changed = changed_since(since)
+                    since = table_seq
+                    if changed:
+                        self._send(changed, binary)
+                    elif binary:
+                        self.wfile.write(encode_keepalive())
+                    else:
+                        self.wfile.write(b":\n\n")
+                    self.wfile.flush()
+                    state_lock.wait(HEARTBEAT)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+    def _send(self, changed, binary):
+        for dev in changed:
+            if binary:
+                self.wfile.write(encode_frame(dev))
+            else:
+                self.wfile.write(f"event: fix\ndata: {encode(dev)}\n\n".encode())
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Fake LoRa GPS receiver")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8080, help="snapshot port")
+    parser.add_argument("--stream-port", type=int, default=8081, help="stream port")
+    parser.add_argument("--devices", type=int, default=3, help="simulated trackers")
+    parser.add_argument("--interval", type=float, default=2.0, help="seconds between fixes")
+    parser.add_argument("--dropout", type=int, default=0,
+                        help="lose each tracker every N fixes, 0 to never")
+    args = parser.parse_args()
+
+    for device in range(1, args.devices+1):
+        threading.Thread(target=sender, args=(device, args.interval, args.dropout),
+                         daemon=True).start()
+
+    snapshot = ThreadingHTTPServer((args.host, args.port), SnapshotHandler)
+    stream = ThreadingHTTPServer((args.host, args.stream_port), StreamHandler)
+    stream.daemon_threads = True
+    threading.Thread(target=snapshot.serve_forever, daemon=True).start()
+    print(f"Serving snapshot on :{args.port}, stream on :{args.stream_port}")
+    try:
+        stream.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()